@@ -9,6 +9,55 @@
 
 #include "args.h"
 #include "options.h"
+#include "logging.h"
+
+/*
+ * Options of the command line that configure the pool: they are
+ * kept to be applied again, before the configuration file, every
+ * time the configuration is loaded.
+ */
+
+static struct {
+    int c;
+    char *arg;
+} *config_args;
+
+static unsigned int nconfig_args;
+
+/*
+ * Keywords of the configuration file, and the options
+ * of the command line they stand for.
+ */
+
+static struct {
+    char *keyword;
+    int c;
+} config_keywords[] = {
+    { "range",       'a' },
+    { "circuits",    'c' },
+    { "hosts",       'H' },
+    { "class",       'k' },
+    { "subnet",      'n' },
+    { "option",      'o' },
+    { "pending",     'p' },
+    { "rapidcommit", 'R' },
+    { "match",       'r' },
+    { "host",        's' },
+    { NULL, 0 }
+};
+
+/*
+ * State of the loading of a configuration.
+ */
+
+struct config_state {
+    client_class *class; // class being configured, NULL if none
+    char *circuits;      // circuits file, loaded once the subnets are known
+};
+
+typedef struct config_state config_state;
+
+static char config_error[4096]; // message of the last error
 
 void usage(char *msg, int exit_status)
 {
@@ -23,42 +72,893 @@ void usage(char *msg, int exit_status)
     exit(exit_status);
 }
  
-void parse_args(int argc, char *argv[], address_pool *pool)
+/*
+ * Add a subnet to the configuration: the subnets after the default
+ * one start with its options and lease times, and the mask of
+ * the subnet.
+ */
+
+static void
+add_subnet (server_config *config, uint32_t network, uint8_t prefix)
+{
+    subnet_pool *subnet;
+
+    config->subnets = realloc(config->subnets, (config->nsubnets + 1) * sizeof(subnet_pool));
+    subnet = &config->subnets[config->nsubnets];
+
+    memset(subnet, 0, sizeof(*subnet));
+    subnet->id      = config->nsubnets++;
+    subnet->network = network;
+    subnet->prefix  = prefix;
+    subnet->netmask = prefix == 0 ? 0 : htonl(~0U << (32 - prefix));
+
+    if (subnet->id == 0) {
+	dhcp_option lease = { IP_ADDRESS_LEASE_TIME, 4 };
+	uint32_t lease_time = htonl(DEFAULT_LEASE_TIME);
+
+	// a pending offer or a lease of zero seconds would expire at once
+
+	memcpy(lease.data, &lease_time, sizeof(lease_time));
+
+	init_option_table(&subnet->options);
+	add_option(&subnet->options, &lease);
+
+	subnet->lease_time   = DEFAULT_LEASE_TIME;
+	subnet->pending_time = DEFAULT_PENDING_TIME;
+	subnet->rapid_commit = 1;
+	return;
+    }
+
+    dhcp_option mask = { SUBNET_MASK, 4 };
+
+    memcpy(mask.data, &subnet->netmask, sizeof(subnet->netmask));
+
+    copy_option_table(&subnet->options, &config->subnets[0].options);
+    add_option(&subnet->options, &mask);
+
+    subnet->lease_time   = config->subnets[0].lease_time;
+    subnet->pending_time = config->subnets[0].pending_time;
+    subnet->rapid_commit = config->subnets[0].rapid_commit;
+}
+
+/*
+ * Parse an agent circuit id or remote id of the circuits file:
+ * "-" (empty, any id), hexadecimal bytes after "0x", or else the
+ * bytes of the string.
+ *
+ * Return the length of the id, -1 on error.
+ */
+
+static int
+parse_agent_id (char *s, uint8_t *id)
+{
+    size_t len = strlen(s);
+    size_t i;
+
+    if (strcmp(s, "-") == 0)
+	return 0;
+
+    if (strncmp(s, "0x", 2) != 0) {
+	if (len > 255)
+	    return -1;
+
+	memcpy(id, s, len);
+	return len;
+    }
+
+    s += 2;
+    len -= 2;
+
+    if (len == 0 || len % 2 != 0 || len / 2 > 255)
+	return -1;
+
+    for (i = 0; i < len; i++) {
+	if (!isxdigit((unsigned char) s[i]))
+	    return -1;
+    }
+
+    for (i = 0; i < len / 2; i++) {
+	char byte[3] = { s[2 * i], s[2 * i + 1], '\0' };
+	id[i] = strtoul(byte, NULL, 16);
+    }
+
+    return len / 2;
+}
+
+/*
+ * Load the circuits of the relay agents from a file, one per line:
+ *
+ *   circuit-id remote-id network/len
+ *   circuit-id remote-id address
+ *
+ * The circuit is served from the addresses of the given subnet
+ * (configured with -n), or gets the given address (reserved in
+ * the subnet it belongs to). Empty lines and lines starting
+ * with # are skipped.
+ *
+ * Return NULL on success, the error message otherwise.
+ */
+
+static char *
+load_circuits (char *path, server_config *config)
+{
+    uint8_t circuit_id[256], remote_id[256];
+    char *line = NULL, *error = NULL;
+    size_t size = 0;
+    unsigned int n = 0;
+    FILE *f;
+
+    if ((f = fopen(path, "re")) == NULL) {
+	snprintf(config_error, sizeof(config_error),
+		 "error: can not open the circuits file %s.", path);
+	return config_error;
+    }
+
+    while (error == NULL && getline(&line, &size, f) != -1) {
+	char *save, *scircuit, *sremote, *starget, *slen, *end = "";
+	relay_agent_info info;
+	uint32_t *address;
+	int circuit_len, remote_len;
+	unsigned int i, subnet;
+	long len = 32;
+
+	n++;
+
+	scircuit = strtok_r(line, " \t\r\n", &save);
+
+	if (scircuit == NULL || scircuit[0] == '#')
+	    continue;
+
+	sremote = strtok_r(NULL, " \t\r\n", &save);
+	starget = strtok_r(NULL, " \t\r\n", &save);
+
+	if (sremote == NULL || starget == NULL || strtok_r(NULL, " \t\r\n", &save) != NULL ||
+	    (circuit_len = parse_agent_id(scircuit, circuit_id)) == -1 ||
+	    (remote_len = parse_agent_id(sremote, remote_id)) == -1) {
+	    error = "error: invalid circuit";
+	    break;
+	}
+
+	if ((slen = strchr(starget, '/')) != NULL) {
+	    *slen = '\0';
+	    len = strtol(slen + 1, &end, 10);
+	}
+
+	if (parse_ip(starget, (void **)&address) != 4) {
+	    error = "error: invalid circuit address";
+	    break;
+	}
+
+	// the subnet of the circuit, or the subnet of its address
+
+	subnet = config->nsubnets;
+
+	for (i = 0; i < config->nsubnets; i++) {
+	    subnet_pool *s = &config->subnets[i];
+
+	    if (slen != NULL ? s->network == *address && s->prefix == len :
+		(*address & s->netmask) == s->network &&
+		(subnet == config->nsubnets || s->prefix > config->subnets[subnet].prefix))
+		subnet = i;
+	}
+
+	info.circuit_id  = circuit_id;
+	info.circuit_len = circuit_len;
+	info.remote_id   = remote_id;
+	info.remote_len  = remote_len;
+
+	if (*end != '\0' || len < 0 || len > 32)
+	    error = "error: invalid circuit address";
+	else if (subnet == config->nsubnets)
+	    error = "error: circuit not in any subnet";
+	else if (add_circuit(&config->circuits, &info, subnet, slen != NULL ? 0 : *address) == -1)
+	    error = "error: circuit specified twice";
+
+	free(address);
+    }
+
+    free(line);
+    fclose(f);
+
+    if (error == NULL)
+	return NULL;
+
+    snprintf(config_error, sizeof(config_error), "%s at %s:%u.", error, path, n);
+    return config_error;
+}
+
+/*
+ * Load the static bindings from a file, one per line:
+ *
+ *   mac address [option,value ...]
+ *
+ * where the hardware address can also be given as a client
+ * identifier of an Ethernet client (01:mac, see RFC 2132), and
+ * the options are sent to the client instead of the ones of its
+ * subnet or class. Empty lines and lines starting with # are
+ * skipped. A hardware address or an address reserved twice is
+ * an error.
+ *
+ * Return NULL on success, the error message otherwise.
+ */
+
+static char *
+load_hosts (char *path, server_config *config)
+{
+    dhcp_option_table options;
+    char *line = NULL, *error = NULL;
+    size_t size = 0;
+    unsigned int n = 0;
+    FILE *f;
+
+    if ((f = fopen(path, "re")) == NULL) {
+	snprintf(config_error, sizeof(config_error),
+		 "error: can not open the static bindings file %s.", path);
+	return config_error;
+    }
+
+    init_option_table(&options);
+
+    while (error == NULL && getline(&line, &size, f) != -1) {
+	char *save, *smac, *sip, *sopt;
+	uint8_t *mac;
+	uint32_t *ip;
+	int ret;
+
+	n++;
+
+	smac = strtok_r(line, " \t\r\n", &save);
+
+	if (smac == NULL || smac[0] == '#')
+	    continue;
+
+	if (strlen(smac) == 20 && strncmp(smac, "01:", 3) == 0)
+	    smac += 3; // client identifier, hardware type 1
+
+	if ((sip = strtok_r(NULL, " \t\r\n", &save)) == NULL ||
+	    parse_mac(smac, (void **)&mac) != 6) {
+	    error = "error: invalid static binding";
+	    break;
+	}
+
+	if (parse_ip(sip, (void **)&ip) != 4) {
+	    error = "error: invalid static binding address";
+	    free(mac);
+	    break;
+	}
+
+	if (options.len > sizeof(option_magic)) {
+	    memset(options.offset, 0, sizeof(options.offset));
+	    options.len = sizeof(option_magic);
+	}
+
+	while (error == NULL && (sopt = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+	    char *value = strchr(sopt, ',');
+	    dhcp_option option;
+
+	    if (value == NULL) {
+		error = "error: comma not present in static binding option";
+		break;
+	    }
+	    *value++ = '\0';
+
+	    if (parse_option(&option, sopt, value) == 0)
+		error = "error: invalid static binding option";
+	    else if (option.id == IP_ADDRESS_LEASE_TIME)
+		error = "error: the lease time does not apply to a static binding";
+	    else if (add_option(&options, &option) == 0 || options.len >= UINT16_MAX)
+		error = "error: too many static binding options";
+	}
+
+	if (error == NULL) {
+	    ret = add_host(&config->hosts, mac, *ip, &options);
+
+	    if (ret == HOST_DUPLICATE_MAC)
+		error = "error: mac address reserved twice";
+	    else if (ret == HOST_DUPLICATE_ADDRESS)
+		error = "error: ip reserved twice";
+	}
+
+	free(mac);
+	free(ip);
+    }
+
+    delete_option_table(&options);
+    free(line);
+    fclose(f);
+
+    if (error == NULL)
+	return NULL;
+
+    snprintf(config_error, sizeof(config_error), "%s at %s:%u.", error, path, n);
+    return config_error;
+}
+
+/*
+ * Add a client class to the configuration, served from the given
+ * subnet (an index of the subnets, -1 if none).
+ */
+
+static client_class *
+add_class (server_config *config, char *name, long subnet)
+{
+    client_class *class;
+
+    config->classes = realloc(config->classes, (config->nclasses + 1) * sizeof(client_class));
+    class = &config->classes[config->nclasses];
+
+    memset(class, 0, sizeof(*class));
+    class->id     = config->nclasses++;
+    class->subnet = subnet;
+    strncpy(class->name, name, sizeof(class->name) - 1);
+
+    init_option_table(&class->options);
+
+    return class;
+}
+
+/*
+ * Apply an option of the command line (or a line of the
+ * configuration file) that configures the pool.
+ *
+ * Return NULL on success, the error message otherwise.
+ */
+
+static char *
+config_option (server_config *config, config_state *state, int c, char *arg)
+{
+    subnet_pool *subnet = &config->subnets[config->nsubnets - 1]; // subnet being configured
+    char opt[1024];
+
+    if (strlen(arg) >= sizeof(opt))
+	return "error: option value too long.";
+
+    strcpy(opt, arg);
+
+    if (state->class != NULL && (c == 'a' || c == 'p' || c == 'R'))
+	return "error: options -a, -p and -R do not apply to a client class.";
+
+    switch (c) {
+
+    case 'a': // parse IP address pool
+	{
+	    char *sfirst = opt;
+	    char *slast  = strchr(opt, ',');
+	    uint32_t *first, *last;
+	    char *error = NULL;
+
+	    if (slast == NULL)
+		return "error: comma not present in option -a.";
+	    *slast = '\0';
+	    slast++;
+
+	    if (parse_ip(sfirst, (void **)&first) != 4)
+		return "error: invalid first ip in address pool.";
+
+	    if (parse_ip(slast, (void **)&last) != 4) {
+		free(first);
+		return "error: invalid last ip in address pool.";
+	    }
+
+	    if ((*first & subnet->netmask) != subnet->network ||
+		(*last & subnet->netmask) != subnet->network) {
+		error = "error: address pool outside of its subnet.";
+	    } else {
+		subnet->indexes.first   = *first;
+		subnet->indexes.last    = *last;
+		subnet->indexes.current = *first;
+	    }
+
+	    free(first);
+	    free(last);
+
+	    return error;
+	}
+
+    case 'c': // circuits of the relay agents, loaded once the subnets are known
+	{
+	    free(state->circuits);
+	    state->circuits = strdup(arg);
+	    return NULL;
+	}
+
+    case 'k': // parse client class
+	{
+	    char *snet = strchr(opt, ',');
+	    long id = -1;
+	    unsigned int i;
+
+	    if (snet != NULL) {
+		char *slen = strchr(snet + 1, '/');
+		uint32_t *network;
+
+		*snet = '\0';
+		snet++;
+
+		if (slen == NULL)
+		    return "error: prefix length not present in option -k.";
+		*slen = '\0';
+		slen++;
+
+		if (parse_ip(snet, (void **)&network) != 4)
+		    return "error: invalid subnet address in option -k.";
+
+		for (i = 1; i < config->nsubnets; i++) {
+		    if (config->subnets[i].network == *network &&
+			config->subnets[i].prefix == strtol(slen, NULL, 10))
+			id = i;
+		}
+
+		free(network);
+
+		if (id == -1)
+		    return "error: the subnet of a client class must be specified before it.";
+	    }
+
+	    if (*opt == '\0')
+		return "error: empty client class name.";
+
+	    for (i = 0; i < config->nclasses; i++) {
+		if (strcmp(config->classes[i].name, opt) == 0)
+		    return "error: client class specified twice.";
+	    }
+
+	    if (config->nclasses == 0xfffe)
+		return "error: too many client classes specified.";
+
+	    state->class = add_class(config, opt, id);
+	    return NULL;
+	}
+
+    case 'n': // parse subnet
+	{
+	    char *slen = strchr(opt, '/');
+	    uint32_t *network, address;
+	    unsigned int i;
+	    char *end;
+	    long len;
+
+	    if (slen == NULL)
+		return "error: prefix length not present in option -n.";
+	    *slen = '\0';
+	    slen++;
+
+	    if (parse_ip(opt, (void **)&network) != 4)
+		return "error: invalid subnet address.";
+
+	    address = *network;
+	    free(network);
+
+	    len = strtol(slen, &end, 10);
+
+	    if (*slen == '\0' || *end != '\0' || len < 1 || len > 32)
+		return "error: invalid subnet prefix length.";
+
+	    if ((address & htonl(~0U << (32 - len))) != address)
+		return "error: subnet address with host bits set.";
+
+	    for (i = 1; i < config->nsubnets; i++) {
+		if (config->subnets[i].network == address && config->subnets[i].prefix == len)
+		    return "error: subnet specified twice.";
+	    }
+
+	    add_subnet(config, address, len);
+	    state->class = NULL;
+	    return NULL;
+	}
+
+    case 'o': // parse dhcp option
+	{
+	    char *name  = opt;
+	    char *value = strchr(opt, ',');
+	    dhcp_option option;
+
+	    if (value == NULL)
+		return "error: comma not present in option -o.";
+	    *value = '\0';
+	    value++;
+
+	    if (parse_option(&option, name, value) == 0) {
+		snprintf(config_error, sizeof(config_error),
+			 "error: invalid dhcp option specified: %s,%s",
+			 name, value);
+		return config_error;
+	    }
+
+	    if (state->class != NULL && option.id == IP_ADDRESS_LEASE_TIME)
+		return "error: the lease time does not apply to a client class.";
+
+	    if (option.id == IP_ADDRESS_LEASE_TIME && *((uint32_t *)option.data) == 0)
+		return "error: invalid lease time.";
+
+	    if (add_option(state->class != NULL ? &state->class->options : &subnet->options,
+			   &option) == 0)
+		return "error: too many dhcp options specified.";
+
+	    if (option.id == IP_ADDRESS_LEASE_TIME)
+		subnet->lease_time = ntohl(*((uint32_t *)option.data));
+
+	    return NULL;
+	}
+
+    case 'p': // parse pending time
+	{
+	    uint32_t *t;
+
+	    if (parse_long(opt, (void **)&t) != 4 || *t == 0) {
+		free(t);
+		return "error: invalid pending time.";
+	    }
+
+	    subnet->pending_time = ntohl(*t); // parsed in network order
+	    free(t);
+	    return NULL;
+	}
+
+    case 'R': // parse rapid commit
+	{
+	    if (strcmp(opt, "on") == 0)
+		subnet->rapid_commit = 1;
+	    else if (strcmp(opt, "off") == 0)
+		subnet->rapid_commit = 0;
+	    else
+		return "error: invalid rapid commit, on or off expected.";
+
+	    return NULL;
+	}
+
+    case 'r': // parse match rule of a client class
+	{
+	    char *value = strchr(opt, ':');
+	    uint8_t *oui = NULL;
+	    int prefix = 0;
+	    size_t len;
+	    uint8_t type;
+	    int ret;
+
+	    if (state->class == NULL)
+		return "error: option -r given before any client class.";
+
+	    if (value == NULL)
+		return "error: colon not present in option -r.";
+	    value++;
+	    len = strlen(value);
+
+	    if (strncmp(opt, "vendor:", 7) == 0)
+		type = CLASS_VENDOR;
+	    else if (strncmp(opt, "user:", 5) == 0)
+		type = CLASS_USER;
+	    else if (strncmp(opt, "oui:", 4) == 0)
+		type = CLASS_OUI;
+	    else
+		return "error: invalid match rule type.";
+
+	    if (type == CLASS_OUI) {
+		char mac[18];
+
+		snprintf(mac, sizeof(mac), "%s:00:00:00", value);
+
+		if (len != 8 || parse_mac(mac, (void **)&oui) != 6)
+		    return "error: invalid OUI in match rule.";
+
+		value = (char *) oui;
+		len = 3;
+
+	    } else if (len > 0 && value[len - 1] == '*') {
+		prefix = 1;
+		len--;
+	    }
+
+	    if (len > 255)
+		return "error: match rule value too long.";
+
+	    ret = add_class_rule(&config->matcher, type, (uint8_t *) value, len,
+				 prefix, state->class->id);
+	    free(oui);
+
+	    if (ret == -1)
+		return "error: match rule specified for two client classes.";
+
+	    return NULL;
+	}
+
+    case 's': // static binding
+	{
+	    char *shw  = opt;
+	    char *sip  = strchr(opt, ',');
+	    uint32_t *ip;
+	    uint8_t  *hw;
+	    int ret;
+
+	    if (sip == NULL)
+		return "error: comma not present in option -s.";
+	    *sip = '\0';
+	    sip++;
+
+	    if (parse_mac(shw, (void **)&hw) != 6)
+		return "error: invalid mac address in static binding.";
+
+	    if (parse_ip(sip, (void **)&ip) != 4) {
+		free(hw);
+		return "error: invalid ip in static binding.";
+	    }
+
+	    ret = add_host(&config->hosts, hw, *ip, NULL);
+
+	    free(ip);
+	    free(hw);
+
+	    if (ret == HOST_DUPLICATE_MAC)
+		return "error: static binding of a mac address specified twice.";
+	    if (ret == HOST_DUPLICATE_ADDRESS)
+		return "error: static binding of an ip specified twice.";
+
+	    return NULL;
+	}
+
+    case 'H': // static bindings file
+	{
+	    return load_hosts(arg, config);
+	}
+
+    }
+
+    return "error: invalid option.";
+}
+
+/*
+ * Apply the lines of the configuration file: a keyword (see
+ * config_keywords) and its value, the same of the corresponding
+ * option of the command line. Empty lines and lines starting
+ * with # are skipped.
+ *
+ * Return NULL on success, the error message otherwise.
+ */
+
+static char *
+load_config_file (char *path, server_config *config, config_state *state)
+{
+    char *line = NULL, *error = NULL, msg[sizeof(config_error)];
+    size_t size = 0;
+    unsigned int n = 0;
+    FILE *f;
+
+    if ((f = fopen(path, "re")) == NULL) {
+	snprintf(config_error, sizeof(config_error),
+		 "error: can not open the configuration file %s.", path);
+	return config_error;
+    }
+
+    while (error == NULL && getline(&line, &size, f) != -1) {
+	char *keyword = line, *value, *end;
+	int i;
+
+	n++;
+
+	while (isspace((unsigned char) *keyword))
+	    keyword++;
+
+	if (*keyword == '\0' || *keyword == '#')
+	    continue;
+
+	for (value = keyword; *value != '\0' && !isspace((unsigned char) *value); value++)
+	    ;
+
+	if (*value != '\0')
+	    *value++ = '\0';
+
+	while (isspace((unsigned char) *value))
+	    value++;
+
+	for (end = value + strlen(value); end > value && isspace((unsigned char) end[-1]); end--)
+	    ;
+	*end = '\0';
+
+	for (i = 0; config_keywords[i].keyword != NULL; i++) {
+	    if (strcmp(config_keywords[i].keyword, keyword) == 0)
+		break;
+	}
+
+	if (config_keywords[i].keyword == NULL)
+	    error = "error: unknown keyword.";
+	else if (*value == '\0')
+	    error = "error: value not present.";
+	else
+	    error = config_option(config, state, config_keywords[i].c, value);
+    }
+
+    free(line);
+    fclose(f);
+
+    if (error == NULL)
+	return NULL;
+
+    snprintf(msg, sizeof(msg), "%s:%u: %s", path, n, error);
+    strcpy(config_error, msg);
+
+    return config_error;
+}
+
+/*
+ * Index the subnets by prefix. The default subnet is left out if
+ * it has no addresses and other subnets are configured, so that the
+ * requests of the other networks are not answered.
+ */
+
+static char *
+index_subnets (server_config *config)
+{
+    char network[INET_ADDRSTRLEN], last[INET_ADDRSTRLEN];
+    unsigned int i;
+
+    for (i = 0; i < config->nsubnets; i++) {
+	subnet_pool *subnet = &config->subnets[i];
+
+	if (i == 0 && subnet->indexes.first == 0 && config->nsubnets > 1)
+	    continue;
+
+	if (add_prefix(&config->lookup, subnet->network, subnet->prefix, i) == -1)
+	    return "error: can not index the subnets.";
+
+	if (subnet->indexes.first != 0) {
+	    strcpy(network, str_ip(subnet->network));
+	    strcpy(last, str_ip(subnet->indexes.last));
+	    log_info("Subnet %s/%u: addresses %s - %s", network, subnet->prefix,
+		     str_ip(subnet->indexes.first), last);
+	}
+    }
+
+    return NULL;
+}
+
+static int
+compare_addresses (const void *a, const void *b)
+{
+    uint32_t x = ntohl(*(const uint32_t *) a);
+    uint32_t y = ntohl(*(const uint32_t *) b);
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Sort the addresses reserved to the circuits: a reload looks up
+ * the bindings it keeps with a binary search (see apply_config
+ * in dhcpserver.c).
+ */
+
+static void
+sort_reserved (server_config *config)
+{
+    unsigned int i;
+
+    config->reserved = calloc(config->circuits.count + 1, sizeof(uint32_t));
+
+    for (i = 0; i < config->circuits.count; i++) {
+	if (config->circuits.circuits[i].address != 0)
+	    config->reserved[config->nreserved++] = config->circuits.circuits[i].address;
+    }
+
+    qsort(config->reserved, config->nreserved, sizeof(uint32_t), compare_addresses);
+
+    config->owners = calloc(config->nreserved + 1, sizeof(circuit_owner));
+}
+
+/*
+ * Load a new configuration: the options of the command line that
+ * configure the pool, then the configuration file (if any).
+ *
+ * Return the configuration, NULL on error (with the message in error).
+ */
+
+server_config *
+load_config (server_settings *settings, char **error)
+{
+    static unsigned int generation;
+    server_config *config = calloc(1, sizeof(server_config));
+    config_state state = { NULL, NULL };
+    unsigned int i;
+
+    *error = NULL;
+    config->generation = ++generation;
+
+    init_prefix_table(&config->lookup);
+    init_circuit_table(&config->circuits);
+    init_class_matcher(&config->matcher);
+    init_host_table(&config->hosts);
+
+    add_subnet(config, 0, 0); // default subnet
+
+    for (i = 0; *error == NULL && i < nconfig_args; i++)
+	*error = config_option(config, &state, config_args[i].c, config_args[i].arg);
+
+    if (*error == NULL && settings->config_file != NULL)
+	*error = load_config_file(settings->config_file, config, &state);
+
+    if (*error == NULL && state.circuits != NULL)
+	*error = load_circuits(state.circuits, config);
+
+    if (*error == NULL)
+	*error = index_subnets(config);
+
+    if (*error == NULL)
+	sort_reserved(config);
+
+    free(state.circuits);
+
+    if (*error != NULL) {
+	delete_config(config);
+	return NULL;
+    }
+
+    return config;
+}
+
+void
+delete_config (server_config *config)
+{
+    unsigned int i;
+
+    for (i = 0; i < config->nsubnets; i++)
+	delete_option_table(&config->subnets[i].options);
+
+    for (i = 0; i < config->nclasses; i++)
+	delete_option_table(&config->classes[i].options);
+
+    delete_prefix_table(&config->lookup);
+    delete_circuit_table(&config->circuits);
+    delete_class_matcher(&config->matcher);
+    delete_host_table(&config->hosts);
+
+    free(config->subnets);
+    free(config->classes);
+    free(config->reserved);
+    free(config->owners);
+    free(config);
+}
+
+void parse_args(int argc, char *argv[], address_pool *pool, server_settings *settings)
 {
     int c;
 
     opterr = 0;
 
-    while ((c = getopt (argc, argv, "a:d:o:p:s:")) != -1)
+    while ((c = getopt (argc, argv, "a:b:c:C:d:f:H:j:k:l:m:n:o:p:r:R:s:t:w:x:")) != -1) {
+
 	switch (c) {
 
-	case 'a': // parse IP address pool
+	case 'a': // options of the pool, applied when the configuration is loaded
+	case 'c':
+	case 'H':
+	case 'k':
+	case 'n':
+	case 'o':
+	case 'p':
+	case 'r':
+	case 'R':
+	case 's':
 	    {
-		char *opt    = strdup(optarg);
-		char *sfirst = opt;
-		char *slast  = strchr(opt, ',');
-	    
-		if (slast == NULL)
-		    usage("error: comma not present in option -a.", 1);
-		*slast = '\0';
-		slast++;
-	    
-		uint32_t *first, *last;
-		
-		if (parse_ip(sfirst, (void **)&first) != 4)
-		    usage("error: invalid first ip in address pool.", 1);
-		
-		if (parse_ip(slast, (void **)&last) != 4)
-		    usage("error: invalid last ip in address pool.", 1);
-
-		pool->indexes.first   = *first;
-		pool->indexes.last    = *last;
-		pool->indexes.current = *first;
-		
-		free(first);
-		free(last);
-		free(opt);
-		
+		config_args = realloc(config_args, (nconfig_args + 1) * sizeof(*config_args));
+		config_args[nconfig_args].c   = c;
+		config_args[nconfig_args].arg = optarg;
+		nconfig_args++;
+		break;
+	    }
+
+	case 'b': // parse batch size
+	    {
+		char *end;
+		long n = strtol(optarg, &end, 0);
+
+		if (*optarg == '\0' || *end != '\0' || n < 1 || n > UIO_MAXIOV)
+		    usage("error: invalid batch size.", 1);
+
+		settings->batch_size = n;
+		break;
+	    }
+
+	case 'C': // configuration file
+	    {
+		settings->config_file = strdup(optarg);
 		break;
 	    }
 
@@ -67,88 +967,101 @@ void parse_args(int argc, char *argv[], address_pool *pool)
 		strncpy(pool->device, optarg, sizeof(pool->device));
 		break;
 	    }
-	    
-	case 'o': // parse dhcp option
+
+	case 'f': // parse flush timeout
 	    {
-		uint8_t id;
-
-		char *opt   = strdup(optarg);
-		char *name  = opt;
-		char *value = strchr(opt, ',');
-		
-		if (value == NULL)
-		    usage("error: comma not present in option -o.", 1);
-		*value = '\0';
-		value++;
-		
-		dhcp_option *option = calloc(1, sizeof(*option));
-		
-		if((id = parse_option(option, name, value)) == 0) {
-		    char msg[128];
-		    snprintf(msg, sizeof(msg),
-			     "error: invalid dhcp option specified: %s,%s",
-			     name, value);
-		    usage(msg, 1);
-		}
-		
-		append_option(&pool->options, option);
+		char *end;
+		long n = strtol(optarg, &end, 0);
 
-		if(option->id == IP_ADDRESS_LEASE_TIME)
-		    pool->lease_time = ntohl(*((uint32_t *)option->data));
+		if (*optarg == '\0' || *end != '\0' || n < 0 || n > 60000)
+		    usage("error: invalid flush timeout.", 1);
 
-		free(option);
-		free(opt);
+		settings->flush_timeout = n;
 		break;
 	    }
 
-	case 'p': // parse pending time
+	case 'j': // lease journal
 	    {
-		time_t *t;
+		settings->journal = strdup(optarg);
+		break;
+	    }
 
-		if(parse_long(optarg, (void **)&t) != 4)
-		    usage("error: invalid pending time.", 1);
+	case 'l': // parse log level
+	    {
+		if (strcmp(optarg, "error") == 0)
+		    settings->log_level = LOG_ERROR;
+		else if (strcmp(optarg, "info") == 0)
+		    settings->log_level = LOG_INFO;
+		else if (strcmp(optarg, "debug") == 0)
+		    settings->log_level = LOG_DEBUG;
+		else
+		    usage("error: invalid log level.", 1);
+		break;
+	    }
 
-		pool->pending_time = *t;
-		free(t);
+	case 'm': // parse metrics port
+	    {
+		char *end;
+		long n = strtol(optarg, &end, 0);
+
+		if (*optarg == '\0' || *end != '\0' || n < 1 || n > 65535)
+		    usage("error: invalid metrics port.", 1);
+
+		settings->metrics_port = n;
 		break;
 	    }
 
-	case 's': // static binding
+	case 't': // parse transmit mode
 	    {
-		char *opt = strdup(optarg);
-		char *shw  = opt;
-		char *sip  = strchr(opt, ',');
-		
-		if (sip == NULL)
-		    usage("error: comma not present in option -s.", 1);
-		*sip = '\0';
-		    sip++;
-		
-		uint32_t *ip;
-		uint8_t  *hw;
-		
-		if (parse_mac(shw, (void **)&hw) != 6)
-		    usage("error: invalid mac address in static binding.", 1);
-		
-		if (parse_ip(sip, (void **)&ip) != 4)
-		    usage("error: invalid ip in static binding.", 1);
-		
-		add_binding(&pool->bindings, *ip, hw, 6, 1);
-		
-		free(ip);
-		free(hw);
-		free(opt);
+		if (strcmp(optarg, "udp") == 0)
+		    settings->tx_mode = TX_UDP;
+		else if (strcmp(optarg, "packet") == 0)
+		    settings->tx_mode = TX_PACKET;
+		else if (strcmp(optarg, "ring") == 0)
+		    settings->tx_mode = TX_RING;
+		else
+		    usage("error: invalid transmit mode.", 1);
 		break;
 	    }
-	    
+
+	case 'w': // parse number of workers
+	    {
+		char *end;
+		long n = strtol(optarg, &end, 0);
+
+		if (*optarg == '\0' || *end != '\0' || n < 1 || n > 256)
+		    usage("error: invalid number of workers.", 1);
+
+		settings->workers = n;
+		break;
+	    }
+
+	case 'x': // parse AF_XDP backend mode
+	    {
+		if (strcmp(optarg, "skb") == 0)
+		    settings->xdp_mode = XDP_MODE_SKB;
+		else if (strcmp(optarg, "native") == 0)
+		    settings->xdp_mode = XDP_MODE_NATIVE;
+		else
+		    usage("error: invalid XDP mode.", 1);
+		break;
+	    }
+
 	case '?':
 	default:
 	    usage(NULL, 1);
 	}
+    }
 
     if(optind >= argc)
 	usage("error: server address not provided.", 1);
 
+    if(settings->tx_mode != TX_UDP && pool->device[0] == '\0')
+	usage("error: a network device is required to send raw frames.", 1);
+
+    if(settings->xdp_mode != XDP_MODE_NONE && pool->device[0] == '\0')
+	usage("error: a network device is required by the XDP backend.", 1);
+
     uint32_t *ip;
 
     if (parse_ip(argv[optind], (void **)&ip) != 4)
@@ -8,19 +8,69 @@
 
 #define USAGE_TXT							\
     NAME " - " VERSION "\n"						\
-    "usage: [-a first,last] [-d device] [-o opt,value]\n"		\
-    "       [-p time] [-s mac,ip] server_address\n"
+    "usage: [-a first,last] [-b size] [-c file] [-C file] [-d device]\n"	\
+    "       [-f time] [-H file] [-j file] [-k class[,network/len]]\n"	\
+    "       [-l level] [-m port] [-n network/len] [-o opt,value]\n"	\
+    "       [-p time] [-r type:value] [-R on|off] [-s mac,ip]\n"	\
+    "       [-t mode] [-w workers] [-x mode] server_address\n"
 
 /* 
  * Usage description:
- *  -a: specify the pool of free addresses to allocate
+ *  -a: specify the pool of free addresses to allocate, in the subnet
+ *  -b: max messages received or sent with one system call
+ *  -c: circuits of the relay agents (option 82), one per line:
+ *      "circuit-id remote-id network/len" to serve the circuit from
+ *      a subnet, or "circuit-id remote-id address" to reserve it
+ *      an address; an id is a string, hex bytes after 0x, or -
+ *      to match any id
+ *  -C: configuration file, one setting per line: "subnet", "range",
+ *      "option", "pending", "rapidcommit", "host", "hosts", "class",
+ *      "match" or "circuits" followed by the value of -n, -a, -o, -p,
+ *      -R, -s, -H, -k, -r or -c;
+ *      applied after the options of the command line, and loaded
+ *      again on SIGHUP (the leases of the addresses that are still
+ *      in their range are kept)
  *  -d: network device name to use
- *  -o: specify a DHCP option for the pool
- *  -p: time in the pending state (in seconds)
- *  -s: specify a static binding
+ *  -f: max time to wait to fill a batch (in milliseconds)
+ *  -H: static bindings, one per line: "mac address [opt,value ...]",
+ *      the mac also as a client identifier (01:mac); the options are
+ *      sent to the client instead of the ones of its subnet or class.
+ *      A mac address or an address reserved twice is an error
+ *  -j: journal of the leases, restored on start (the segments
+ *      are named file.N, the snapshot of the bindings file.snap)
+ *  -k: start the configuration of a client class, served from the
+ *      given subnet (if any): the options -o and -r given after it,
+ *      up to the next -k or -n, apply to the class
+ *  -l: level of the events logged: error, info (default) or
+ *      debug; changed at runtime with SIGUSR1 (up) and SIGUSR2 (down)
+ *  -m: serve the metrics in the Prometheus text format on
+ *      this TCP port of the loopback address
+ *  -n: start the configuration of a subnet: the options -a, -o, -p
+ *      and -R given after it apply to the subnet (before any -n, to the
+ *      default subnet, whose options and times the subnets inherit)
+ *  -o: specify a DHCP option for the pool, in the subnet or class
+ *      (the lease time, IP_ADDRESS_LEASE_TIME, is 3600 by default)
+ *  -p: time in the pending state (in seconds, 30 by default),
+ *      in the subnet
+ *  -r: match rule of a client class: vendor:value (option 60),
+ *      user:value (option 77), where a value ending with * matches
+ *      the values starting with it, or oui:xx:xx:xx (hardware
+ *      address); the first class matched by a request applies
+ *  -R: rapid commit (RFC 4039), in the subnet: a discover with
+ *      option 80 is answered with an ack, committing the lease
+ *      without the request (on by default)
+ *  -s: specify a static binding (see -H)
+ *  -t: transmit mode of the replies: udp (default), packet
+ *      (raw frames) or ring (raw frames through a transmit ring)
+ *  -w: number of worker threads
+ *  -x: receive and send through AF_XDP sockets, with the XDP
+ *      program in skb (generic) or native mode
  */
 
 /* Prototypes */
 
 void usage(char *msg, int exit_status);
-void parse_args(int argc, char *argv[], address_pool *pool);
+void parse_args(int argc, char *argv[], address_pool *pool, server_settings *settings);
+
+server_config *load_config (server_settings *settings, char **error);
+void delete_config (server_config *config);
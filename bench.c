@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+
+#include "options.h"
+#include "bindings.h"
+#include "classes.h"
+
+/*
+ * Micro-benchmarks of the hot paths of the server: the parsing and
+ * writing of the options of a message, the matching of the client
+ * classes and the binding table at several sizes.
+ *
+ * Every benchmark prints the time per operation, the allocations
+ * per operation (malloc, calloc and realloc are wrapped at link
+ * time, see the Makefile) and the resident set size of the process
+ * once the benchmark has run. The binding benchmarks of every
+ * table size run in their own process, so their RSS is not mixed
+ * with the one of the other sizes.
+ */
+
+enum {
+    OPTION_OPS  = 5000000, // operations of an option benchmark
+    LOOKUP_OPS  = 2000000, // lookups of a binding benchmark
+    ALLOC_ROUND = 500      // bindings created between two cleanups
+};
+
+static uint64_t allocations; // calls to the allocation functions
+
+static volatile uintptr_t sink; // keeps the results alive
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t n, size_t size);
+void *__real_realloc (void *p, size_t size);
+
+void *
+__wrap_malloc (size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc (size_t n, size_t size)
+{
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc (void *p, size_t size)
+{
+    allocations++;
+    return __real_realloc(p, size);
+}
+
+/*
+ * Options of the DISCOVER messages of common clients, as they
+ * are sent (magic cookie included).
+ */
+
+static uint8_t windows_discover[] = {
+    0x63, 0x82, 0x53, 0x63,
+    DHCP_MESSAGE_TYPE, 1, DHCP_DISCOVER,
+    CLIENT_IDENTIFIER, 7, 1, 0x00, 0x15, 0x5d, 0x4a, 0x10, 0x2c,
+    HOST_NAME, 15, 'D', 'E', 'S', 'K', 'T', 'O', 'P', '-', '4', 'F', '2', 'K', '9', 'Q', 'X',
+    VENDOR_CLASS_IDENTIFIER, 8, 'M', 'S', 'F', 'T', ' ', '5', '.', '0',
+    PARAMETER_REQUEST_LIST, 14, 1, 3, 6, 15, 31, 33, 43, 44, 46, 47, 119, 121, 249, 252,
+    END
+};
+
+static uint8_t android_discover[] = {
+    0x63, 0x82, 0x53, 0x63,
+    DHCP_MESSAGE_TYPE, 1, DHCP_DISCOVER,
+    CLIENT_IDENTIFIER, 7, 1, 0xa2, 0x7c, 0x31, 0x0e, 0x5b, 0x90,
+    MAXIMUM_DHCP_MESSAGE_SIZE, 2, 0x05, 0xdc,
+    VENDOR_CLASS_IDENTIFIER, 15, 'a', 'n', 'd', 'r', 'o', 'i', 'd', '-', 'd', 'h', 'c', 'p', '-', '1', '3',
+    HOST_NAME, 7, 'P', 'i', 'x', 'e', 'l', '-', '7',
+    PARAMETER_REQUEST_LIST, 12, 1, 3, 6, 15, 26, 28, 51, 58, 59, 43, 114, 108,
+    END
+};
+
+static uint8_t ios_discover[] = {
+    0x63, 0x82, 0x53, 0x63,
+    DHCP_MESSAGE_TYPE, 1, DHCP_DISCOVER,
+    PARAMETER_REQUEST_LIST, 12, 1, 121, 3, 6, 15, 108, 114, 119, 252, 95, 44, 46,
+    MAXIMUM_DHCP_MESSAGE_SIZE, 2, 0x05, 0xdc,
+    CLIENT_IDENTIFIER, 7, 1, 0x3e, 0x22, 0xfb, 0x70, 0x16, 0x0d,
+    REQUESTED_IP_ADDRESS, 4, 192, 168, 1, 57,
+    IP_ADDRESS_LEASE_TIME, 4, 0x00, 0x76, 0xa7, 0x00,
+    HOST_NAME, 6, 'i', 'P', 'h', 'o', 'n', 'e',
+    END
+};
+
+static struct {
+    char *name;
+    uint8_t *opts;
+    size_t len;
+} profiles[] = {
+    { "windows", windows_discover, sizeof(windows_discover) },
+    { "android", android_discover, sizeof(android_discover) },
+    { "ios",     ios_discover,     sizeof(ios_discover) }
+};
+
+#define NPROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+/*
+ * Options of the pool, as configured by launch_server.sh.
+ */
+
+static char *pool_options[][2] = {
+    { "ROUTER",                  "192.168.1.1" },
+    { "SUBNET_MASK",             "255.255.255.0" },
+    { "IP_ADDRESS_LEASE_TIME",   "3600" },
+    { "RENEWAL_T1_TIME_VALUE",   "1800" },
+    { "REBINDING_T2_TIME_VALUE", "3150" },
+    { "BROADCAST_ADDRESS",       "192.168.1.255" },
+    { "DOMAIN_NAME",             "example.org" },
+    { "DOMAIN_NAME_SERVER",      "192.168.1.1 8.8.8.8" }
+};
+
+#define NPOOL_OPTIONS (sizeof(pool_options) / sizeof(pool_options[0]))
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Resident set size of the process, in megabytes.
+ */
+
+static double
+rss_mb (void)
+{
+    unsigned long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (f != NULL) {
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+	    resident = 0;
+	fclose(f);
+    }
+
+    return (double) resident * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static void
+report (char *name, char *variant, uint64_t ns, uint64_t allocs, uint64_t ops)
+{
+    char label[64];
+
+    snprintf(label, sizeof(label), "%s/%s", name, variant);
+
+    printf("%-36s %10.1f ns/op %8.3f allocs/op %9.1f MB rss\n", label,
+	   (double) ns / ops, (double) allocs / ops, rss_mb());
+}
+
+/*
+ * Option benchmarks.
+ */
+
+static void
+bench_parse (void)
+{
+    dhcp_option_table table;
+    unsigned int p, i;
+
+    for (p = 0; p < NPROFILES; p++) {
+	uint64_t allocs = allocations, start = now_ns();
+
+	for (i = 0; i < OPTION_OPS; i++) {
+	    sink += parse_options_to_table(&table, profiles[p].opts, profiles[p].len);
+	    sink += table.offset[PARAMETER_REQUEST_LIST];
+	}
+
+	report("parse_options_to_table", profiles[p].name,
+	       now_ns() - start, allocations - allocs, OPTION_OPS);
+    }
+}
+
+/*
+ * Write the options of a reply that does not depend on the client:
+ * message type and server identifier, then the END option.
+ */
+
+static void
+bench_serialize (void)
+{
+    dhcp_option type_opt = { DHCP_MESSAGE_TYPE, 1, { DHCP_OFFER } };
+    dhcp_option server_id_opt = { SERVER_IDENTIFIER, 4, { 192, 168, 1, 1 } };
+    dhcp_option_buffer buffer;
+    uint8_t buf[312];
+    unsigned int i;
+
+    uint64_t allocs = allocations, start = now_ns();
+
+    for (i = 0; i < OPTION_OPS; i++) {
+	init_option_buffer(&buffer, buf, sizeof(buf));
+	write_option(&buffer, &type_opt);
+	write_option(&buffer, &server_id_opt);
+	sink += finish_option_buffer(&buffer);
+    }
+
+    report("write_option", "reply", now_ns() - start, allocations - allocs, OPTION_OPS);
+}
+
+static void
+bench_fill_requested (dhcp_option_table *pool_opts)
+{
+    dhcp_option_table *tables[] = { pool_opts, NULL };
+    dhcp_option_table table;
+    dhcp_option_buffer buffer;
+    uint8_t buf[312];
+    unsigned int p, i;
+
+    for (p = 0; p < NPROFILES; p++) {
+	parse_options_to_table(&table, profiles[p].opts, profiles[p].len);
+
+	dhcp_option *requested = search_option(&table, PARAMETER_REQUEST_LIST);
+	uint64_t allocs = allocations, start = now_ns();
+
+	for (i = 0; i < OPTION_OPS; i++) {
+	    init_option_buffer(&buffer, buf, sizeof(buf));
+	    fill_requested_dhcp_options(tables, requested, &buffer);
+	    sink += buffer.len;
+	}
+
+	report("fill_requested_dhcp_options", profiles[p].name,
+	       now_ns() - start, allocations - allocs, OPTION_OPS);
+    }
+}
+
+/*
+ * Client class benchmarks: the user class of a Windows client (the
+ * option as a whole) and of an RFC 3004 client (length prefixed
+ * items), checked against the class expected before being timed.
+ */
+
+static uint8_t windows_user_class[] = { 'c', 'o', 'r', 'p' };
+static uint8_t rfc3004_user_class[] = { 4, 'i', 'P', 'X', 'E', 3, 'f', 'o', 'o' };
+
+static struct {
+    char *name;
+    uint8_t *value;
+    size_t len;
+    long class;
+} user_classes[] = {
+    { "windows", windows_user_class, sizeof(windows_user_class), 0 },
+    { "rfc3004", rfc3004_user_class, sizeof(rfc3004_user_class), 1 }
+};
+
+#define NUSER_CLASSES (sizeof(user_classes) / sizeof(user_classes[0]))
+
+static int
+bench_match_user_class (void)
+{
+    class_matcher matcher;
+    unsigned int p, i;
+
+    init_class_matcher(&matcher);
+    add_class_rule(&matcher, CLASS_USER, (uint8_t *) "corp", 4, 0, 0);
+    add_class_rule(&matcher, CLASS_USER, (uint8_t *) "foo", 3, 0, 1);
+    add_class_rule(&matcher, CLASS_USER, (uint8_t *) "iPXE-", 5, 1, 2);
+
+    for (p = 0; p < NUSER_CLASSES; p++) {
+	long class = match_user_class(&matcher, user_classes[p].value, user_classes[p].len);
+
+	if (class != user_classes[p].class) {
+	    fprintf(stderr, "match_user_class/%s: class %ld, expected %ld\n",
+		    user_classes[p].name, class, user_classes[p].class);
+	    return -1;
+	}
+
+	uint64_t allocs = allocations, start = now_ns();
+
+	for (i = 0; i < OPTION_OPS; i++)
+	    sink += match_user_class(&matcher, user_classes[p].value, user_classes[p].len);
+
+	report("match_user_class", user_classes[p].name,
+	       now_ns() - start, allocations - allocs, OPTION_OPS);
+    }
+
+    delete_class_matcher(&matcher);
+
+    return 0;
+}
+
+/*
+ * Binding benchmarks.
+ *
+ * The clients are identified by hardware addresses derived from
+ * their number, scattered like real ones; the unknown clients
+ * have another prefix.
+ */
+
+static void
+client_mac (uint8_t *mac, uint32_t n, int known)
+{
+    uint32_t x = n * 0x9e3779b1;
+
+    mac[0] = known ? 0x02 : 0x06;
+    mac[1] = 0x00;
+    memcpy(mac + 2, &x, sizeof(x));
+}
+
+/*
+ * Fill a binding list with size pending dynamic bindings, in a pool
+ * range twice as large.
+ */
+
+static void
+fill_binding_list (binding_list *list, pool_indexes *indexes, uint32_t size)
+{
+    uint8_t mac[6];
+    uint32_t n;
+
+    init_binding_list(list);
+
+    indexes->first   = htonl(0x0a000001);
+    indexes->last    = htonl(0x0a000001 + 2 * size - 1);
+    indexes->current = indexes->first;
+
+    set_binding_pool(list, indexes);
+
+    for (n = 0; n < size; n++) {
+	client_mac(mac, n, 1);
+	set_binding_status(list, new_dynamic_binding(list, indexes, 0, mac, sizeof(mac)), PENDING);
+    }
+}
+
+static void
+bench_search (binding_list *list, uint32_t size, char *variant)
+{
+    uint32_t *order = malloc(size * sizeof(uint32_t));
+    uint8_t mac[6];
+    uint32_t n, i;
+
+    // random order, so that the lookups miss the caches like real ones
+
+    for (n = 0; n < size; n++)
+	order[n] = n;
+
+    for (n = size - 1; n > 0; n--) {
+	uint32_t k = random() % (n + 1), t = order[n];
+
+	order[n] = order[k];
+	order[k] = t;
+    }
+
+    uint64_t allocs = allocations, start = now_ns();
+
+    for (i = 0; i < LOOKUP_OPS; i++) {
+	client_mac(mac, order[i % size], 1);
+	sink += (uintptr_t) search_binding(list, mac, sizeof(mac), DYNAMIC, 0);
+    }
+
+    report("search_binding/hit", variant, now_ns() - start, allocations - allocs, LOOKUP_OPS);
+
+    allocs = allocations;
+    start = now_ns();
+
+    for (i = 0; i < LOOKUP_OPS; i++) {
+	client_mac(mac, order[i % size], 0);
+	sink += (uintptr_t) search_binding(list, mac, sizeof(mac), DYNAMIC, 0);
+    }
+
+    report("search_binding/miss", variant, now_ns() - start, allocations - allocs, LOOKUP_OPS);
+
+    free(order);
+}
+
+/*
+ * New clients join the table in rounds of ALLOC_ROUND: the bindings
+ * of a round are removed (not timed) before the next one, so the
+ * table keeps its size.
+ */
+
+static void
+bench_new_binding (binding_list *list, pool_indexes *indexes, uint32_t size, char *variant)
+{
+    address_binding *round[ALLOC_ROUND];
+    uint64_t ns = 0, allocs = 0, ops = 0;
+    uint8_t mac[6];
+    uint32_t n = size;
+    unsigned int i;
+
+    while (ops < LOOKUP_OPS / 4) {
+	uint64_t a = allocations, start = now_ns();
+
+	for (i = 0; i < ALLOC_ROUND; i++) {
+	    client_mac(mac, n++, 1);
+	    round[i] = new_dynamic_binding(list, indexes, 0, mac, sizeof(mac));
+	    set_binding_status(list, round[i], PENDING);
+	}
+
+	ns += now_ns() - start;
+	allocs += allocations - a;
+	ops += ALLOC_ROUND;
+
+	for (i = 0; i < ALLOC_ROUND; i++)
+	    remove_binding(list, round[i]);
+    }
+
+    report("new_dynamic_binding", variant, ns, allocs, ops);
+}
+
+int
+main (int argc, char *argv[])
+{
+    static uint32_t sizes[] = { 1000, 100000, 1000000 };
+    dhcp_option_table pool_opts;
+    unsigned int i;
+
+    init_option_table(&pool_opts);
+
+    for (i = 0; i < NPOOL_OPTIONS; i++) {
+	dhcp_option opt;
+
+	if (parse_option(&opt, pool_options[i][0], pool_options[i][1]) == 0)
+	    return 1;
+
+	add_option(&pool_opts, &opt);
+    }
+
+    bench_parse();
+    bench_serialize();
+    bench_fill_requested(&pool_opts);
+
+    if (bench_match_user_class() == -1)
+	return 1;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	binding_list list;
+	pool_indexes indexes;
+	char variant[16];
+
+	fflush(stdout);
+
+	if (fork() != 0) {
+	    wait(NULL);
+	    continue;
+	}
+
+	snprintf(variant, sizeof(variant), "%uk", sizes[i] / 1000);
+
+	fill_binding_list(&list, &indexes, sizes[i]);
+
+	bench_search(&list, sizes[i], variant);
+	bench_new_binding(&list, &indexes, sizes[i], variant);
+
+	fflush(stdout);
+	_exit(0);
+    }
+
+    return 0;
+}
@@ -4,7 +4,6 @@
 #include <time.h>
 #include <arpa/inet.h>
 
-#include "queue.h"
 #include "bindings.h"
 
 /*
@@ -14,13 +13,383 @@
 void
 init_binding_list (binding_list *list)
 {
-    LIST_INIT(list);
+    memset(list, 0, sizeof(*list));
+
+    list->count = 1; // handle zero is never used
+
+    list->timers.now = time(NULL);
+
+    list->index_size  = 64;
+    list->index_count = 0;
+    list->index = calloc(list->index_size, sizeof(*list->index));
+
+    init_bitmap(&list->free, 0);
+}
+
+/*
+ * Hash a client identifier (32 bit FNV-1a).
+ */
+
+static uint32_t
+hash_cident (uint8_t *cident, uint8_t cident_len)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < cident_len; i++) {
+	hash ^= cident[i];
+	hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Return the client identifier of a binding.
+ */
+
+uint8_t *
+binding_cident (binding_list *list, address_binding *binding)
+{
+    uint32_t n;
+
+    if (binding->cident_len <= CIDENT_INLINE)
+	return binding->cident;
+
+    memcpy(&n, binding->cident, sizeof(n));
+
+    return list->cidents[n].cident;
+}
+
+/*
+ * Store the client identifier of a binding, out of line if it
+ * does not fit in the record.
+ */
+
+static void
+store_cident (binding_list *list, address_binding *binding,
+	      uint8_t *cident, uint8_t cident_len)
+{
+    uint32_t n;
+
+    if (binding->cident_len > CIDENT_INLINE) { // release the long one
+	memcpy(&n, binding->cident, sizeof(n));
+	free(list->cidents[n].cident);
+	list->cidents[n].next_free = list->free_cidents;
+	list->free_cidents = n + 1;
+    }
+
+    binding->cident_len = cident_len;
+    binding->cident_hash = hash_cident(cident, cident_len);
+
+    if (cident_len <= CIDENT_INLINE) {
+	memcpy(binding->cident, cident, cident_len);
+	return;
+    }
+
+    if (list->free_cidents == 0) { // double the slots, the new ones are free
+	uint32_t size = list->ncidents ? 2 * list->ncidents : 16;
+
+	list->cidents = realloc(list->cidents, size * sizeof(*list->cidents));
+
+	for (n = size; n > list->ncidents; n--) {
+	    list->cidents[n - 1].next_free = list->free_cidents;
+	    list->free_cidents = n;
+	}
+
+	list->ncidents = size;
+    }
+
+    n = list->free_cidents - 1;
+    list->free_cidents = list->cidents[n].next_free;
+
+    list->cidents[n].cident = malloc(cident_len);
+    memcpy(list->cidents[n].cident, cident, cident_len);
+    memcpy(binding->cident, &n, sizeof(n));
+}
+
+/*
+ * Take a record from the binding table: a removed one if
+ * available, otherwise the next one (allocating a new chunk
+ * when needed).
+ */
+
+static address_binding *
+alloc_binding (binding_list *list)
+{
+    address_binding *binding;
+    binding_handle handle;
+
+    if (list->unused != NO_BINDING) {
+	handle = list->unused;
+	binding = get_binding(list, handle);
+	list->unused = binding->timer_next;
+    } else {
+	handle = list->count;
+
+	if ((handle >> BINDING_CHUNK_BITS) == list->nchunks) {
+	    list->chunks = realloc(list->chunks, (list->nchunks + 1) * sizeof(*list->chunks));
+	    list->chunks[list->nchunks++] = calloc(BINDING_CHUNK, sizeof(address_binding));
+	}
+
+	list->count++;
+	binding = get_binding(list, handle);
+    }
+
+    memset(binding, 0, sizeof(*binding));
+    binding->handle = handle;
+
+    return binding;
+}
+
+/*
+ * Insert a binding in the client identifier index.
+ *
+ * The index is doubled when it becomes three quarters full,
+ * to keep the probe sequences short.
+ */
+
+static void
+index_insert (binding_list *list, address_binding *binding)
+{
+    size_t mask, i;
+
+    if (4 * (list->index_count + 1) > 3 * list->index_size) {
+	binding_handle *old = list->index;
+	size_t old_size = list->index_size;
+
+	list->index_size *= 2;
+	list->index = calloc(list->index_size, sizeof(*list->index));
+
+	mask = list->index_size - 1;
+
+	for (i = 0; i < old_size; i++) {
+	    if (old[i] != NO_BINDING) {
+		size_t j = get_binding(list, old[i])->cident_hash & mask;
+
+		while (list->index[j] != NO_BINDING)
+		    j = (j + 1) & mask;
+
+		list->index[j] = old[i];
+	    }
+	}
+
+	free(old);
+    }
+
+    mask = list->index_size - 1;
+    i = binding->cident_hash & mask;
+
+    while (list->index[i] != NO_BINDING)
+	i = (i + 1) & mask;
+
+    list->index[i] = binding->handle;
+    list->index_count++;
+}
+
+/*
+ * Remove a binding from the client identifier index.
+ *
+ * The following entries of the probe sequence are shifted back,
+ * so no tombstones are needed and the lookups can stop at the
+ * first empty slot.
+ */
+
+static void
+index_remove (binding_list *list, address_binding *binding)
+{
+    size_t mask = list->index_size - 1;
+    size_t i = binding->cident_hash & mask;
+    size_t j;
+
+    while (list->index[i] != binding->handle) {
+	if (list->index[i] == NO_BINDING)
+	    return; // not indexed
+	i = (i + 1) & mask;
+    }
+
+    list->index[i] = NO_BINDING;
+    list->index_count--;
+
+    for (j = (i + 1) & mask; list->index[j] != NO_BINDING; j = (j + 1) & mask) {
+	size_t home = get_binding(list, list->index[j])->cident_hash & mask;
+
+	// move the entry back if its home slot is not between i and j
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	    list->index[i] = list->index[j];
+	    list->index[j] = NO_BINDING;
+	    i = j;
+	}
+    }
+}
+
+/*
+ * Change the client identifier of a binding (when an address
+ * previously used by another client is reused), keeping the
+ * index up to date.
+ */
+
+static void
+set_binding_client (binding_list *list, address_binding *binding,
+		    uint8_t *cident, uint8_t cident_len)
+{
+    index_remove(list, binding);
+    store_cident(list, binding, cident, cident_len);
+    index_insert(list, binding);
+}
+
+/*
+ * Queue a binding in the timer wheel, in the slot of the lowest
+ * level covering its expiration time.
+ */
+
+static void
+timer_insert (binding_list *list, address_binding *binding)
+{
+    timer_wheel *wheel = &list->timers;
+    time_t expire = (time_t) binding->binding_time + binding->lease_time;
+    time_t delta = expire - wheel->now;
+    binding_handle *head;
+    int l, idx;
+
+    if (delta < 0) { // already expired, process it at the next second
+	expire = wheel->now;
+	delta  = 0;
+    }
+
+    for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+	if (delta < (time_t) 1 << (WHEEL_BITS * (l + 1)))
+	    break;
+    }
+
+    if (delta >= (time_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) // too far, requeued later
+	expire = wheel->now + ((time_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    idx  = (expire >> (WHEEL_BITS * l)) & (WHEEL_SIZE - 1);
+    head = &wheel->slots[l][idx];
+
+    binding->timer_slot = l * WHEEL_SIZE + idx + 1;
+    binding->timer_prev = NO_BINDING;
+    binding->timer_next = *head;
+
+    if (*head != NO_BINDING)
+	get_binding(list, *head)->timer_prev = binding->handle;
+
+    *head = binding->handle;
+}
+
+/*
+ * Remove a binding from the timer wheel, if queued.
+ */
+
+static void
+timer_remove (binding_list *list, address_binding *binding)
+{
+    int slot = binding->timer_slot - 1;
+
+    if (binding->timer_slot == 0)
+	return;
+
+    if (binding->timer_prev != NO_BINDING)
+	get_binding(list, binding->timer_prev)->timer_next = binding->timer_next;
+    else
+	list->timers.slots[slot / WHEEL_SIZE][slot % WHEEL_SIZE] = binding->timer_next;
+
+    if (binding->timer_next != NO_BINDING)
+	get_binding(list, binding->timer_next)->timer_prev = binding->timer_prev;
+
+    binding->timer_slot = 0;
+    binding->timer_next = binding->timer_prev = NO_BINDING;
+}
+
+/*
+ * The address of a dynamic binding can be handed out again
+ * to another client if the binding is not pending or associated.
+ */
+
+static int
+is_reusable (address_binding *binding)
+{
+    return !binding->is_static &&
+	binding->status != PENDING &&
+	binding->status != ASSOCIATED;
+}
+
+/*
+ * When an address has more than one binding, the address index
+ * refers to the static one, else to a pending or associated one:
+ * a binding takes the slot of another of a lower rank (and of the
+ * same rank when added, a new dynamic binding replacing the one of
+ * a reused address).
+ */
+
+static int
+address_rank (address_binding *binding)
+{
+    return binding->is_static ? 2 : !is_reusable(binding);
+}
+
+/*
+ * Return the slot of an address in the address index,
+ * or -1 if the address is outside the pool range.
+ */
+
+static long
+address_slot (binding_list *list, uint32_t address)
+{
+    uint32_t offset = ntohl(address) - list->first;
+
+    if (offset >= list->range)
+	return -1;
+
+    return offset;
+}
+
+/*
+ * Set the address pool of the binding list.
+ *
+ * The address index and the free address bitmap are allocated
+ * over the pool range, and the bindings already present (e.g. the
+ * static ones) are indexed and their addresses marked as used.
+ */
+
+void
+set_binding_pool (binding_list *list, pool_indexes *indexes)
+{
+    binding_handle handle;
+
+    free(list->by_address);
+    delete_bitmap(&list->free);
+
+    list->first = ntohl(indexes->first);
+    list->range = 0;
+
+    if (indexes->first != 0 && ntohl(indexes->last) >= list->first)
+	list->range = ntohl(indexes->last) - list->first + 1;
+
+    list->by_address = calloc(list->range, sizeof(*list->by_address));
+    init_bitmap(&list->free, list->range);
+
+    for (handle = 1; handle < list->count; handle++) {
+	address_binding *binding = get_binding(list, handle);
+	long slot = address_slot(list, binding->address);
+
+	if (binding->handle == NO_BINDING || slot < 0)
+	    continue;
+
+	if (list->by_address[slot] == NO_BINDING ||
+	    address_rank(get_binding(list, list->by_address[slot])) < address_rank(binding))
+	    list->by_address[slot] = handle;
+
+	if (!is_reusable(binding))
+	    clear_bitmap_bit(&list->free, slot);
+    }
 }
 
 /*
  * Create a new binding
- * 
- * The binding is added to the binding list,
+ *
+ * The binding is added to the binding table,
  * and a pointer to the binding is returned for further manipulations.
  */
 
@@ -30,35 +399,212 @@ add_binding (binding_list *list, uint32_t address,
 {
     // fill binding
 
-    address_binding *binding = calloc(1, sizeof(*binding));
+    address_binding *binding = alloc_binding(list);
 
     binding->address = address;
-    binding->cident_len = cident_len;
-    memcpy(binding->cident, cident, cident_len);
+    store_cident(list, binding, cident, cident_len);
 
     binding->is_static = is_static;
 
-    // add to binding list
+    list->by_status[binding->status]++;
+
+    // add to the indexes
+
+    index_insert(list, binding);
+
+    long slot = address_slot(list, address);
+
+    if (slot >= 0 &&
+	(list->by_address[slot] == NO_BINDING ||
+	 address_rank(get_binding(list, list->by_address[slot])) <= address_rank(binding))) {
+	list->by_address[slot] = binding->handle;
+
+	if (!is_reusable(binding))
+	    clear_bitmap_bit(&list->free, slot);
+    }
 
-    LIST_INSERT_HEAD(list, binding, pointers);
-    
     return binding;
 }
 
 /*
- * Updated bindings status, i.e. set to EXPIRED the status of the 
+ * Remove a binding from the indexes, and give its record back
+ * to the binding table.
+ */
+
+void
+remove_binding (binding_list *list, address_binding *binding)
+{
+    long slot = address_slot(list, binding->address);
+
+    if (slot >= 0 && list->by_address[slot] == binding->handle) {
+	list->by_address[slot] = NO_BINDING;
+	set_bitmap_bit(&list->free, slot);
+    }
+
+    list->by_status[binding->status]--;
+
+    timer_remove(list, binding);
+    index_remove(list, binding);
+    store_cident(list, binding, NULL, 0);
+
+    binding->timer_next = list->unused;
+    list->unused = binding->handle;
+    binding->handle = NO_BINDING;
+}
+
+/*
+ * Change the status of a binding, taking its address from
+ * the free addresses or giving it back.
+ *
+ * The pending and associated bindings are queued in the timer
+ * wheel to expire at binding_time + lease_time, see set_binding_lease.
+ */
+
+void
+set_binding_status (binding_list *list, address_binding *binding, int status)
+{
+    long slot = address_slot(list, binding->address);
+
+    list->by_status[binding->status]--;
+    list->by_status[status]++;
+
+    binding->status = status;
+
+    timer_remove(list, binding);
+
+    if (status == PENDING || status == ASSOCIATED)
+	timer_insert(list, binding);
+
+    if (slot < 0 || list->by_address[slot] != binding->handle)
+	return;
+
+    if (is_reusable(binding))
+	set_bitmap_bit(&list->free, slot);
+    else
+	clear_bitmap_bit(&list->free, slot);
+}
+
+/*
+ * Start a pending offer or an associated lease of the given
+ * duration, from now.
+ */
+
+void
+set_binding_lease (binding_list *list, address_binding *binding,
+		   int status, time_t lease_time)
+{
+    binding->binding_time = time(NULL);
+    binding->lease_time = lease_time;
+
+    set_binding_status(list, binding, status);
+}
+
+/*
+ * Number of free and used addresses of the pool.
+ */
+
+uint32_t
+free_addresses (binding_list *list)
+{
+    return list->free.count;
+}
+
+uint32_t
+used_addresses (binding_list *list)
+{
+    return list->range - list->free.count;
+}
+
+/*
+ * Move the timer wheel to a time far from its own (e.g. after a
+ * restart): the queued bindings are taken out of all the slots and
+ * queued again from the new time, the expired ones in the slot of
+ * the new time, in one pass instead of one per elapsed second.
+ */
+
+static void
+timer_jump (binding_list *list, time_t now)
+{
+    timer_wheel *wheel = &list->timers;
+    binding_handle queued = NO_BINDING;
+    address_binding *binding;
+    int l, i;
+
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+	for (i = 0; i < WHEEL_SIZE; i++) {
+	    while (wheel->slots[l][i] != NO_BINDING) {
+		binding = get_binding(list, wheel->slots[l][i]);
+		timer_remove(list, binding);
+		binding->timer_next = queued;
+		queued = binding->handle;
+	    }
+	}
+    }
+
+    wheel->now = now;
+
+    while (queued != NO_BINDING) {
+	binding = get_binding(list, queued);
+	queued = binding->timer_next;
+	timer_insert(list, binding);
+    }
+}
+
+/*
+ * Updated bindings status, i.e. set to EXPIRED the status of the
  * expired bindings.
+ *
+ * The timer wheel is advanced up to now, so the cost is proportional
+ * to the elapsed seconds and to the expired bindings only; when more
+ * than a turn of the lowest level has elapsed the wheel jumps to now
+ * instead. The expired function, if not NULL, is called for every
+ * expired binding.
  */
 
 void
-update_bindings_statuses (binding_list *list)
+update_bindings_statuses (binding_list *list, time_t now,
+			  void (*expired) (binding_list *, address_binding *, void *), void *arg)
 {
-    address_binding *binding, *binding_temp;
-    
-    LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
-	if(binding->binding_time + binding->lease_time < time(NULL)) {
-	    binding->status = EXPIRED;
+    timer_wheel *wheel = &list->timers;
+    address_binding *binding;
+
+    if (now - wheel->now > WHEEL_SIZE)
+	timer_jump(list, now);
+
+    while (wheel->now <= now) {
+	int idx = wheel->now & (WHEEL_SIZE - 1);
+	int l;
+
+	// when a level wraps around, cascade the next slot of the level above
+
+	for (l = 1; l < WHEEL_LEVELS && idx == 0; l++) {
+	    binding_handle *slot;
+
+	    idx = (wheel->now >> (WHEEL_BITS * l)) & (WHEEL_SIZE - 1);
+	    slot = &wheel->slots[l][idx];
+
+	    // the bindings always go to a lower level (or another slot)
+
+	    while (*slot != NO_BINDING) {
+		binding = get_binding(list, *slot);
+		timer_remove(list, binding);
+		timer_insert(list, binding);
+	    }
 	}
+
+	// expire the bindings of the current second
+
+	binding_handle *slot = &wheel->slots[0][wheel->now & (WHEEL_SIZE - 1)];
+
+	while (*slot != NO_BINDING) {
+	    binding = get_binding(list, *slot);
+	    set_binding_status(list, binding, EXPIRED);
+
+	    if (expired != NULL)
+		expired(list, binding, arg);
+	}
+
+	wheel->now++;
     }
 }
 
@@ -74,13 +620,17 @@ address_binding *
 search_binding (binding_list *list, uint8_t *cident, uint8_t cident_len,
 		int is_static, int status)
 {
-    address_binding *binding, *binding_temp;
-	
-    LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
+    uint32_t hash = hash_cident(cident, cident_len);
+    size_t mask = list->index_size - 1;
+    size_t i;
+
+    for (i = hash & mask; list->index[i] != NO_BINDING; i = (i + 1) & mask) {
+	address_binding *binding = get_binding(list, list->index[i]);
 
-	if((binding->is_static == is_static || is_static == STATIC_OR_DYNAMIC) &&
+	if(binding->cident_hash == hash &&
+	   (binding->is_static == is_static || is_static == STATIC_OR_DYNAMIC) &&
 	   binding->cident_len == cident_len &&
-	   memcmp(binding->cident, cident, cident_len) == 0) {
+	   memcmp(binding_cident(list, binding), cident, cident_len) == 0) {
 
 	    if(status == 0)
 		return binding;
@@ -93,29 +643,86 @@ search_binding (binding_list *list, uint8_t *cident, uint8_t cident_len,
 }
 
 /*
- * Get an available free address
+ * Search the static or dynamic binding of a client to the given
+ * address (the client may have other bindings in the list).
+ */
+
+address_binding *
+search_address_binding (binding_list *list, uint8_t *cident, uint8_t cident_len,
+			int is_static, uint32_t address)
+{
+    uint32_t hash = hash_cident(cident, cident_len);
+    size_t mask = list->index_size - 1;
+    size_t i;
+
+    for (i = hash & mask; list->index[i] != NO_BINDING; i = (i + 1) & mask) {
+	address_binding *binding = get_binding(list, list->index[i]);
+
+	if(binding->cident_hash == hash && binding->address == address &&
+	   (binding->is_static == is_static || is_static == STATIC_OR_DYNAMIC) &&
+	   binding->cident_len == cident_len &&
+	   memcmp(binding_cident(list, binding), cident, cident_len) == 0)
+	    return binding;
+    }
+
+    return NULL;
+}
+
+/*
+ * Search the binding of an address of the pool of the list,
+ * NULL if the address is not bound or outside the pool.
+ */
+
+address_binding *
+search_bound_address (binding_list *list, uint32_t address)
+{
+    long slot = address_slot(list, address);
+
+    if (slot < 0 || list->by_address[slot] == NO_BINDING)
+	return NULL;
+
+    return get_binding(list, list->by_address[slot]);
+}
+
+/*
+ * Mark an address of the pool as used without a binding,
+ * so it is never allocated (e.g. an address statically
+ * bound in another binding list).
+ */
+
+void
+reserve_address (binding_list *list, uint32_t address)
+{
+    long slot = address_slot(list, address);
+
+    if (slot >= 0)
+	clear_bitmap_bit(&list->free, slot);
+}
+
+/*
+ * Get an available free address, starting from the last allocated one.
  *
  * If a zero address is returned, no more address are available.
  */
 
 static uint32_t
-take_free_address (pool_indexes *indexes)
+take_free_address (binding_list *list, pool_indexes *indexes)
 {
-    if(indexes->current <= indexes->last) {
-
-	uint32_t address = indexes->current;	
-	indexes->current = htonl(ntohl(indexes->current) + 1);
-	return address;
+    long slot = find_bitmap_bit(&list->free, ntohl(indexes->current) - list->first);
 
-    } else
+    if (slot < 0)
 	return 0;
+
+    indexes->current = htonl(list->first + slot + 1);
+
+    return htonl(list->first + slot);
 }
 
 /*
  * Create a new dynamic binding or reuse an expired one.
  *
  * An attemp will be made to assign to the client the requested IP address
- * contained in the address option. An address equals to zero means that no 
+ * contained in the address option. An address equals to zero means that no
  * specific address has been requested.
  *
  * If the dynamic pool of addresses is full a NULL pointer will be returned.
@@ -125,55 +732,365 @@ address_binding *
 new_dynamic_binding (binding_list *list, pool_indexes *indexes, uint32_t address,
 		     uint8_t *cident, uint8_t cident_len)
 {
-    address_binding *binding, *binding_temp;
-    address_binding *found_binding = NULL;
+    address_binding *binding;
+    long slot = -1;
 
-    if (address != 0) {
+    if (address != 0)
+	slot = address_slot(list, address);
 
-	LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
-	    // search a previous binding using the requested IP address
+    if (slot < 0 || !test_bitmap_bit(&list->free, slot)) {
 
-	    if(binding->address == address) {
-		found_binding = binding;
-		break;
-	    }
+	/* the requested IP address is already in use, outside of the pool,
+	   or no address has been requested: use the next available address */
+
+	address = take_free_address(list, indexes);
+
+	if (address == 0) // no more addresses are available
+	    return NULL;
+
+	slot = address_slot(list, address);
+    }
+
+    if (list->by_address[slot] != NO_BINDING) {
+	// the address is available (reuse an expired association)
+	binding = get_binding(list, list->by_address[slot]);
+	set_binding_client(list, binding, cident, cident_len);
+	return binding;
+    }
+
+    return add_binding(list, address, cident, cident_len, 0);
+}
+
+/*
+ * Restore the state of a dynamic binding read back from the lease
+ * journal, with its original binding time and lease time.
+ *
+ * The journal is newer than the bindings already in the list (e.g.
+ * loaded from a snapshot): for a lease the binding of the address is
+ * taken over and another dynamic binding of the client is removed,
+ * otherwise the binding of the address (if any) just gets the status.
+ *
+ * An address outside of the pool is bound out of the address index
+ * (the lease of a pool split differently, see reserve_moved_leases in
+ * dhcpserver.c): the caller checks it is still a served address.
+ *
+ * If the address is reserved or statically bound, a NULL pointer
+ * will be returned.
+ */
+
+address_binding *
+restore_binding (binding_list *list, uint32_t address, uint8_t *cident, uint8_t cident_len,
+		 int status, time_t binding_time, time_t lease_time)
+{
+    address_binding *binding = NULL, *old;
+    long slot = address_slot(list, address);
+
+    if (slot < 0)
+	binding = search_address_binding(list, cident, cident_len, DYNAMIC, address);
+    else if (list->by_address[slot] != NO_BINDING)
+	binding = get_binding(list, list->by_address[slot]);
+    else if (!test_bitmap_bit(&list->free, slot))
+	return NULL; // reserved
+
+    if (binding != NULL && binding->is_static)
+	return NULL;
+
+    if (status != ASSOCIATED) { // the address is free again
+	if (binding != NULL)
+	    set_binding_status(list, binding, status);
+
+	return binding;
+    }
+
+    old = search_binding(list, cident, cident_len, DYNAMIC, EMPTY);
+
+    if (old != NULL && old != binding)
+	remove_binding(list, old);
+
+    if (binding == NULL)
+	binding = add_binding(list, address, cident, cident_len, 0);
+    else if (old != binding)
+	set_binding_client(list, binding, cident, cident_len);
+
+    binding->binding_time = binding_time;
+    binding->lease_time = lease_time;
+
+    set_binding_status(list, binding, status);
+
+    return binding;
+}
+
+/*
+ * Offsets of the parts of a binding list image: the binding table
+ * (whole chunks), the client identifier index, the address index
+ * and the free address bitmap, every part aligned to 8 bytes.
+ *
+ * Return the offset of the long client identifiers, the last part.
+ */
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+static size_t
+image_offsets (binding_image *hdr, size_t *records, size_t *index,
+	       size_t *by_address, size_t *free_words)
+{
+    size_t off = ALIGN8(sizeof(binding_image));
+
+    *records = off;
+    off += (size_t) hdr->nchunks * BINDING_CHUNK * sizeof(address_binding);
+
+    *index = off;
+    off += ALIGN8(hdr->index_size * sizeof(binding_handle));
+
+    *by_address = off;
+    off += ALIGN8((size_t) hdr->range * sizeof(binding_handle));
+
+    *free_words = off;
+    off += ((size_t) hdr->range + 63) / 64 * sizeof(uint64_t);
+
+    return off;
+}
+
+/*
+ * Save a binding list as an image, passed part by part to a write
+ * function: the records, the indexes and the timer wheel as they
+ * are, the long client identifiers in binding order. Nothing is
+ * allocated nor copied, so the image can be written by a child
+ * forked by a multithreaded process.
+ *
+ * Return 0 on success with the size of the image in size, -1 if
+ * the write function failed.
+ */
+
+int
+save_binding_list (binding_list *list, image_writer write, void *arg, size_t *size)
+{
+    static const uint8_t zeros[8];
+    size_t records, index, by_address, free_words, off;
+    binding_image hdr;
+    binding_handle handle;
+    uint32_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.count       = list->count;
+    hdr.unused      = list->unused;
+    hdr.nchunks     = list->nchunks;
+    hdr.ncidents    = list->ncidents;
+    hdr.first       = list->first;
+    hdr.range       = list->range;
+    hdr.index_size  = list->index_size;
+    hdr.index_count = list->index_count;
+    hdr.now         = list->timers.now;
+    memcpy(hdr.wheel, list->timers.slots, sizeof(hdr.wheel));
+
+    off = image_offsets(&hdr, &records, &index, &by_address, &free_words);
+
+    // every part but the last is padded to its offset
+
+    if (write(arg, &hdr, sizeof(hdr)) == -1 ||
+	write(arg, zeros, records - sizeof(hdr)) == -1)
+	return -1;
+
+    for (i = 0; i < list->nchunks; i++) {
+	if (write(arg, list->chunks[i], BINDING_CHUNK * sizeof(address_binding)) == -1)
+	    return -1;
+    }
+
+    if (write(arg, list->index, list->index_size * sizeof(binding_handle)) == -1 ||
+	write(arg, zeros, by_address - index - list->index_size * sizeof(binding_handle)) == -1 ||
+	write(arg, list->by_address, list->range * sizeof(binding_handle)) == -1 ||
+	write(arg, zeros, free_words - by_address - list->range * sizeof(binding_handle)) == -1)
+	return -1;
+
+    if (list->range > 0 &&
+	write(arg, list->free.level[0], list->free.words[0] * sizeof(uint64_t)) == -1)
+	return -1;
+
+    for (handle = 1; handle < list->count; handle++) {
+	address_binding *binding = get_binding(list, handle);
+
+	if (binding->handle != NO_BINDING && binding->cident_len > CIDENT_INLINE) {
+	    if (write(arg, binding_cident(list, binding), binding->cident_len) == -1)
+		return -1;
+
+	    off += binding->cident_len;
 	}
     }
 
-    if(found_binding != NULL &&
-       !found_binding->is_static &&
-       found_binding->status != PENDING &&
-       found_binding->status != ASSOCIATED) {
+    *size = ALIGN8(off);
 
-	// the requested IP address is available (reuse an expired association)
-	return found_binding;
-	
-    } else {
+    return write(arg, zeros, *size - off);
+}
 
-	/* the requested IP address is already in use, or no address has been
-           requested, or the address requested has never been allocated
-           (we do not support this last case and just return the next
-           available address!). */
+/*
+ * Free the memory used by a binding list (the chunks of the binding
+ * table in an image stay in the image).
+ */
 
-	uint32_t address = take_free_address(indexes);
+void
+delete_binding_list (binding_list *list)
+{
+    uint32_t i;
 
-	if(address != 0)
-	    return add_binding(list, address, cident, cident_len, 0);
+    for (i = list->mapped_chunks; i < list->nchunks; i++)
+	free(list->chunks[i]);
 
-	else { // search any previously assigned address which is expired
-    
-	    LIST_FOREACH_SAFE(binding, list, pointers, binding_temp) {
-		if(!binding->is_static &&
-		   found_binding->status != PENDING &&
-		   found_binding->status != ASSOCIATED)
-		    return binding;
-	    }
+    while (list->free_cidents != 0) { // the free slots hold no identifier
+	i = list->free_cidents - 1;
+	list->free_cidents = list->cidents[i].next_free;
+	list->cidents[i].cident = NULL;
+    }
 
-	    // if executions reach here no more addresses are available
-	    return NULL;
-	}	
+    for (i = 0; i < list->ncidents; i++)
+	free(list->cidents[i].cident);
+
+    free(list->chunks);
+    free(list->cidents);
+    free(list->index);
+    free(list->by_address);
+    delete_bitmap(&list->free);
+}
+
+/*
+ * Check that the handles of an array are in a table of count handles.
+ */
+
+static int
+valid_handles (binding_handle *handles, size_t n, uint32_t count)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (handles[i] >= count)
+	    return 0;
     }
 
-    // execution should not reach here...
-    return NULL;
+    return 1;
+}
+
+/*
+ * Load a binding list from an image saved by save_binding_list (with
+ * the pool range of the image). The binding table is used in place,
+ * so the image must stay in memory and writable (e.g. a private
+ * mapping of a snapshot); the other parts are copied.
+ *
+ * Return 0 on success, -1 if the image is not valid: then the list
+ * is only good to be deleted.
+ */
+
+int
+load_binding_list (binding_list *list, uint8_t *image, size_t size)
+{
+    size_t records, index, by_address, free_words, off;
+    binding_image hdr;
+    binding_handle handle;
+    uint32_t i;
+
+    if (size < sizeof(hdr))
+	return -1;
+
+    memcpy(&hdr, image, sizeof(hdr));
+
+    off = image_offsets(&hdr, &records, &index, &by_address, &free_words);
+
+    // handle 0 is never used: a list with no bindings has no chunks
+
+    if (off > size || hdr.count == 0 ||
+	(hdr.count > 1 && hdr.count > (uint64_t) hdr.nchunks * BINDING_CHUNK) ||
+	hdr.index_size == 0 || (hdr.index_size & (hdr.index_size - 1)) != 0)
+	return -1;
+
+    // from here on the list holds only what is loaded, so it can be
+    // deleted whatever check fails
+
+    delete_binding_list(list);
+    memset(list, 0, sizeof(*list));
+
+    list->first       = hdr.first;
+    list->range       = hdr.range;
+    list->count       = hdr.count;
+    list->unused      = hdr.unused;
+    list->nchunks     = hdr.nchunks;
+    list->index_size  = hdr.index_size;
+    list->index_count = hdr.index_count;
+
+    list->chunks = malloc(hdr.nchunks * sizeof(*list->chunks));
+
+    for (i = 0; i < hdr.nchunks; i++)
+	list->chunks[i] = (address_binding *)
+	    (image + records + (size_t) i * BINDING_CHUNK * sizeof(address_binding));
+
+    list->mapped_chunks = hdr.nchunks; // the next ones are allocated
+
+    list->index = malloc(hdr.index_size * sizeof(binding_handle));
+    memcpy(list->index, image + index, hdr.index_size * sizeof(binding_handle));
+
+    list->by_address = malloc(hdr.range * sizeof(binding_handle));
+    memcpy(list->by_address, image + by_address, hdr.range * sizeof(binding_handle));
+
+    load_bitmap(&list->free, hdr.range, (uint64_t *) (image + free_words));
+
+    list->timers.now = hdr.now;
+    memcpy(list->timers.slots, hdr.wheel, sizeof(hdr.wheel));
+
+    // every stored handle must be in the table (e.g. not an image of
+    // another record layout with a valid checksum)
+
+    if (hdr.unused >= hdr.count ||
+	!valid_handles(list->index, hdr.index_size, hdr.count) ||
+	!valid_handles(list->by_address, hdr.range, hdr.count) ||
+	!valid_handles(&list->timers.slots[0][0], WHEEL_LEVELS * WHEEL_SIZE, hdr.count))
+	return -1;
+
+    // the long client identifiers, in binding order, and the status counts
+
+    list->ncidents = hdr.ncidents;
+    list->cidents  = calloc(hdr.ncidents, sizeof(*list->cidents));
+
+    memset(list->by_status, 0, sizeof(list->by_status));
+
+    for (handle = 1; handle < list->count; handle++) {
+	address_binding *binding = get_binding(list, handle);
+	uint32_t n;
+
+	// the removed bindings are linked by timer_next
+
+	if (binding->timer_next >= list->count || binding->timer_prev >= list->count ||
+	    binding->timer_slot > WHEEL_LEVELS * WHEEL_SIZE)
+	    return -1;
+
+	if (binding->handle == NO_BINDING)
+	    continue;
+
+	if (binding->handle != handle || binding->status > RELEASED)
+	    return -1;
+
+	list->by_status[binding->status]++;
+
+	if (binding->cident_len <= CIDENT_INLINE)
+	    continue;
+
+	memcpy(&n, binding->cident, sizeof(n));
+
+	if (n >= list->ncidents || list->cidents[n].cident != NULL ||
+	    off + binding->cident_len > size)
+	    return -1;
+
+	list->cidents[n].cident = malloc(binding->cident_len);
+	memcpy(list->cidents[n].cident, image + off, binding->cident_len);
+	off += binding->cident_len;
+    }
+
+    // the slots of no identifier are free
+
+    list->free_cidents = 0;
+
+    for (i = list->ncidents; i > 0; i--) {
+	if (list->cidents[i - 1].cident == NULL) {
+	    list->cidents[i - 1].next_free = list->free_cidents;
+	    list->free_cidents = i;
+	}
+    }
+
+    return 0;
 }
@@ -2,10 +2,11 @@
 #define BINDINGS_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 
-#include "queue.h"
 #include "options.h"
+#include "bitmap.h"
 
 /*
  * Header to manage the database of address bindings.
@@ -34,47 +35,206 @@ enum {
 struct pool_indexes {
     uint32_t first;    // first address of the pool
     uint32_t last;     // last address of the pool
-    uint32_t current;  // current available address
+    uint32_t current;  // next address to try when allocating
 };
 
 typedef struct pool_indexes pool_indexes;
 
 /*
- * The bindings are organized as a double linked list
- * using the standard queue(3) library
+ * The bindings are stored in a table of compact records, allocated
+ * in chunks that are never moved: a binding is referred to by its
+ * handle (the position in the table), and a pointer to a binding
+ * stays valid until the binding is removed. Handle zero is never
+ * used, and means no binding.
+ *
+ * Client identifiers up to CIDENT_INLINE bytes (MAC addresses) are
+ * stored in the record, longer ones out of line.
+ *
+ * The bindings are indexed by client identifier with an open
+ * addressing hash table, and by address with an array over the
+ * pool range.
+ *
+ * The free addresses of the pool are tracked with a bitmap:
+ * an address is free if it has no binding, or if its dynamic
+ * binding is neither pending nor associated (so it can be
+ * handed out again to another client).
+ *
+ * Pending and associated bindings are queued in a hierarchical
+ * timer wheel, which moves them to the EXPIRED status when their
+ * lease (or offer) time is over.
+ *
+ * The number of bindings in every status is kept up to date on
+ * every change, so it can be read at any time (see metrics.h).
  */
 
+typedef uint32_t binding_handle;
+
+enum {
+    NO_BINDING    = 0,
+    CIDENT_INLINE = 7,
+    BINDING_CHUNK_BITS = 12,
+    BINDING_CHUNK = 1 << BINDING_CHUNK_BITS // bindings per chunk
+};
+
 struct address_binding {
     uint32_t address;     // address
-    uint8_t cident_len;   // client identifier len
-    uint8_t cident[256];  // client identifier
-    
-    time_t binding_time;  // time of binding
-    time_t lease_time;    // duration of lease
+    uint32_t cident_hash; // hash of the client identifier
 
-    int status;           // binding status
-    int is_static;        // check if it is a static binding
+    uint32_t binding_time; // time of binding
+    uint32_t lease_time;   // duration of lease
 
-    LIST_ENTRY(address_binding) pointers; // list pointers, see queue(3)
+    binding_handle handle;     // handle of this binding, NO_BINDING if unused
+    binding_handle timer_next; // timer wheel slot list
+    binding_handle timer_prev;
+    uint16_t timer_slot;       // timer wheel slot + 1, zero if not queued
+
+    uint8_t status;       // binding status
+    uint8_t is_static;    // check if it is a static binding
+
+    uint8_t cident_len;             // client identifier len
+    uint8_t cident[CIDENT_INLINE];  // client identifier, or index of the long one
 };
 
 typedef struct address_binding address_binding;
 
-typedef LIST_HEAD(binding_list_, address_binding) BINDING_LIST_HEAD;
-typedef struct binding_list_ binding_list;
-						 
+/*
+ * Every level of the timer wheel has WHEEL_SIZE slots of one second
+ * at level 0, WHEEL_SIZE seconds at level 1 and so on. The bindings
+ * of an upper level slot are cascaded to the lower levels when the
+ * lower level wraps around, so every binding is moved at most once
+ * per level.
+ */
+
+enum {
+    WHEEL_BITS   = 6,
+    WHEEL_SIZE   = 1 << WHEEL_BITS,
+    WHEEL_LEVELS = 5 // 2^30 seconds
+};
+
+struct timer_wheel {
+    time_t now; // next second to process
+    binding_handle slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+typedef struct timer_wheel timer_wheel;
+
+/*
+ * The index uses linear probing, every slot holds a binding handle
+ * or NO_BINDING. Static and dynamic bindings of the same client share
+ * the same key, the status is not part of the key so it can change
+ * without touching the index.
+ */
+
+/*
+ * Slot of a long client identifier: a free slot holds the
+ * next free one instead, so a slot is taken or released
+ * in constant time.
+ */
+
+union cident_slot {
+    uint8_t *cident;    // long client identifier
+    uint32_t next_free; // next free slot + 1, zero if none
+};
+
+typedef union cident_slot cident_slot;
+
+struct binding_list {
+    address_binding **chunks; // binding table
+    uint32_t nchunks;         // number of allocated chunks
+    uint32_t mapped_chunks;   // chunks in an image (see load_binding_list), not allocated
+    uint32_t count;           // number of used handles (including zero)
+    binding_handle unused;    // list of removed bindings, to be reused
+
+    cident_slot *cidents;     // long client identifiers
+    uint32_t ncidents;        // number of long client identifiers slots
+    uint32_t free_cidents;    // list of free slots: first free slot + 1, zero if none
+
+    binding_handle *index;   // hash index on client identifier
+    size_t index_size;       // number of slots (a power of two)
+    size_t index_count;      // number of bindings in the index
+
+    binding_handle *by_address; // bindings by address, over the pool range
+    uint32_t first;             // first address of the range (host order)
+    uint32_t range;             // number of addresses in the range
+
+    bitmap free; // free addresses of the pool range
+
+    uint32_t by_status[RELEASED + 1]; // number of bindings in every status
+
+    timer_wheel timers; // expiration of pending and associated bindings
+};
+
+typedef struct binding_list binding_list;
+
+/*
+ * Header of the image of a binding list (see save_binding_list),
+ * followed by the binding table, the indexes and the free address
+ * bitmap as they are in memory.
+ */
+
+struct binding_image {
+    uint32_t count;    // used handles
+    uint32_t unused;   // list of removed bindings
+    uint32_t nchunks;  // chunks of the binding table
+    uint32_t ncidents; // long client identifiers slots
+    uint32_t first;    // pool range
+    uint32_t range;
+    uint64_t index_size;
+    uint64_t index_count;
+    int64_t now;       // timer wheel
+    binding_handle wheel[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+typedef struct binding_image binding_image;
+
+/*
+ * Function writing a part of an image, returning 0 on success,
+ * -1 on error.
+ */
+
+typedef int (*image_writer) (void *arg, const void *data, size_t len);
+
+/*
+ * Get the binding of a handle.
+ */
+
+static inline address_binding *
+get_binding (binding_list *list, binding_handle handle)
+{
+    return &list->chunks[handle >> BINDING_CHUNK_BITS][handle & (BINDING_CHUNK - 1)];
+}
+
 /*
  * Prototypes
  */
 
 void init_binding_list (binding_list *list);
+void delete_binding_list (binding_list *list);
 
 address_binding *add_binding (binding_list *list, uint32_t address, uint8_t *cident, uint8_t cident_len, int is_static);
-void remove_binding (address_binding *binding);
+void remove_binding (binding_list *list, address_binding *binding);
+void reserve_address (binding_list *list, uint32_t address);
 
-void update_bindings_statuses (binding_list *list);
+void set_binding_pool (binding_list *list, pool_indexes *indexes);
+void set_binding_status (binding_list *list, address_binding *binding, int status);
+void set_binding_lease (binding_list *list, address_binding *binding, int status, time_t lease_time);
+void update_bindings_statuses (binding_list *list, time_t now,
+			       void (*expired) (binding_list *, address_binding *, void *), void *arg);
+
+uint8_t *binding_cident (binding_list *list, address_binding *binding);
+
+uint32_t free_addresses (binding_list *list);
+uint32_t used_addresses (binding_list *list);
 
 address_binding *search_binding (binding_list *list, uint8_t *cident, uint8_t cident_len, int is_static, int status);
+address_binding *search_address_binding (binding_list *list, uint8_t *cident, uint8_t cident_len,
+					 int is_static, uint32_t address);
+address_binding *search_bound_address (binding_list *list, uint32_t address);
 address_binding *new_dynamic_binding (binding_list *list, pool_indexes *indexes, uint32_t address, uint8_t *cident, uint8_t cident_len);
+address_binding *restore_binding (binding_list *list, uint32_t address, uint8_t *cident, uint8_t cident_len,
+				  int status, time_t binding_time, time_t lease_time);
+
+int save_binding_list (binding_list *list, image_writer write, void *arg, size_t *size);
+int load_binding_list (binding_list *list, uint8_t *image, size_t size);
 
 #endif
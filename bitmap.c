@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+/*
+ * Initialize a bitmap of the given size, with all the bits set.
+ */
+
+void
+init_bitmap (bitmap *bm, uint32_t size)
+{
+    uint64_t bits = size;
+    int l;
+
+    memset(bm, 0, sizeof(*bm));
+
+    bm->size  = size;
+    bm->count = size;
+
+    if (size == 0)
+	return;
+
+    for (l = 0; l < BITMAP_MAX_LEVELS; l++) {
+	uint64_t words = (bits + 63) / 64;
+
+	bm->level[l] = calloc(words, sizeof(uint64_t));
+	bm->words[l] = words;
+
+	// set the first bits bits of the level
+
+	memset(bm->level[l], 0xff, (bits / 64) * sizeof(uint64_t));
+
+	if (bits % 64)
+	    bm->level[l][bits / 64] = (1ULL << (bits % 64)) - 1;
+
+	bm->levels = l + 1;
+
+	if (words == 1)
+	    break;
+
+	bits = words;
+    }
+}
+
+/*
+ * Initialize a bitmap of the given size from the words of its
+ * level 0 (e.g. read from a snapshot): the upper levels and the
+ * count are rebuilt.
+ */
+
+void
+load_bitmap (bitmap *bm, uint32_t size, uint64_t *words)
+{
+    uint32_t i;
+    int l;
+
+    init_bitmap(bm, size);
+
+    if (size == 0)
+	return;
+
+    memcpy(bm->level[0], words, bm->words[0] * sizeof(uint64_t));
+
+    bm->count = 0;
+
+    for (i = 0; i < bm->words[0]; i++)
+	bm->count += __builtin_popcountll(bm->level[0][i]);
+
+    for (l = 1; l < bm->levels; l++) {
+	memset(bm->level[l], 0, bm->words[l] * sizeof(uint64_t));
+
+	for (i = 0; i < bm->words[l - 1]; i++) {
+	    if (bm->level[l - 1][i] != 0)
+		bm->level[l][i / 64] |= 1ULL << (i % 64);
+	}
+    }
+}
+
+/*
+ * Free the memory used by a bitmap.
+ */
+
+void
+delete_bitmap (bitmap *bm)
+{
+    int l;
+
+    for (l = 0; l < bm->levels; l++)
+	free(bm->level[l]);
+
+    memset(bm, 0, sizeof(*bm));
+}
+
+/*
+ * Set the bit n, propagating it to the upper levels.
+ */
+
+void
+set_bitmap_bit (bitmap *bm, uint32_t n)
+{
+    uint64_t idx = n;
+    int l;
+
+    if (n >= bm->size || test_bitmap_bit(bm, n))
+	return;
+
+    bm->count++;
+
+    for (l = 0; l < bm->levels; l++) {
+	uint64_t *word = &bm->level[l][idx / 64];
+	int was_empty = (*word == 0);
+
+	*word |= 1ULL << (idx % 64);
+
+	if (!was_empty)
+	    break; // the upper levels already know about this word
+
+	idx /= 64;
+    }
+}
+
+/*
+ * Clear the bit n, propagating it to the upper levels.
+ */
+
+void
+clear_bitmap_bit (bitmap *bm, uint32_t n)
+{
+    uint64_t idx = n;
+    int l;
+
+    if (n >= bm->size || !test_bitmap_bit(bm, n))
+	return;
+
+    bm->count--;
+
+    for (l = 0; l < bm->levels; l++) {
+	uint64_t *word = &bm->level[l][idx / 64];
+
+	*word &= ~(1ULL << (idx % 64));
+
+	if (*word != 0)
+	    break; // the word still has bits set
+
+	idx /= 64;
+    }
+}
+
+/*
+ * Check if the bit n is set.
+ */
+
+int
+test_bitmap_bit (bitmap *bm, uint32_t n)
+{
+    if (n >= bm->size)
+	return 0;
+
+    return (bm->level[0][n / 64] >> (n % 64)) & 1;
+}
+
+/*
+ * Find the first set bit starting from position from, wrapping
+ * around at the end of the bitmap.
+ *
+ * Return the position of the bit, or -1 if no bit is set.
+ */
+
+long
+find_bitmap_bit (bitmap *bm, uint32_t from)
+{
+    uint64_t idx;
+    int l, pass;
+
+    if (bm->count == 0)
+	return -1;
+
+    for (pass = 0; pass < 2; pass++) {
+
+	idx = (pass == 0 && from < bm->size) ? from : 0;
+
+	// climb until a word with a set bit at or after idx is found
+
+	for (l = 0; l < bm->levels; l++) {
+	    uint64_t word;
+
+	    if (idx / 64 >= bm->words[l])
+		break;
+
+	    word = bm->level[l][idx / 64] & (~0ULL << (idx % 64));
+
+	    if (word != 0) {
+		idx = (idx & ~63ULL) + __builtin_ctzll(word);
+
+		// descend to the first set bit of level 0
+
+		while (l-- > 0)
+		    idx = idx * 64 + __builtin_ctzll(bm->level[l][idx]);
+
+		return idx;
+	    }
+
+	    idx = idx / 64 + 1; // first word after this one, in the level above
+	}
+    }
+
+    return -1;
+}
@@ -0,0 +1,44 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical bitmap, used to track the free addresses of a pool.
+ *
+ * Level 0 has a bit for every element, each upper level has a bit
+ * for every word of the level below which has at least one bit set.
+ * The top level is a single word, so a set bit is found with one
+ * find-first-set per level.
+ */
+
+enum {
+    BITMAP_MAX_LEVELS = 6 // enough for 2^32 elements
+};
+
+struct bitmap {
+    uint32_t size;   // number of elements
+    uint32_t count;  // number of bits set
+    int levels;      // number of levels in use
+
+    uint64_t *level[BITMAP_MAX_LEVELS]; // words of every level
+    uint32_t words[BITMAP_MAX_LEVELS];  // number of words of every level
+};
+
+typedef struct bitmap bitmap;
+
+/*
+ * Prototypes
+ */
+
+void init_bitmap (bitmap *bm, uint32_t size);
+void load_bitmap (bitmap *bm, uint32_t size, uint64_t *words);
+void delete_bitmap (bitmap *bm);
+
+void set_bitmap_bit (bitmap *bm, uint32_t n);
+void clear_bitmap_bit (bitmap *bm, uint32_t n);
+int test_bitmap_bit (bitmap *bm, uint32_t n);
+
+long find_bitmap_bit (bitmap *bm, uint32_t from);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "circuits.h"
+
+/*
+ * Initialize an empty circuit table.
+ */
+
+void
+init_circuit_table (circuit_table *table)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->index_size = 64;
+    table->index = calloc(table->index_size, sizeof(*table->index));
+}
+
+void
+delete_circuit_table (circuit_table *table)
+{
+    free(table->circuits);
+    free(table->index);
+    free(table->keys);
+
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Hash the key of a circuit (32 bit FNV-1a, over the lengths
+ * and the two ids).
+ */
+
+static uint32_t
+hash_circuit (uint8_t *circuit_id, uint8_t circuit_len,
+	      uint8_t *remote_id, uint8_t remote_len)
+{
+    uint32_t hash = 2166136261u;
+    int i;
+
+    hash = (hash ^ circuit_len) * 16777619u;
+    hash = (hash ^ remote_len) * 16777619u;
+
+    for (i = 0; i < circuit_len; i++)
+	hash = (hash ^ circuit_id[i]) * 16777619u;
+
+    for (i = 0; i < remote_len; i++)
+	hash = (hash ^ remote_id[i]) * 16777619u;
+
+    return hash;
+}
+
+/*
+ * Search the circuit of a key, NULL if it is not in the table.
+ */
+
+static circuit *
+lookup_circuit (circuit_table *table, uint8_t *circuit_id, uint8_t circuit_len,
+		uint8_t *remote_id, uint8_t remote_len)
+{
+    uint32_t hash = hash_circuit(circuit_id, circuit_len, remote_id, remote_len);
+    size_t mask = table->index_size - 1;
+    size_t i;
+
+    for (i = hash & mask; table->index[i] != 0; i = (i + 1) & mask) {
+	circuit *c = &table->circuits[table->index[i] - 1];
+	uint8_t *key = table->keys + c->key;
+
+	if (c->hash == hash &&
+	    c->circuit_len == circuit_len && c->remote_len == remote_len &&
+	    memcmp(key, circuit_id, circuit_len) == 0 &&
+	    memcmp(key + circuit_len, remote_id, remote_len) == 0)
+	    return c;
+    }
+
+    return NULL;
+}
+
+/*
+ * Insert a circuit in the hash index, doubling the index when
+ * it becomes three quarters full.
+ */
+
+static void
+index_circuit (circuit_table *table, uint32_t n)
+{
+    size_t mask, i;
+
+    if (4 * (size_t) (table->count + 1) > 3 * table->index_size) {
+	uint32_t j;
+
+	free(table->index);
+
+	table->index_size *= 2;
+	table->index = calloc(table->index_size, sizeof(*table->index));
+
+	for (j = 0; j < table->count; j++)
+	    index_circuit(table, j);
+    }
+
+    mask = table->index_size - 1;
+    i = table->circuits[n].hash & mask;
+
+    while (table->index[i] != 0)
+	i = (i + 1) & mask;
+
+    table->index[i] = n + 1;
+}
+
+/*
+ * Add a circuit, served from the given subnet (an index of the
+ * subnets of the pool) or with the given reserved address (if
+ * not zero).
+ *
+ * Return 0 on success, -1 if the key is empty or already in
+ * the table.
+ */
+
+int
+add_circuit (circuit_table *table, relay_agent_info *info, uint32_t subnet, uint32_t address)
+{
+    size_t len = info->circuit_len + info->remote_len;
+    circuit *c;
+
+    if (len == 0 ||
+	lookup_circuit(table, info->circuit_id, info->circuit_len,
+		       info->remote_id, info->remote_len) != NULL)
+	return -1;
+
+    if (table->count == table->size) {
+	table->size = table->size ? table->size * 2 : 64;
+	table->circuits = realloc(table->circuits, table->size * sizeof(circuit));
+    }
+
+    if (table->keys_len + len > table->keys_size) {
+	while (table->keys_len + len > table->keys_size)
+	    table->keys_size = table->keys_size ? table->keys_size * 2 : 4096;
+	table->keys = realloc(table->keys, table->keys_size);
+    }
+
+    c = &table->circuits[table->count];
+
+    c->hash        = hash_circuit(info->circuit_id, info->circuit_len,
+				  info->remote_id, info->remote_len);
+    c->key         = table->keys_len;
+    c->circuit_len = info->circuit_len;
+    c->remote_len  = info->remote_len;
+    c->subnet      = subnet;
+    c->address     = address;
+
+    if (info->circuit_len != 0)
+	memcpy(table->keys + table->keys_len, info->circuit_id, info->circuit_len);
+    if (info->remote_len != 0)
+	memcpy(table->keys + table->keys_len + info->circuit_len, info->remote_id, info->remote_len);
+    table->keys_len += len;
+
+    if (info->circuit_len == 0)
+	table->any_circuit++;
+    if (info->remote_len == 0)
+	table->any_remote++;
+
+    index_circuit(table, table->count);
+    table->count++;
+
+    return 0;
+}
+
+/*
+ * Search the circuit of the relay agent information of a request:
+ * the circuit with the same circuit id and remote id, else the one
+ * with the same circuit id and any remote id, else the one with
+ * any circuit id and the same remote id.
+ *
+ * Return NULL if there is no such circuit.
+ */
+
+circuit *
+search_circuit (circuit_table *table, relay_agent_info *info)
+{
+    circuit *c = NULL;
+
+    if (table->count == 0)
+	return NULL;
+
+    if (info->circuit_len != 0 && info->remote_len != 0)
+	c = lookup_circuit(table, info->circuit_id, info->circuit_len,
+			   info->remote_id, info->remote_len);
+
+    if (c == NULL && table->any_remote != 0 && info->circuit_len != 0)
+	c = lookup_circuit(table, info->circuit_id, info->circuit_len, (uint8_t *) "", 0);
+
+    if (c == NULL && table->any_circuit != 0 && info->remote_len != 0)
+	c = lookup_circuit(table, (uint8_t *) "", 0, info->remote_id, info->remote_len);
+
+    return c;
+}
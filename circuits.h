@@ -0,0 +1,62 @@
+#ifndef CIRCUITS_H
+#define CIRCUITS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "options.h"
+
+/*
+ * Table of the circuits of the relay agents, by agent circuit id
+ * and agent remote id (option 82): a circuit is served from the
+ * addresses of a subnet, or gets an address reserved to it.
+ *
+ * The keys (the circuit id followed by the remote id) are stored
+ * one after the other in a single buffer, and the circuits are
+ * indexed with an open addressing hash table, so a lookup costs
+ * a hash and a few probes whatever the number of circuits.
+ *
+ * An empty circuit id or remote id in the table matches any
+ * value (see search_circuit).
+ */
+
+struct circuit {
+    uint32_t hash;       // hash of the key
+    uint32_t key;        // offset of the key in the keys buffer
+    uint8_t circuit_len; // length of the circuit id
+    uint8_t remote_len;  // length of the remote id
+
+    uint32_t subnet;  // subnet of the circuit (of its reserved address)
+    uint32_t address; // address reserved to the circuit, zero if none
+};
+
+typedef struct circuit circuit;
+
+struct circuit_table {
+    circuit *circuits; // circuits, in the order they were added
+    uint32_t count;    // number of circuits
+    uint32_t size;     // number of circuits allocated
+
+    uint32_t *index;   // hash index: position of a circuit + 1, zero if empty
+    size_t index_size; // number of slots (a power of two)
+
+    uint8_t *keys;     // keys of the circuits
+    size_t keys_len;   // bytes used
+    size_t keys_size;  // bytes allocated
+
+    uint32_t any_circuit; // number of circuits with an empty circuit id
+    uint32_t any_remote;  // number of circuits with an empty remote id
+};
+
+typedef struct circuit_table circuit_table;
+
+/*
+ * Prototypes
+ */
+
+void init_circuit_table (circuit_table *table);
+void delete_circuit_table (circuit_table *table);
+int add_circuit (circuit_table *table, relay_agent_info *info, uint32_t subnet, uint32_t address);
+circuit *search_circuit (circuit_table *table, relay_agent_info *info);
+
+#endif
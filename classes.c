@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "classes.h"
+
+/*
+ * Initialize an empty matcher, with only the root node.
+ */
+
+void
+init_class_matcher (class_matcher *matcher)
+{
+    memset(matcher, 0, sizeof(*matcher));
+
+    matcher->size   = 64;
+    matcher->nnodes = 1;
+    matcher->nodes  = calloc(matcher->size, sizeof(class_node));
+
+    matcher->edges_size = 256;
+    matcher->edges = calloc(matcher->edges_size, sizeof(class_edge));
+}
+
+void
+delete_class_matcher (class_matcher *matcher)
+{
+    free(matcher->nodes);
+    free(matcher->edges);
+
+    memset(matcher, 0, sizeof(*matcher));
+}
+
+static size_t
+edge_slot (uint32_t from, uint8_t byte)
+{
+    uint32_t h = (from * 0x9e3779b1u) ^ (byte * 0x85ebca6bu);
+
+    return h ^ (h >> 15);
+}
+
+/*
+ * Return the child of a node for a byte, -1 if there is none.
+ */
+
+static long
+child_node (class_matcher *matcher, uint32_t node, uint8_t byte)
+{
+    size_t mask = matcher->edges_size - 1;
+    size_t i;
+
+    for (i = edge_slot(node, byte) & mask; matcher->edges[i].from != 0; i = (i + 1) & mask) {
+	if (matcher->edges[i].from == node + 1 && matcher->edges[i].byte == byte)
+	    return matcher->edges[i].to;
+    }
+
+    return -1;
+}
+
+static void
+insert_edge (class_matcher *matcher, class_edge *edge)
+{
+    size_t mask = matcher->edges_size - 1;
+    size_t i = edge_slot(edge->from - 1, edge->byte) & mask;
+
+    while (matcher->edges[i].from != 0)
+	i = (i + 1) & mask;
+
+    matcher->edges[i] = *edge;
+}
+
+/*
+ * Add the child of a node for a byte, doubling the edges table
+ * when it becomes three quarters full.
+ *
+ * Return the new node.
+ */
+
+static uint32_t
+add_child_node (class_matcher *matcher, uint32_t node, uint8_t byte)
+{
+    class_edge edge;
+
+    if (matcher->nnodes == matcher->size) {
+	matcher->size *= 2;
+	matcher->nodes = realloc(matcher->nodes, matcher->size * sizeof(class_node));
+    }
+
+    memset(&matcher->nodes[matcher->nnodes], 0, sizeof(class_node));
+
+    if (4 * (matcher->nedges + 1) > 3 * matcher->edges_size) {
+	class_edge *old = matcher->edges;
+	size_t old_size = matcher->edges_size;
+	size_t i;
+
+	matcher->edges_size *= 2;
+	matcher->edges = calloc(matcher->edges_size, sizeof(class_edge));
+
+	for (i = 0; i < old_size; i++) {
+	    if (old[i].from != 0)
+		insert_edge(matcher, &old[i]);
+	}
+
+	free(old);
+    }
+
+    edge.from = node + 1;
+    edge.to   = matcher->nnodes;
+    edge.byte = byte;
+
+    insert_edge(matcher, &edge);
+    matcher->nedges++;
+
+    return matcher->nnodes++;
+}
+
+/*
+ * Add a rule: the values of the given type equal to value (or
+ * starting with it, if prefix is set) select the given class.
+ *
+ * Return 0 on success, -1 if the same rule selects another class.
+ */
+
+int
+add_class_rule (class_matcher *matcher, uint8_t type, uint8_t *value, size_t len,
+		int prefix, unsigned int class)
+{
+    uint32_t node;
+    uint16_t *c;
+    long child;
+    size_t i;
+
+    if ((child = child_node(matcher, 0, type)) == -1)
+	child = add_child_node(matcher, 0, type);
+
+    node = child;
+
+    for (i = 0; i < len; i++) {
+	if ((child = child_node(matcher, node, value[i])) == -1)
+	    child = add_child_node(matcher, node, value[i]);
+
+	node = child;
+    }
+
+    c = prefix ? &matcher->nodes[node].prefix : &matcher->nodes[node].exact;
+
+    if (*c != 0 && *c != class + 1)
+	return -1;
+
+    *c = class + 1;
+
+    return 0;
+}
+
+/*
+ * Class of a value of the given type: the class of the rule equal
+ * to the value, else of the longest rule the value starts with.
+ *
+ * Return -1 if no rule matches.
+ */
+
+long
+match_class (class_matcher *matcher, uint8_t type, uint8_t *value, size_t len)
+{
+    long child = child_node(matcher, 0, type);
+    long class = -1;
+    size_t i;
+
+    for (i = 0; child != -1; i++) {
+	class_node *node = &matcher->nodes[child];
+
+	if (node->prefix != 0)
+	    class = node->prefix - 1;
+
+	if (i == len)
+	    return node->exact != 0 ? node->exact - 1 : class;
+
+	child = child_node(matcher, child, value[i]);
+    }
+
+    return class;
+}
+
+/*
+ * Class of a user class option: the option of an RFC 3004 client
+ * (e.g. ISC dhclient, systemd-networkd) is a sequence of length
+ * prefixed items, every item is matched and the first class wins;
+ * the option of other clients (e.g. Windows), or one where no item
+ * matches, is matched as a whole.
+ *
+ * Return -1 if no rule matches.
+ */
+
+long
+match_user_class (class_matcher *matcher, uint8_t *value, size_t len)
+{
+    long class, best = -1;
+    size_t i;
+
+    // every item has a length of at least one, and they fill the option
+
+    for (i = 0; i < len && value[i] != 0; i += 1 + value[i]) {
+	if (i + 1 + value[i] > len)
+	    break;
+    }
+
+    if (len > 0 && i == len) {
+	for (i = 0; i < len; i += 1 + value[i]) {
+	    class = match_class(matcher, CLASS_USER, value + i + 1, value[i]);
+
+	    if (class != -1 && (best == -1 || class < best))
+		best = class;
+	}
+    }
+
+    return best != -1 ? best : match_class(matcher, CLASS_USER, value, len);
+}
@@ -0,0 +1,80 @@
+#ifndef CLASSES_H
+#define CLASSES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "options.h"
+
+/*
+ * Client classes, selected by match rules on the vendor class
+ * identifier (option 60), the user class (option 77) or the OUI
+ * of the hardware address of the client. A class has its own
+ * options, sent instead of the ones of the subnet, and may be
+ * served from its own subnet.
+ *
+ * The rules are compiled in a trie over the bytes of the matched
+ * values (the first byte of a key is the type of the rule), whose
+ * edges are kept in an open addressing hash table: classifying a
+ * request costs a probe per byte of its values, whatever the number
+ * of classes and rules. A node holds the class of the values that
+ * end there, and the class of the values that start with it (the
+ * rules ending with *); the longest match wins. The items of an
+ * RFC 3004 user class are matched one by one (see match_user_class).
+ */
+
+enum {
+    CLASS_OUI    = 0,                       // first three bytes of the hardware address
+    CLASS_VENDOR = VENDOR_CLASS_IDENTIFIER, // option 60
+    CLASS_USER   = USER_CLASS               // option 77
+};
+
+struct client_class {
+    unsigned int id; // index of the class
+    char name[32];   // name of the class
+    long subnet;     // subnet of the class, -1 to use the subnet of the request
+
+    dhcp_option_table options; // options of the class, already encoded
+};
+
+typedef struct client_class client_class;
+
+struct class_node {
+    uint16_t exact;  // class of the values ending here + 1, zero if none
+    uint16_t prefix; // class of the values starting with this node + 1, zero if none
+};
+
+typedef struct class_node class_node;
+
+struct class_edge {
+    uint32_t from; // parent node + 1, zero if the slot is empty
+    uint32_t to;   // child node
+    uint8_t byte;  // byte of the value
+};
+
+typedef struct class_edge class_edge;
+
+struct class_matcher {
+    class_node *nodes; // node zero is the root
+    uint32_t nnodes;   // number of nodes
+    uint32_t size;     // number of nodes allocated
+
+    class_edge *edges;  // hash table of the edges
+    size_t nedges;      // number of edges
+    size_t edges_size;  // number of slots (a power of two)
+};
+
+typedef struct class_matcher class_matcher;
+
+/*
+ * Prototypes
+ */
+
+void init_class_matcher (class_matcher *matcher);
+void delete_class_matcher (class_matcher *matcher);
+int add_class_rule (class_matcher *matcher, uint8_t type, uint8_t *value, size_t len,
+		    int prefix, unsigned int class);
+long match_class (class_matcher *matcher, uint8_t type, uint8_t *value, size_t len);
+long match_user_class (class_matcher *matcher, uint8_t *value, size_t len);
+
+#endif
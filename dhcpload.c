@@ -0,0 +1,1134 @@
+/*
+ * dhcpload - load generator for a DHCP server.
+ *
+ * Simulates many clients, with distinct hardware addresses, on
+ * a network device (e.g. one end of a veth pair, the server on the
+ * other end in its own network namespace): the messages are sent and
+ * received as raw frames with an AF_PACKET socket, so the clients
+ * need no address.
+ *
+ * Every client loops: it gets a lease (DISCOVER, OFFER, REQUEST,
+ * ACK), renews it a number of times (REQUEST with ciaddr, ACK) and
+ * releases it. Alternatively the client messages of a pcap file are
+ * replayed by every client, in order, with the hardware address and
+ * the transaction id of the client, and the addresses of the last
+ * reply received.
+ *
+ * A transaction (a lease, a renewal or a replay of the file) is
+ * started at the given rate; the report has the transactions and
+ * the exchanges (a message and its reply) completed per second,
+ * their latency percentiles and the ones lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+
+#include "dhcp.h"
+#include "options.h"
+
+#define USAGE_TXT							\
+    "dhcpload - load generator for a DHCP server\n"			\
+    "usage: [-b] [-c clients] [-l seconds] [-n renewals] [-p file]\n"	\
+    "       [-r rate] [-t timeout] device\n"
+
+/*
+ * Usage description:
+ *  -b: ask the server to broadcast the replies
+ *  -c: number of clients (default 100)
+ *  -l: duration of the run, in seconds (default 10)
+ *  -n: renewals of every lease before it is released (default 1)
+ *  -p: replay the client messages of a pcap file
+ *  -r: transactions started per second (default 0, no limit)
+ *  -t: time to wait for a reply, in milliseconds (default 1000)
+ */
+
+enum {
+    MAX_CLIENTS = 1 << 24, // the client is in the low bits of the xid
+    FRAME_SIZE  = 1024,
+    IO_BATCH    = 64,      // frames sent or received with a system call
+    LAT_SUB     = 64,      // latency buckets per power of two
+    LAT_BUCKETS = LAT_SUB * 40
+};
+
+// client states
+enum {
+    INIT = 0,   // ready to get a lease
+    SELECTING,  // DISCOVER sent
+    REQUESTING, // REQUEST sent
+    BOUND,      // ready to renew the lease
+    RENEWING,   // REQUEST with ciaddr sent
+    REPLAYING   // message of the pcap file sent
+};
+
+// kinds of transaction
+enum {
+    TR_LEASE = 0,
+    TR_RENEWAL,
+    TR_REPLAY,
+    TR_MAX
+};
+
+static char *transaction_names[TR_MAX] = { "leases", "renewals", "replays" };
+
+struct client {
+    uint8_t mac[6];
+    uint8_t state;
+    uint8_t seq;          // transaction number, in the high bits of the xid
+    uint32_t xid;         // of the exchange in progress
+    uint32_t address;     // address offered or leased
+    uint32_t server_id;   // server of the offer or of the lease
+    uint8_t server_mac[6];
+    uint16_t renewals;    // renewals left before the release
+    uint32_t step;        // next message of the replay
+    uint64_t sent;        // start of the exchange in progress
+    uint64_t started;     // start of the transaction in progress
+};
+
+typedef struct client client;
+
+/*
+ * Log-linear histogram of latencies, in microseconds: LAT_SUB
+ * buckets for every power of two (about 1.5% of resolution).
+ */
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+typedef struct histogram histogram;
+
+struct stats {
+    uint64_t started;
+    uint64_t completed;
+    uint64_t lost;    // a reply did not arrive in time
+    uint64_t refused; // NAK received
+    histogram latency;
+};
+
+typedef struct stats stats;
+
+/*
+ * Pending exchanges, in the order they were sent (so in the
+ * order they time out). An entry is stale if the client has
+ * received the reply or started another exchange.
+ */
+
+struct pending {
+    uint32_t client;
+    uint32_t xid;
+    uint64_t deadline;
+};
+
+typedef struct pending pending;
+
+/*
+ * A client message of the pcap file.
+ */
+
+struct replay_msg {
+    dhcp_message msg;
+    size_t len;
+    uint8_t type;
+};
+
+typedef struct replay_msg replay_msg;
+
+static struct {
+    int broadcast;
+    unsigned int nclients;
+    unsigned int duration;
+    unsigned int renewals;
+    char *pcap;
+    unsigned int rate;
+    unsigned int timeout;
+    char *device;
+} settings = { 0, 100, 10, 1, NULL, 0, 1000, NULL };
+
+static int fd;
+static int ifindex;
+static uint8_t broadcast_mac[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static client *clients;
+
+static uint32_t *ready;          // clients ready to start a transaction
+static size_t ready_head, ready_tail;
+
+static pending *pendings;        // exchanges waiting for a reply
+static size_t pending_head, pending_tail, pending_size;
+static uint64_t outstanding;     // exchanges waiting, not stale
+
+static replay_msg *script;       // messages of the pcap file
+static size_t script_len;
+
+static stats transactions[TR_MAX];
+static stats exchanges;
+static uint64_t releases;
+
+static uint8_t out_frames[IO_BATCH][FRAME_SIZE];
+static struct iovec out_iov[IO_BATCH];
+static struct mmsghdr out_msgs[IO_BATCH];
+static unsigned int out_count;
+static uint64_t send_errors;
+
+static void
+usage (char *msg)
+{
+    fprintf(stderr, "%s", USAGE_TXT);
+
+    if (msg)
+	fprintf(stderr, "\n%s\n", msg);
+
+    exit(1);
+}
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Histogram routines.
+ */
+
+static void
+record_latency (histogram *h, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned int b;
+
+    if (us < LAT_SUB) {
+	b = us;
+    } else {
+	unsigned int e = 63 - __builtin_clzll(us); // at least log2(LAT_SUB)
+	b = (e - 5) * LAT_SUB + (us >> (e - 6)) - LAT_SUB;
+    }
+
+    if (b >= LAT_BUCKETS)
+	b = LAT_BUCKETS - 1;
+
+    h->buckets[b]++;
+    h->count++;
+
+    if (us > h->max)
+	h->max = us;
+}
+
+/*
+ * Upper bound of a bucket, in microseconds.
+ */
+
+static uint64_t
+bucket_value (unsigned int b)
+{
+    unsigned int e;
+
+    if (b < LAT_SUB)
+	return b;
+
+    e = b / LAT_SUB + 5;
+
+    return ((uint64_t) (b % LAT_SUB + LAT_SUB + 1) << (e - 6)) - 1;
+}
+
+static uint64_t
+percentile (histogram *h, double p)
+{
+    uint64_t rank = (uint64_t) (h->count * p);
+    uint64_t seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	seen += h->buckets[b];
+
+	if (seen > rank)
+	    return bucket_value(b) < h->max ? bucket_value(b) : h->max;
+    }
+
+    return h->max;
+}
+
+/*
+ * Frame routines.
+ */
+
+static uint16_t
+ip_checksum (void *data, size_t len)
+{
+    uint16_t *p = data;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+	sum += *p++;
+
+    if (len)
+	sum += *(uint8_t *) p;
+
+    while (sum >> 16)
+	sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/*
+ * Send the frames queued.
+ */
+
+static void
+flush_frames (void)
+{
+    unsigned int sent = 0;
+    int ret;
+
+    while (sent < out_count) {
+	if ((ret = sendmmsg(fd, out_msgs + sent, out_count - sent, 0)) == -1) {
+	    if (errno == EINTR)
+		continue;
+
+	    send_errors++; // the exchange times out
+	    sent++;
+	    continue;
+	}
+
+	sent += ret;
+    }
+
+    out_count = 0;
+}
+
+/*
+ * Queue a frame from a client to the server with the given message,
+ * sent with the others at the next flush_frames.
+ */
+
+static void
+queue_frame (client *c, uint8_t *mac, uint32_t src, uint32_t dst,
+	     dhcp_message *msg, size_t len)
+{
+    uint8_t *frame = out_frames[out_count];
+    struct ether_header *eth = (struct ether_header *) frame;
+    struct iphdr *ip = (struct iphdr *) (eth + 1);
+    struct udphdr *udp = (struct udphdr *) (ip + 1);
+
+    memcpy(eth->ether_dhost, mac, 6);
+    memcpy(eth->ether_shost, c->mac, 6);
+    eth->ether_type = htons(ETHERTYPE_IP);
+
+    memset(ip, 0, sizeof(*ip));
+    ip->version  = 4;
+    ip->ihl      = sizeof(*ip) / 4;
+    ip->tot_len  = htons(sizeof(*ip) + sizeof(*udp) + len);
+    ip->ttl      = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr    = src;
+    ip->daddr    = dst;
+    ip->check    = ip_checksum(ip, sizeof(*ip));
+
+    udp->source = htons(BOOTPC);
+    udp->dest   = htons(BOOTPS);
+    udp->len    = htons(sizeof(*udp) + len);
+    udp->check  = 0; // optional for IPv4
+
+    memcpy(udp + 1, msg, len);
+
+    out_iov[out_count].iov_base = frame;
+    out_iov[out_count].iov_len  = sizeof(*eth) + sizeof(*ip) + sizeof(*udp) + len;
+
+    if (++out_count == IO_BATCH)
+	flush_frames();
+}
+
+/*
+ * Open the packet socket on the device, receiving only the UDP
+ * datagrams to the client port.
+ */
+
+static int
+open_socket (char *device)
+{
+    struct sock_filter code[] = {
+	{ BPF_LD  | BPF_H | BPF_ABS, 0, 0, 12 },             // ether type
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 8, ETHERTYPE_IP },
+	{ BPF_LD  | BPF_B | BPF_ABS, 0, 0, 23 },             // protocol
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 6, IPPROTO_UDP },
+	{ BPF_LD  | BPF_H | BPF_ABS, 0, 0, 20 },             // fragment
+	{ BPF_JMP | BPF_JSET | BPF_K, 4, 0, 0x1fff },
+	{ BPF_LDX | BPF_B | BPF_MSH, 0, 0, 14 },             // header len
+	{ BPF_LD  | BPF_H | BPF_IND, 0, 0, 16 },             // destination port
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, BOOTPC },
+	{ BPF_RET | BPF_K,           0, 0, 0xffff },
+	{ BPF_RET | BPF_K,           0, 0, 0 },
+    };
+
+    struct sock_fprog prog = {
+	.len = sizeof(code) / sizeof(code[0]),
+	.filter = code
+    };
+
+    struct sockaddr_ll sll;
+    struct packet_mreq mr;
+    int size = 4 << 20;
+    int s;
+
+    if ((ifindex = if_nametoindex(device)) == 0)
+	return -1;
+
+    if ((s = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_IP))) == -1)
+	return -1;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex  = ifindex;
+
+    // the replies are addressed to the hardware addresses of the clients
+
+    memset(&mr, 0, sizeof(mr));
+    mr.mr_ifindex = ifindex;
+    mr.mr_type    = PACKET_MR_PROMISC;
+
+    if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1 ||
+	bind(s, (struct sockaddr *) &sll, sizeof(sll)) == -1 ||
+	setsockopt(s, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) == -1) {
+	close(s);
+	return -1;
+    }
+
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    return s;
+}
+
+/*
+ * Load the client messages (BOOTREQUEST to the server port) of
+ * a pcap file with Ethernet frames.
+ *
+ * Return the number of messages, -1 on error.
+ */
+
+static int
+load_pcap (char *path)
+{
+    uint32_t hdr[6], rec[4];
+    uint8_t frame[65536];
+    int swap;
+    FILE *f;
+
+    if ((f = fopen(path, "re")) == NULL)
+	return -1;
+
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+	(hdr[0] != 0xa1b2c3d4 && hdr[0] != 0xd4c3b2a1)) {
+	fclose(f);
+	return -1;
+    }
+
+    swap = hdr[0] == 0xd4c3b2a1;
+
+    if ((swap ? __builtin_bswap32(hdr[5]) : hdr[5]) != 1) { // Ethernet
+	fclose(f);
+	return -1;
+    }
+
+    while (fread(rec, sizeof(rec), 1, f) == 1) {
+	uint32_t len = swap ? __builtin_bswap32(rec[2]) : rec[2];
+	struct iphdr *ip = (struct iphdr *) (frame + sizeof(struct ether_header));
+	struct udphdr *udp;
+	dhcp_option_table opts;
+	dhcp_option *type;
+	replay_msg *m;
+	size_t off, payload;
+
+	if (len > sizeof(frame) || fread(frame, 1, len, f) != len)
+	    break;
+
+	if (len < sizeof(struct ether_header) + sizeof(*ip) + sizeof(*udp) ||
+	    ((struct ether_header *) frame)->ether_type != htons(ETHERTYPE_IP) ||
+	    ip->protocol != IPPROTO_UDP)
+	    continue;
+
+	off = sizeof(struct ether_header) + ip->ihl * 4;
+	udp = (struct udphdr *) (frame + off);
+	off += sizeof(*udp);
+
+	if (off >= len || udp->dest != htons(BOOTPS))
+	    continue;
+
+	payload = len - off;
+
+	if (payload < DHCP_HEADER_SIZE + 4 || payload > sizeof(dhcp_message) ||
+	    frame[off] != BOOTREQUEST)
+	    continue;
+
+	script = realloc(script, (script_len + 1) * sizeof(replay_msg));
+	m = &script[script_len];
+
+	memset(&m->msg, 0, sizeof(m->msg));
+	memcpy(&m->msg, frame + off, payload);
+	m->len = payload;
+
+	if (!parse_options_to_table(&opts, m->msg.options, payload - DHCP_HEADER_SIZE) ||
+	    (type = search_option(&opts, DHCP_MESSAGE_TYPE)) == NULL)
+	    continue;
+
+	m->type = type->data[0];
+	script_len++;
+    }
+
+    fclose(f);
+
+    return script_len;
+}
+
+/*
+ * Exchange routines.
+ */
+
+static void
+add_pending (client *c)
+{
+    if (pending_tail - pending_head == pending_size) {
+	pending *p = malloc(2 * pending_size * sizeof(pending));
+	size_t i;
+
+	for (i = 0; i < pending_size; i++)
+	    p[i] = pendings[(pending_head + i) % pending_size];
+
+	free(pendings);
+	pendings = p;
+	pending_tail = pending_size;
+	pending_head = 0;
+	pending_size *= 2;
+    }
+
+    pending *p = &pendings[pending_tail++ % pending_size];
+
+    p->client   = c - clients;
+    p->xid      = c->xid;
+    p->deadline = c->sent + (uint64_t) settings.timeout * 1000000;
+
+    outstanding++;
+    exchanges.started++;
+}
+
+static void
+push_ready (client *c)
+{
+    ready[ready_tail++ % settings.nclients] = c - clients;
+}
+
+/*
+ * Build a message of the client with the common fields and
+ * options, the other options are added by the caller.
+ */
+
+static void
+init_message (client *c, dhcp_message *msg, dhcp_option_buffer *opts, uint8_t type)
+{
+    static uint8_t prl[] = { SUBNET_MASK, ROUTER, DOMAIN_NAME_SERVER, DOMAIN_NAME,
+			     IP_ADDRESS_LEASE_TIME, RENEWAL_T1_TIME_VALUE,
+			     REBINDING_T2_TIME_VALUE };
+    dhcp_option opt;
+
+    memset(msg, 0, DHCP_HEADER_SIZE);
+
+    msg->op    = BOOTREQUEST;
+    msg->htype = ETHERNET;
+    msg->hlen  = ETHERNET_LEN;
+    msg->xid   = htonl(c->xid);
+    msg->flags = settings.broadcast ? htons(0x8000) : 0;
+    memcpy(msg->chaddr, c->mac, sizeof(c->mac));
+
+    init_option_buffer(opts, msg->options, sizeof(msg->options));
+
+    opt.id = DHCP_MESSAGE_TYPE;
+    opt.len = 1;
+    opt.data[0] = type;
+    write_option(opts, &opt);
+
+    if (type != DHCP_RELEASE) {
+	opt.id = PARAMETER_REQUEST_LIST;
+	opt.len = sizeof(prl);
+	memcpy(opt.data, prl, sizeof(prl));
+	write_option(opts, &opt);
+    }
+}
+
+static void
+write_address_option (dhcp_option_buffer *opts, uint8_t id, uint32_t address)
+{
+    dhcp_option opt;
+
+    opt.id = id;
+    opt.len = 4;
+    memcpy(opt.data, &address, 4);
+    write_option(opts, &opt);
+}
+
+/*
+ * Send the next message of a client, for its state: a DISCOVER to
+ * get a lease, the REQUEST of an offer or of a renewal, a RELEASE.
+ */
+
+static void
+send_discover (client *c, uint64_t now)
+{
+    dhcp_message msg;
+    dhcp_option_buffer opts;
+
+    c->xid = (uint32_t) ++c->seq << 24 | (c - clients);
+    c->state = SELECTING;
+    c->sent = c->started = now;
+
+    init_message(c, &msg, &opts, DHCP_DISCOVER);
+    queue_frame(c, broadcast_mac, INADDR_ANY, INADDR_BROADCAST, &msg,
+		DHCP_HEADER_SIZE + finish_option_buffer(&opts));
+    add_pending(c);
+}
+
+static void
+send_request (client *c, uint64_t now)
+{
+    dhcp_message msg;
+    dhcp_option_buffer opts;
+
+    c->state = REQUESTING;
+    c->sent = now;
+
+    init_message(c, &msg, &opts, DHCP_REQUEST);
+    write_address_option(&opts, REQUESTED_IP_ADDRESS, c->address);
+    write_address_option(&opts, SERVER_IDENTIFIER, c->server_id);
+    queue_frame(c, broadcast_mac, INADDR_ANY, INADDR_BROADCAST, &msg,
+		DHCP_HEADER_SIZE + finish_option_buffer(&opts));
+    add_pending(c);
+}
+
+static void
+send_renewal (client *c, uint64_t now)
+{
+    dhcp_message msg;
+    dhcp_option_buffer opts;
+
+    c->xid = (uint32_t) ++c->seq << 24 | (c - clients);
+    c->state = RENEWING;
+    c->sent = c->started = now;
+
+    init_message(c, &msg, &opts, DHCP_REQUEST);
+    msg.ciaddr = c->address;
+    queue_frame(c, c->server_mac, c->address, c->server_id, &msg,
+		DHCP_HEADER_SIZE + finish_option_buffer(&opts));
+    add_pending(c);
+}
+
+static void
+send_release (client *c)
+{
+    dhcp_message msg;
+    dhcp_option_buffer opts;
+
+    c->xid = (uint32_t) ++c->seq << 24 | (c - clients);
+    c->state = INIT;
+
+    init_message(c, &msg, &opts, DHCP_RELEASE);
+    msg.ciaddr = c->address;
+    write_address_option(&opts, SERVER_IDENTIFIER, c->server_id);
+    queue_frame(c, c->server_mac, c->address, c->server_id, &msg,
+		DHCP_HEADER_SIZE + finish_option_buffer(&opts));
+
+    releases++;
+}
+
+/*
+ * Send the messages of the pcap file from the current step of the
+ * replay of a client, up to the first one with a reply.
+ *
+ * Return 1 if the replay is over, 0 if a reply is awaited.
+ */
+
+static int
+send_replay (client *c, uint64_t now)
+{
+    for (; c->step < script_len; c->step++) {
+	replay_msg *m = &script[c->step];
+	dhcp_message msg = m->msg;
+	dhcp_option_table opts;
+	uint8_t *mac = broadcast_mac;
+	uint32_t src = INADDR_ANY, dst = INADDR_BROADCAST;
+
+	memcpy(msg.chaddr, c->mac, sizeof(c->mac));
+	msg.xid = htonl(c->xid);
+
+	// the addresses of the capture are replaced with the ones received
+
+	if (parse_options_to_table(&opts, msg.options, m->len - DHCP_HEADER_SIZE) &&
+	    c->address != 0) {
+	    dhcp_option *opt;
+
+	    if ((opt = search_option(&opts, REQUESTED_IP_ADDRESS)) != NULL && opt->len == 4)
+		memcpy(opt->data, &c->address, 4);
+
+	    if ((opt = search_option(&opts, SERVER_IDENTIFIER)) != NULL && opt->len == 4)
+		memcpy(opt->data, &c->server_id, 4);
+	}
+
+	if (msg.ciaddr != 0 && c->address != 0) {
+	    msg.ciaddr = c->address;
+	    mac = c->server_mac;
+	    src = c->address;
+	    dst = c->server_id;
+	}
+
+	queue_frame(c, mac, src, dst, &msg, m->len);
+
+	if (m->type == DHCP_DISCOVER || m->type == DHCP_REQUEST || m->type == DHCP_INFORM) {
+	    c->state = REPLAYING;
+	    c->sent = now;
+	    add_pending(c);
+	    c->step++;
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+/*
+ * Start the next transaction of a client.
+ */
+
+static void
+start_transaction (client *c, uint64_t now)
+{
+    if (script != NULL) {
+	c->xid = (uint32_t) ++c->seq << 24 | (c - clients);
+	c->step = 0;
+	c->started = now;
+	transactions[TR_REPLAY].started++;
+
+	if (send_replay(c, now)) { // nothing to wait for
+	    transactions[TR_REPLAY].completed++;
+	    record_latency(&transactions[TR_REPLAY].latency, 0);
+	    push_ready(c);
+	}
+
+    } else if (c->state == BOUND) {
+	transactions[TR_RENEWAL].started++;
+	send_renewal(c, now);
+
+    } else {
+	transactions[TR_LEASE].started++;
+	send_discover(c, now);
+    }
+}
+
+static void
+complete_transaction (client *c, int kind, uint64_t now)
+{
+    transactions[kind].completed++;
+    record_latency(&transactions[kind].latency, now - c->started);
+}
+
+/*
+ * The lease of a client is acked: it is renewed, or released
+ * when there are no renewals left.
+ */
+
+static void
+lease_acked (client *c)
+{
+    if (c->renewals > 0) {
+	c->renewals--;
+	c->state = BOUND;
+    } else {
+	send_release(c);
+    }
+
+    push_ready(c);
+}
+
+/*
+ * Handle a frame received: a reply to the exchange in progress
+ * of a client advances its state.
+ */
+
+static void
+handle_frame (uint8_t *frame, size_t len, uint64_t now)
+{
+    struct ether_header *eth = (struct ether_header *) frame;
+    struct iphdr *ip = (struct iphdr *) (eth + 1);
+    dhcp_message *msg;
+    dhcp_option_table opts;
+    dhcp_option *type_opt, *server_opt;
+    uint32_t xid, server_id = 0;
+    size_t off;
+    client *c;
+
+    off = sizeof(*eth) + ip->ihl * 4 + sizeof(struct udphdr);
+
+    if (len < off + DHCP_HEADER_SIZE + 4)
+	return;
+
+    msg = (dhcp_message *) (frame + off);
+    xid = ntohl(msg->xid);
+
+    if (msg->op != BOOTREPLY || (xid & (MAX_CLIENTS - 1)) >= settings.nclients)
+	return;
+
+    c = &clients[xid & (MAX_CLIENTS - 1)];
+
+    if (c->xid != xid || c->state == INIT || c->state == BOUND ||
+	memcmp(msg->chaddr, c->mac, sizeof(c->mac)) != 0)
+	return; // not for an exchange in progress
+
+    if (!parse_options_to_table(&opts, msg->options, len - off - DHCP_HEADER_SIZE) ||
+	(type_opt = search_option(&opts, DHCP_MESSAGE_TYPE)) == NULL)
+	return;
+
+    if ((server_opt = search_option(&opts, SERVER_IDENTIFIER)) != NULL && server_opt->len == 4)
+	memcpy(&server_id, server_opt->data, 4);
+
+    switch (c->state) {
+
+    case SELECTING:
+	if (type_opt->data[0] != DHCP_OFFER)
+	    return;
+
+	c->address   = msg->yiaddr;
+	c->server_id = server_id;
+	memcpy(c->server_mac, eth->ether_shost, 6);
+	break;
+
+    case REQUESTING:
+    case RENEWING:
+	if (type_opt->data[0] != DHCP_ACK && type_opt->data[0] != DHCP_NAK)
+	    return;
+	break;
+
+    }
+
+    // the exchange is completed
+
+    exchanges.completed++;
+    record_latency(&exchanges.latency, now - c->sent);
+    outstanding--;
+
+    switch (c->state) {
+
+    case SELECTING:
+	send_request(c, now);
+	break;
+
+    case REQUESTING:
+    case RENEWING: {
+	int kind = c->state == REQUESTING ? TR_LEASE : TR_RENEWAL;
+
+	if (type_opt->data[0] == DHCP_NAK) {
+	    transactions[kind].refused++;
+	    exchanges.refused++;
+	    c->state = INIT;
+	    push_ready(c);
+	    break;
+	}
+
+	complete_transaction(c, kind, now);
+
+	if (kind == TR_LEASE)
+	    c->renewals = settings.renewals;
+
+	lease_acked(c);
+	break;
+    }
+
+    case REPLAYING:
+	if (msg->yiaddr != 0)
+	    c->address = msg->yiaddr;
+
+	if (server_id != 0) {
+	    c->server_id = server_id;
+	    memcpy(c->server_mac, eth->ether_shost, 6);
+	}
+
+	if (send_replay(c, now)) {
+	    c->state = INIT;
+	    complete_transaction(c, TR_REPLAY, now);
+	    push_ready(c);
+	}
+	break;
+
+    }
+}
+
+/*
+ * Expire the exchanges without a reply: the client starts over.
+ */
+
+static void
+expire_pending (uint64_t now)
+{
+    while (pending_head != pending_tail) {
+	pending *p = &pendings[pending_head % pending_size];
+	client *c = &clients[p->client];
+
+	if (p->deadline > now)
+	    break;
+
+	pending_head++;
+
+	if (c->xid != p->xid || c->sent + (uint64_t) settings.timeout * 1000000 != p->deadline ||
+	    c->state == INIT || c->state == BOUND)
+	    continue; // stale
+
+	outstanding--;
+	exchanges.lost++;
+
+	switch (c->state) {
+	case SELECTING:
+	case REQUESTING:
+	    transactions[TR_LEASE].lost++;
+	    break;
+	case RENEWING:
+	    transactions[TR_RENEWAL].lost++;
+	    break;
+	case REPLAYING:
+	    transactions[TR_REPLAY].lost++;
+	    break;
+	}
+
+	c->state = INIT;
+	push_ready(c);
+    }
+}
+
+/*
+ * Receive the frames waiting on the socket.
+ */
+
+static void
+receive_frames (void)
+{
+    static uint8_t frames[IO_BATCH][FRAME_SIZE];
+    static struct iovec iov[IO_BATCH];
+    static struct mmsghdr msgs[IO_BATCH];
+    unsigned int i;
+    uint64_t now;
+    int n;
+
+    for (i = 0; i < IO_BATCH; i++) {
+	iov[i].iov_base = frames[i];
+	iov[i].iov_len  = FRAME_SIZE;
+	msgs[i].msg_hdr.msg_iov    = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while ((n = recvmmsg(fd, msgs, IO_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+	now = now_ns();
+
+	for (i = 0; i < n; i++)
+	    handle_frame(frames[i], msgs[i].msg_len, now);
+
+	flush_frames();
+    }
+}
+
+static void
+print_stats (char *name, stats *s, double elapsed)
+{
+    printf("%-12s %10llu completed %10.1f/s %8llu lost (%.2f%%) %6llu refused\n",
+	   name, (unsigned long long) s->completed, s->completed / elapsed,
+	   (unsigned long long) s->lost,
+	   s->started ? 100.0 * s->lost / s->started : 0.0,
+	   (unsigned long long) s->refused);
+
+    if (s->latency.count > 0)
+	printf("%-12s p50 %llu us, p99 %llu us, p999 %llu us, max %llu us\n", "",
+	       (unsigned long long) percentile(&s->latency, 0.5),
+	       (unsigned long long) percentile(&s->latency, 0.99),
+	       (unsigned long long) percentile(&s->latency, 0.999),
+	       (unsigned long long) s->latency.max);
+}
+
+static void
+parse_args (int argc, char *argv[])
+{
+    int c;
+
+    opterr = 0;
+
+    while ((c = getopt(argc, argv, "bc:l:n:p:r:t:")) != -1) {
+	char *end;
+	long n = 0;
+
+	if (c != 'b' && c != 'p' && c != '?') {
+	    n = strtol(optarg, &end, 0);
+
+	    if (*optarg == '\0' || *end != '\0' || n < 0)
+		usage("error: invalid number.");
+	}
+
+	switch (c) {
+
+	case 'b':
+	    settings.broadcast = 1;
+	    break;
+
+	case 'c':
+	    if (n < 1 || n >= MAX_CLIENTS)
+		usage("error: invalid number of clients.");
+	    settings.nclients = n;
+	    break;
+
+	case 'l':
+	    if (n < 1)
+		usage("error: invalid duration.");
+	    settings.duration = n;
+	    break;
+
+	case 'n':
+	    settings.renewals = n;
+	    break;
+
+	case 'p':
+	    settings.pcap = optarg;
+	    break;
+
+	case 'r':
+	    settings.rate = n;
+	    break;
+
+	case 't':
+	    if (n < 1)
+		usage("error: invalid timeout.");
+	    settings.timeout = n;
+	    break;
+
+	case '?':
+	default:
+	    usage(NULL);
+	}
+    }
+
+    if (optind >= argc)
+	usage("error: network device not provided.");
+
+    settings.device = argv[optind];
+}
+
+int
+main (int argc, char *argv[])
+{
+    uint64_t start, end, now, last;
+    double tokens = 0, elapsed;
+    unsigned int i;
+
+    parse_args(argc, argv);
+
+    if (settings.pcap != NULL && load_pcap(settings.pcap) <= 0) {
+	fprintf(stderr, "dhcpload: no client messages in %s\n", settings.pcap);
+	exit(1);
+    }
+
+    if ((fd = open_socket(settings.device)) == -1) {
+	perror("dhcpload: can not open the packet socket");
+	exit(1);
+    }
+
+    for (i = 0; i < IO_BATCH; i++) {
+	out_msgs[i].msg_hdr.msg_iov    = &out_iov[i];
+	out_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    clients = calloc(settings.nclients, sizeof(client));
+    ready   = malloc(settings.nclients * sizeof(uint32_t));
+
+    pending_size = settings.nclients;
+    pendings = malloc(pending_size * sizeof(pending));
+
+    // locally administered addresses, 02:00 and the client number
+
+    for (i = 0; i < settings.nclients; i++) {
+	clients[i].mac[0] = 0x02;
+	clients[i].mac[2] = i >> 24;
+	clients[i].mac[3] = i >> 16;
+	clients[i].mac[4] = i >> 8;
+	clients[i].mac[5] = i;
+	push_ready(&clients[i]);
+    }
+
+    start = last = now_ns();
+    end = start + (uint64_t) settings.duration * 1000000000;
+
+    for (now = start; now < end || outstanding > 0; now = now_ns()) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	// start the transactions allowed by the rate (with 10 ms of burst)
+
+	if (settings.rate > 0) {
+	    tokens += (double) (now - last) * settings.rate / 1e9;
+
+	    if (tokens > settings.rate / 100.0 + 1)
+		tokens = settings.rate / 100.0 + 1;
+	}
+
+	last = now;
+
+	while (now < end && ready_head != ready_tail &&
+	       (settings.rate == 0 || tokens >= 1)) {
+	    start_transaction(&clients[ready[ready_head++ % settings.nclients]], now);
+	    tokens -= 1;
+
+	    if (settings.rate == 0 && out_count == 0)
+		break; // a batch was sent, receive the replies
+	}
+
+	flush_frames();
+
+	poll(&pfd, 1, 1);
+
+	now = now_ns();
+	receive_frames();
+	expire_pending(now);
+    }
+
+    elapsed = (now - start) / 1e9;
+
+    printf("dhcpload: %u clients on %s, %.1f s\n", settings.nclients, settings.device, elapsed);
+
+    for (i = 0; i < TR_MAX; i++) {
+	if (transactions[i].started > 0)
+	    print_stats(transaction_names[i], &transactions[i], elapsed);
+    }
+
+    print_stats("exchanges", &exchanges, elapsed);
+
+    if (releases > 0)
+	printf("%-12s %10llu sent\n", "releases", (unsigned long long) releases);
+
+    if (send_errors > 0)
+	printf("%-12s %10llu\n", "send errors", (unsigned long long) send_errors);
+
+    return 0;
+}
@@ -7,23 +7,29 @@
 #include <ctype.h>
 #include <regex.h>
 #include <unistd.h>
+#include <poll.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
-#include <sys/ioctl.h>
-#include <net/if_arp.h>
 #include <net/if.h>
+#include <sys/signalfd.h>
+#include <linux/filter.h>
 
 #include "dhcpserver.h"
+#include "event.h"
 #include "bindings.h"
 #include "args.h"
 #include "dhcp.h"
 #include "options.h"
 #include "logging.h"
+#include "snapshot.h"
 
 /*
  * Global pool
@@ -31,6 +37,46 @@
 
 address_pool pool;
 
+/*
+ * Global settings
+ */
+
+server_settings settings;
+
+/*
+ * XDP program of the AF_XDP backend
+ */
+
+xdp_program xdp;
+
+/*
+ * Lease journal, and the last record appended by the current thread
+ */
+
+journal lease_journal;
+char *snapshot_path;
+
+static __thread uint64_t journal_seq;
+
+/*
+ * Multiplier used to hash the hardware address of a client
+ * to the shard (and to the worker) of the client.
+ */
+
+#define SHARD_HASH 0x9e3779b1
+
+/*
+ * Interval of the housekeeping of the workers (in milliseconds).
+ */
+
+#define HOUSEKEEPING_INTERVAL 1000
+
+/*
+ * Space for the IP_PKTINFO of a message received.
+ */
+
+#define BATCH_CONTROL CMSG_SPACE(sizeof(struct in_pktinfo))
+
 /*
  * Helper functions
  */
@@ -38,15 +84,15 @@ address_pool pool;
 char *
 str_ip (uint32_t ip)
 {
-    struct in_addr addr;
-    memcpy(&addr, &ip, sizeof(ip));
-    return inet_ntoa(addr);
+    static __thread char str[INET_ADDRSTRLEN];
+
+    return (char *) inet_ntop(AF_INET, &ip, str, sizeof(str));
 }
 
 char *
 str_mac (uint8_t *mac)
 {
-    static char str[128];
+    static __thread char str[128];
 
     sprintf(str, "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x",
 	    mac[0], mac[1], mac[2],
@@ -75,83 +121,248 @@ str_status (int status)
 }
 
 /*
- * Network related routines
+ * Append the new status of a dynamic binding to the lease journal.
  */
 
 void
-add_arp_entry (int s, uint8_t *mac, uint32_t ip)
+journal_binding (binding_list *list, address_binding *binding)
 {
-    struct arpreq ar;
-    struct sockaddr_in *sock;
+    journal_record rec;
 
-    memset(&ar, 0, sizeof(ar));
+    if (lease_journal.fd == -1 || binding->is_static)
+	return;
 
-    /* add a proxy ARP entry for given pair */
-    
-    sock = (struct sockaddr_in *) &ar.arp_pa;
-    sock->sin_family = AF_INET;
-    sock->sin_addr.s_addr = ip;
+    memset(&rec, 0, sizeof(rec));
+    rec.address      = binding->address;
+    rec.binding_time = binding->binding_time;
+    rec.lease_time   = binding->lease_time;
+    rec.status       = binding->status;
+    rec.cident_len   = binding->cident_len;
+    memcpy(rec.cident, binding_cident(list, binding), binding->cident_len);
+
+    journal_seq = append_journal(&lease_journal, &rec);
+}
+
+/*
+ * Complete a reply before it is sent, setting its destination:
+ * the relay agent of a relayed request, else the client.
+ *
+ * Return the len of the reply.
+ */
 
-    memcpy(ar.arp_ha.sa_data, mac, 6);
-    ar.arp_flags = ATF_COM; //(ATF_PUBL | ATF_COM);
+size_t
+finish_dhcp_reply (struct sockaddr_in *client_sock, dhcp_msg *reply)
+{
+    size_t len;
+
+    len = finish_option_buffer(&reply->reply_opts);
 
-    strncpy(ar.arp_dev, pool.device, sizeof(ar.arp_dev));
+    len += DHCP_HEADER_SIZE;
     
-    if (ioctl(s, SIOCSARP, (char *) &ar) < 0)  {
-	perror("error adding entry to arp table");
-    };    
+    if (reply->hdr.giaddr != 0) {
+	client_sock->sin_addr.s_addr = reply->hdr.giaddr;
+	client_sock->sin_port = htons(BOOTPS);
+    } else {
+	client_sock->sin_addr.s_addr = reply->hdr.yiaddr; // use the address assigned by us
+    }
+
+    return len;
+}
+
+/*
+ * Check if a reply is sent by a worker with a raw frame (through
+ * its AF_XDP socket or its packet socket): only to the clients on
+ * the local network (the relayed ones are reached by routing).
+ */
+
+int
+raw_reply (dhcp_worker *worker, dhcp_msg *request)
+{
+    return request->hdr.giaddr == 0 && (worker->xsk.fd != -1 || worker->tx.fd != -1);
 }
 
+/*
+ * Queue a reply in the AF_XDP socket or in the packet socket of
+ * a worker, addressed as in RFC 2131 section 4.1: broadcast for a
+ * NAK, to ciaddr if the client has an address, broadcast if the
+ * client asked for it, otherwise to chaddr and yiaddr.
+ */
+
 void
-delete_arp_entry (int s, uint8_t *mac, uint32_t ip)
+queue_raw_reply (dhcp_worker *worker, dhcp_msg *request, dhcp_msg *reply)
 {
-    struct arpreq ar;
-    struct sockaddr_in *sock;
+    static uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    uint8_t *mac = reply->hdr.chaddr;
+    uint32_t address = reply->hdr.yiaddr;
+    size_t len;
+    int ret;
 
-    memset(&ar, 0, sizeof(ar));
-    
-    sock = (struct sockaddr_in *) &ar.arp_pa;
-    sock->sin_family = AF_INET;
-    sock->sin_addr.s_addr = ip;
+    len = finish_option_buffer(&reply->reply_opts) + DHCP_HEADER_SIZE;
 
-    strncpy(ar.arp_dev, pool.device, sizeof(ar.arp_dev));
+    if (reply->reply_type == DHCP_NAK) {
+	mac = broadcast;
+	address = INADDR_BROADCAST;
 
-    if(ioctl(s, SIOCGARP, (char *) &ar) < 0)  {
-	if (errno != ENXIO) {
-	    perror("error getting arp entry");
-	    return;
-	}
-    };
-    
-    if(ip == 0 || memcmp(mac, ar.arp_ha.sa_data, 6) == 0) { 
-	if(ioctl(s, SIOCDARP, (char *) &ar) < 0) {
-	    perror("error removing arp table entry");
-	}
+    } else if (request->hdr.ciaddr != 0)
+	address = request->hdr.ciaddr;
+
+    else if ((ntohs(request->hdr.flags) & 0x8000) || address == 0 ||
+	     request->hdr.htype != 1 || request->hdr.hlen != 6) {
+	mac = broadcast;
+	address = INADDR_BROADCAST;
+    }
+
+    if (worker->xsk.fd != -1)
+	ret = queue_xdp_packet(&worker->xsk, mac, address, &reply->hdr, len);
+    else
+	ret = queue_packet(&worker->tx, mac, address, &reply->hdr, len);
+
+    if (ret == -1) {
+	log_event(EV_SEND_FAILED, reply->hdr.chaddr, 0, 0);
+	count_metric(&worker->metrics.outcomes[OUT_SEND_FAILED], 1);
+    }
+}
+
+/*
+ * Batched I/O routines.
+ */
+
+void
+init_batch (dhcp_batch *batch, unsigned int size)
+{
+    batch->size = size;
+
+    batch->requests = calloc(size, sizeof(dhcp_msg));
+    batch->replies  = calloc(size, sizeof(dhcp_msg));
+    batch->clients  = calloc(size, sizeof(struct sockaddr_in));
+    batch->control  = calloc(size, BATCH_CONTROL);
+
+    batch->in_iov  = calloc(size, sizeof(struct iovec));
+    batch->out_iov = calloc(size, sizeof(struct iovec));
+    batch->in  = calloc(size, sizeof(struct mmsghdr));
+    batch->out = calloc(size, sizeof(struct mmsghdr));
+    batch->served = calloc(size, sizeof(unsigned int));
+
+    if (!batch->requests || !batch->replies || !batch->clients || !batch->control ||
+	!batch->in_iov || !batch->out_iov || !batch->in || !batch->out || !batch->served) {
+	perror("server: calloc()");
+	exit(1);
+    }
+
+    unsigned int i;
+    for (i = 0; i < size; i++) {
+	batch->in_iov[i].iov_base = &batch->requests[i].hdr;
+	batch->in_iov[i].iov_len  = sizeof(batch->requests[i].hdr);
+
+	batch->in[i].msg_hdr.msg_iov    = &batch->in_iov[i];
+	batch->in[i].msg_hdr.msg_iovlen = 1;
     }
 }
 
+/*
+ * Receive up to a batch of messages: wait for the first one,
+ * then for at most timeout milliseconds for the others.
+ *
+ * Return the number of messages received.
+ */
+
 int
-send_dhcp_reply	(int s, struct sockaddr_in *client_sock, dhcp_msg *reply)
+receive_batch (int s, dhcp_batch *batch, unsigned int timeout)
 {
-    size_t len, ret;
+    struct timespec start, now;
+    unsigned int i;
+    int n, ret;
 
-    len = serialize_option_list(&reply->opts, reply->hdr.options,
-				sizeof(reply->hdr) - DHCP_HEADER_SIZE);
+    for (i = 0; i < batch->size; i++) {
+	batch->in[i].msg_hdr.msg_name    = &batch->clients[i];
+	batch->in[i].msg_hdr.msg_namelen = sizeof(batch->clients[i]);
 
-    len += DHCP_HEADER_SIZE;
-    
-    client_sock->sin_addr.s_addr = reply->hdr.yiaddr; // use the address assigned by us
+	batch->in[i].msg_hdr.msg_control    = batch->control + i * BATCH_CONTROL;
+	batch->in[i].msg_hdr.msg_controllen = BATCH_CONTROL;
+    }
 
-    if(reply->hdr.yiaddr != 0) {
-	add_arp_entry(s, reply->hdr.chaddr, reply->hdr.yiaddr);
+    if ((n = recvmmsg(s, batch->in, batch->size, MSG_WAITFORONE, NULL)) < 0) {
+	if (errno != EINTR && errno != EAGAIN)
+	    log_event(EV_RECEIVE_ERROR, NULL, 0, errno);
+	return 0;
     }
 
-    if ((ret = sendto(s, reply, len, 0, (struct sockaddr *)client_sock, sizeof(*client_sock))) < 0) {
-	perror("sendto failed");
-	return -1;
+    if (timeout == 0)
+	return n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (n < batch->size) {
+	struct pollfd pfd = { .fd = s, .events = POLLIN };
+	long elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+	    (now.tv_nsec - start.tv_nsec) / 1000000;
+
+	if (elapsed >= timeout || poll(&pfd, 1, timeout - elapsed) <= 0)
+	    break;
+
+	if ((ret = recvmmsg(s, batch->in + n, batch->size - n, MSG_DONTWAIT, NULL)) <= 0)
+	    break;
+
+	n += ret;
+    }
+
+    return n;
+}
+
+/*
+ * Send a batch of replies: a reply that can not be sent is skipped.
+ *
+ * Return the number of replies skipped.
+ */
+
+unsigned int
+send_batch (int s, dhcp_batch *batch, unsigned int n)
+{
+    unsigned int sent = 0, failed = 0;
+    int ret;
+
+    while (sent < n) {
+
+	if ((ret = sendmmsg(s, batch->out + sent, n - sent, 0)) < 0) {
+	    if (errno == EINTR)
+		continue;
+
+	    log_event(EV_SEND_ERROR, NULL, 0, errno);
+	    sent++;
+	    failed++;
+	    continue;
+	}
+
+	sent += ret;
+    }
+
+    return failed;
+}
+
+/*
+ * Address of the interface that received a message (from its
+ * IP_PKTINFO), or the server address if it is not known (e.g. the
+ * message was received by the AF_XDP backend, on the server device).
+ */
+
+uint32_t
+receive_address (struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+	if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+	    struct in_pktinfo info;
+
+	    memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+	    return info.ipi_spec_dst.s_addr;
+	}
     }
 
-    return ret;
+    return pool.server_id;
 }
 
 /*
@@ -161,13 +372,11 @@ send_dhcp_reply	(int s, struct sockaddr_in *client_sock, dhcp_msg *reply)
 uint8_t
 expand_request (dhcp_msg *request, size_t len)
 {
-    init_option_list(&request->opts);
-    
     if (request->hdr.hlen < 1 || request->hdr.hlen > 16)
 	return 0;
 
-    if(parse_options_to_list(&request->opts, (dhcp_option *)request->hdr.options,
-			     len - DHCP_HEADER_SIZE) == 0)
+    if(parse_options_to_table(&request->opts, request->hdr.options,
+			      len - DHCP_HEADER_SIZE) == 0)
 	return 0;
     
     dhcp_option *type_opt = search_option(&request->opts, DHCP_MESSAGE_TYPE);
@@ -185,7 +394,8 @@ init_reply (dhcp_msg *request, dhcp_msg *reply)
 {
     memset(&reply->hdr, 0, sizeof(reply->hdr));
 
-    init_option_list(&reply->opts);
+    init_option_buffer(&reply->reply_opts, reply->hdr.options,
+		       sizeof(reply->hdr) - DHCP_HEADER_SIZE);
     
     reply->hdr.op = BOOTREPLY;
 
@@ -202,75 +412,108 @@ init_reply (dhcp_msg *request, dhcp_msg *reply)
     return 1;
 }
 
-void
-fill_requested_dhcp_options (dhcp_option *requested_opts, dhcp_option_list *reply_opts)
-{
-    uint8_t len = requested_opts->len;
-    uint8_t *id = requested_opts->data;
-
-    int i;
-    for (i = 0; i < len; i++) {
-	    
-	if(id[i] != 0) {
-	    dhcp_option *opt = search_option(&pool.options, id[i]);
-
-	    if(opt != NULL)
-		append_option(reply_opts, opt);
-	}
-	    
-    }
-}
-
 int
-fill_dhcp_reply (dhcp_msg *request, dhcp_msg *reply,
+fill_dhcp_reply (dhcp_msg *request, dhcp_msg *reply, subnet_pool *subnet,
 		 address_binding *binding, uint8_t type)
 {
-    static dhcp_option type_opt, server_id_opt;
+    dhcp_option type_opt, server_id_opt;
+
+    reply->reply_type = type;
 
     type_opt.id = DHCP_MESSAGE_TYPE;
     type_opt.len = 1;
     type_opt.data[0] = type;
-    append_option(&reply->opts, &type_opt);
+    write_option(&reply->reply_opts, &type_opt);
 
     server_id_opt.id = SERVER_IDENTIFIER;
     server_id_opt.len = 4;
     memcpy(server_id_opt.data, &pool.server_id, sizeof(pool.server_id));
-    append_option(&reply->opts, &server_id_opt);
+    write_option(&reply->reply_opts, &server_id_opt);
+
+    // an ack to a discover commits the binding, and says so (RFC 4039)
+
+    dhcp_option *type_req = search_option(&request->opts, DHCP_MESSAGE_TYPE);
+
+    if (type == DHCP_ACK && type_req != NULL && type_req->data[0] == DHCP_DISCOVER) {
+	dhcp_option rapid_opt = { RAPID_COMMIT, 0 };
+	write_option(&reply->reply_opts, &rapid_opt);
+    }
     
     if(binding != NULL) {
 	reply->hdr.yiaddr = binding->address;
     }
     
-    if (type != DHCP_NAK) {
-	dhcp_option *requested_opts = search_option(&request->opts, PARAMETER_REQUEST_LIST);
+    dhcp_option *requested_opts = search_option(&request->opts, PARAMETER_REQUEST_LIST);
+
+    if (type != DHCP_NAK && requested_opts != NULL) {
+	dhcp_option_table *tables[4], host_opts;
+	int n = 0;
+
+	// the options of the static binding, then of the class, then of the subnet
+
+	if (request->host != NULL && binding != NULL &&
+	    binding->is_static && binding->address == request->host->address) {
+	    host_options(request->hosts, request->host, &host_opts);
+	    tables[n++] = &host_opts;
+	}
+
+	if (request->class != NULL)
+	    tables[n++] = &request->class->options;
 
-	if (requested_opts)
-	    fill_requested_dhcp_options(requested_opts, &reply->opts);
+	tables[n++] = &subnet->options;
+	tables[n] = NULL;
+
+	fill_requested_dhcp_options(tables, requested_opts, &reply->reply_opts);
     }
+
+    // the relay agent information is echoed as the last option (RFC 3046)
+
+    dhcp_option *agent_opt = search_option(&request->opts, RELAY_AGENT_INFORMATION);
+
+    if (agent_opt != NULL)
+	write_option(&reply->reply_opts, agent_opt);
     
     return type;
 }
 
+/*
+ * Answer a discover with rapid commit (RFC 4039): the binding
+ * offered to the client is committed at once, as the request
+ * that would follow the offer does, and the reply is an ack.
+ */
+
+static int
+rapid_commit_binding (dhcp_msg *request, dhcp_msg *reply, binding_list *list,
+		      subnet_pool *subnet, address_binding *binding)
+{
+    log_event(EV_ACK, request->hdr.chaddr, binding->address, 0);
+
+    set_binding_lease(list, binding, ASSOCIATED, subnet->lease_time);
+    journal_binding(list, binding);
+
+    return fill_dhcp_reply(request, reply, subnet, binding, DHCP_ACK);
+}
+
 int
-serve_dhcp_discover (dhcp_msg *request, dhcp_msg *reply)
-{  
-    address_binding *binding = search_binding(&pool.bindings, request->hdr.chaddr,
+serve_dhcp_discover (dhcp_msg *request, dhcp_msg *reply, pool_shard *shard, subnet_pool *subnet)
+{
+    binding_list *list = &shard->bindings[subnet->id];
+    address_binding *binding = search_binding(list, request->hdr.chaddr,
 					      request->hdr.hlen, STATIC, EMPTY);
+    int rapid_commit = subnet->rapid_commit &&
+	search_option(&request->opts, RAPID_COMMIT) != NULL;
 
     if (binding) { // a static binding has been configured for this client
 
-        log_info("Offer %s to %s (static), %s status %sexpired",
-                 str_ip(binding->address), str_mac(request->hdr.chaddr),
-                 str_status(binding->status),
-                 binding->binding_time + binding->lease_time < time(NULL) ? "" : "not ");
+	if (rapid_commit)
+	    return rapid_commit_binding(request, reply, list, subnet, binding);
+
+	log_event(EV_OFFER_STATIC, request->hdr.chaddr, binding->address, binding->status);
             
-        if (binding->binding_time + binding->lease_time < time(NULL)) {
-	    binding->status = PENDING;
-	    binding->binding_time = time(NULL);
-	    binding->lease_time = pool.pending_time;
-	}
+        if (binding->status != PENDING && binding->status != ASSOCIATED)
+	    set_binding_lease(list, binding, PENDING, subnet->pending_time);
             
-        return fill_dhcp_reply(request, reply, binding, DHCP_OFFER);
+	return fill_dhcp_reply(request, reply, subnet, binding, DHCP_OFFER);
 
     }
 
@@ -279,7 +522,7 @@ serve_dhcp_discover (dhcp_msg *request, dhcp_msg *reply)
         /* If an address is available, the new address
            SHOULD be chosen as follows: */
 
-	binding = search_binding(&pool.bindings, request->hdr.chaddr,
+	binding = search_binding(list, request->hdr.chaddr,
 				 request->hdr.hlen, DYNAMIC, EMPTY);
 
         if (binding) {
@@ -291,18 +534,15 @@ serve_dhcp_discover (dhcp_msg *request, dhcp_msg *reply)
                expired or released) binding, if that address is in the server's
                pool of available addresses and not already allocated, ELSE */
 
-	    log_info("Offer %s to %s, %s status %sexpired",
-		     str_ip(binding->address), str_mac(request->hdr.chaddr),
-		     str_status(binding->status),
-		     binding->binding_time + binding->lease_time < time(NULL) ? "" : "not ");
+	    if (rapid_commit)
+		return rapid_commit_binding(request, reply, list, subnet, binding);
 
-	    if (binding->binding_time + binding->lease_time < time(NULL)) {
-		binding->status = PENDING;
-		binding->binding_time = time(NULL);
-		binding->lease_time = pool.pending_time;
-	    }
+	    log_event(EV_OFFER, request->hdr.chaddr, binding->address, binding->status);
+
+	    if (binding->status != PENDING && binding->status != ASSOCIATED)
+		set_binding_lease(list, binding, PENDING, subnet->pending_time);
 	    
-            return fill_dhcp_reply(request, reply, binding, DHCP_OFFER);
+	    return fill_dhcp_reply(request, reply, subnet, binding, DHCP_OFFER);
 
         } else {
 
@@ -322,28 +562,23 @@ serve_dhcp_discover (dhcp_msg *request, dhcp_msg *reply)
 	    if(address_opt != NULL)
 		memcpy(&address, address_opt->data, sizeof(address));
 	    
-	    binding = new_dynamic_binding(&pool.bindings, &pool.indexes, address,
+	    binding = new_dynamic_binding(list, &shard->indexes[subnet->id], address,
 					  request->hdr.chaddr, request->hdr.hlen);
 
 	    if (binding == NULL) {
-		log_info("Can not offer an address to %s, no address available.",
-			 str_mac(request->hdr.chaddr));
+		log_event(EV_NO_ADDRESS, request->hdr.chaddr, 0, 0);
 		
 		return 0;
 	    }
 
-	    log_info("Offer %s to %s, %s status %sexpired",
-		     str_ip(binding->address), str_mac(request->hdr.chaddr),
-		     str_status(binding->status),
-		     binding->binding_time + binding->lease_time < time(NULL) ? "" : "not ");
+	    if (rapid_commit)
+		return rapid_commit_binding(request, reply, list, subnet, binding);
+
+	    log_event(EV_OFFER, request->hdr.chaddr, binding->address, binding->status);
 	    
-	    if (binding->binding_time + binding->lease_time < time(NULL)) {
-		binding->status = PENDING;
-		binding->binding_time = time(NULL);
-		binding->lease_time = pool.pending_time;
-	    }
+	    set_binding_lease(list, binding, PENDING, subnet->pending_time);
 
-	    return fill_dhcp_reply(request, reply, binding, DHCP_OFFER);
+	    return fill_dhcp_reply(request, reply, subnet, binding, DHCP_OFFER);
 	}
 
     }
@@ -352,10 +587,18 @@ serve_dhcp_discover (dhcp_msg *request, dhcp_msg *reply)
 }
 
 int
-serve_dhcp_request (dhcp_msg *request, dhcp_msg *reply)
+serve_dhcp_request (dhcp_msg *request, dhcp_msg *reply, pool_shard *shard, subnet_pool *subnet)
 {
-    address_binding *binding = search_binding(&pool.bindings, request->hdr.chaddr,
-					      request->hdr.hlen, STATIC_OR_DYNAMIC, PENDING);
+    binding_list *list = &shard->bindings[subnet->id];
+    address_binding *binding = search_binding(list, request->hdr.chaddr,
+					      request->hdr.hlen, STATIC_OR_DYNAMIC, EMPTY);
+
+    /* the offer (or the lease, if the client rebooted and
+       went through a new discover) must still be valid */
+
+    if (binding != NULL &&
+	binding->status != PENDING && binding->status != ASSOCIATED)
+	binding = NULL;
 
     uint32_t server_id = 0;
     dhcp_option *server_id_opt = search_option(&request->opts, SERVER_IDENTIFIER);
@@ -367,203 +610,1398 @@ serve_dhcp_request (dhcp_msg *request, dhcp_msg *reply)
 
 	if (binding != NULL) {
 
-	    log_info("Ack %s to %s, associated",
-		     str_ip(binding->address), str_mac(request->hdr.chaddr));
+	    log_event(EV_ACK, request->hdr.chaddr, binding->address, 0);
 
-	    binding->status = ASSOCIATED;
-	    binding->lease_time = pool.lease_time;
+	    set_binding_lease(list, binding, ASSOCIATED, subnet->lease_time);
+	    journal_binding(list, binding);
 	    
-	    return fill_dhcp_reply(request, reply, binding, DHCP_ACK);
+	    return fill_dhcp_reply(request, reply, subnet, binding, DHCP_ACK);
 	
 	} else {
 
-	    log_info("Nak to %s, not associated",
-		     str_mac(request->hdr.chaddr));
+	    log_event(EV_NAK, request->hdr.chaddr, 0, 0);
 		    
-	    return fill_dhcp_reply(request, reply, NULL, DHCP_NAK);
+	    return fill_dhcp_reply(request, reply, subnet, NULL, DHCP_NAK);
 	}
 
     } else if (server_id != 0) { // answer to the offer of another server
 
-	log_info("Clearing %s of %s, accepted another server offer",
-		 str_ip(binding->address), str_mac(request->hdr.chaddr));
+	if (binding != NULL) {
+	    log_event(EV_CLEAR, request->hdr.chaddr, binding->address, 0);
 		    
-	binding->status = EMPTY;
-	binding->lease_time = 0;
+	    set_binding_status(list, binding, EMPTY);
+	    delete_neighbor(&shard->neighbors, binding->address);
+	    binding->lease_time = 0;
+	    journal_binding(list, binding);
+	}
 	
 	return 0;
 
     }
 
-    // malformed request...
-    return 0;
+    /* no server identifier: the client is extending its lease
+       (RENEWING or REBINDING, with ciaddr) or verifying it after
+       a reboot (INIT-REBOOT, with the requested address) */
+
+    uint32_t address = request->hdr.ciaddr;
+    dhcp_option *address_opt = search_option(&request->opts, REQUESTED_IP_ADDRESS);
+
+    if (address == 0 && address_opt != NULL)
+	memcpy(&address, address_opt->data, sizeof(address));
+
+    if (address == 0) // malformed request...
+	return 0;
+
+    if ((address & subnet->netmask) != subnet->network) { // the client moved to another subnet
+	log_event(EV_NAK, request->hdr.chaddr, 0, 0);
+
+	return fill_dhcp_reply(request, reply, subnet, NULL, DHCP_NAK);
+    }
+
+    if (binding == NULL) // not a client of this server
+	return 0;
+
+    if (binding->address != address) {
+	log_event(EV_NAK, request->hdr.chaddr, 0, 0);
+
+	return fill_dhcp_reply(request, reply, subnet, NULL, DHCP_NAK);
+    }
+
+    log_event(EV_ACK, request->hdr.chaddr, binding->address, 0);
+
+    set_binding_lease(list, binding, ASSOCIATED, subnet->lease_time);
+    journal_binding(list, binding);
+
+    return fill_dhcp_reply(request, reply, subnet, binding, DHCP_ACK);
 }
 
 int
-serve_dhcp_decline (dhcp_msg *request, dhcp_msg *reply)
+serve_dhcp_decline (dhcp_msg *request, dhcp_msg *reply, pool_shard *shard, subnet_pool *subnet)
 {
-    address_binding *binding = search_binding(&pool.bindings, request->hdr.chaddr,
+    binding_list *list = &shard->bindings[subnet->id];
+    address_binding *binding = search_binding(list, request->hdr.chaddr,
 					      request->hdr.hlen, STATIC_OR_DYNAMIC, PENDING);
 
     if(binding != NULL) {
-	log_info("Declined %s by %s",
-		 str_ip(binding->address), str_mac(request->hdr.chaddr));
+	log_event(EV_DECLINE, request->hdr.chaddr, binding->address, 0);
 
-	binding->status = EMPTY;
+	set_binding_status(list, binding, EMPTY);
+	delete_neighbor(&shard->neighbors, binding->address);
+	journal_binding(list, binding);
     }
 
     return 0;
 }
 
 int
-serve_dhcp_release (dhcp_msg *request, dhcp_msg *reply)
+serve_dhcp_release (dhcp_msg *request, dhcp_msg *reply, pool_shard *shard, subnet_pool *subnet)
 {
-    address_binding *binding = search_binding(&pool.bindings, request->hdr.chaddr,
+    binding_list *list = &shard->bindings[subnet->id];
+    address_binding *binding = search_binding(list, request->hdr.chaddr,
 					      request->hdr.hlen, STATIC_OR_DYNAMIC, ASSOCIATED);
 
     if(binding != NULL) {
-	log_info("Released %s by %s",
-		 str_mac(request->hdr.chaddr), str_ip(binding->address));
+	log_event(EV_RELEASE, request->hdr.chaddr, binding->address, 0);
 
-	binding->status = RELEASED;
+	set_binding_status(list, binding, RELEASED);
+	delete_neighbor(&shard->neighbors, binding->address);
+	journal_binding(list, binding);
     }
 
     return 0;
 }
 
 int
-serve_dhcp_inform (dhcp_msg *request, dhcp_msg *reply)
+serve_dhcp_inform (dhcp_msg *request, dhcp_msg *reply, pool_shard *shard, subnet_pool *subnet)
 {
-    log_info("Info to %s", str_mac(request->hdr.chaddr));
+    log_event(EV_INFORM, request->hdr.chaddr, 0, 0);
 	
-    return fill_dhcp_reply(request, reply, NULL, DHCP_ACK);
+    return fill_dhcp_reply(request, reply, subnet, NULL, DHCP_ACK);
 }
 
 /*
- * Dispatch client DHCP messages to the correct handling routines
+ * Called for every binding whose offer or lease is expired.
  */
 
 void
-message_dispatcher (int s, struct sockaddr_in server_sock)
+binding_expired (binding_list *list, address_binding *binding, void *arg)
 {
-     
-    while (1) {
-	struct sockaddr_in client_sock;
-	socklen_t slen = sizeof(client_sock);
-	size_t len;
+    pool_shard *shard = arg;
 
-	dhcp_msg request;
-	dhcp_msg reply;
+    log_event(EV_EXPIRE, binding_cident(list, binding), binding->address, 0);
 
-	uint8_t type;
+    delete_neighbor(&shard->neighbors, binding->address);
+    journal_binding(list, binding);
+}
 
-	if((len = recvfrom(s, &request.hdr, sizeof(request.hdr), 0, (struct sockaddr *)&client_sock, &slen)) < DHCP_HEADER_SIZE + 5) {
-	    continue; // TODO: check the magic number 300
-	}
+/*
+ * Sharding routines.
+ */
 
-	if(request.hdr.op != BOOTREQUEST)
-	    continue;
-	
-	if((type = expand_request(&request, len)) == 0) {
-	    log_error("%s.%u: invalid request received\n",
-		      inet_ntoa(client_sock.sin_addr), ntohs(client_sock.sin_port));
-	    continue;
-	}
+/*
+ * Return the shard of a client, hashing the last four bytes
+ * of its hardware address: the same hash is computed by the
+ * socket filter that steers the messages to the workers.
+ */
 
-	init_reply(&request, &reply);
+unsigned int
+client_shard (uint8_t *chaddr)
+{
+    uint32_t key;
 
-	switch (type) {
+    memcpy(&key, chaddr + 2, sizeof(key));
 
-	case DHCP_DISCOVER:
-            type = serve_dhcp_discover(&request, &reply);
-	    break;
+    return ((uint32_t) (ntohl(key) * SHARD_HASH) >> 16) % pool.nshards;
+}
 
-	case DHCP_REQUEST:
-	    type = serve_dhcp_request(&request, &reply);
-	    break;
-	    
-	case DHCP_DECLINE:
-	    type = serve_dhcp_decline(&request, &reply);
-	    break;
-	    
-	case DHCP_RELEASE:
-	    type = serve_dhcp_release(&request, &reply);
-	    break;
-	    
-	case DHCP_INFORM:
-	    type = serve_dhcp_inform(&request, &reply);
-	    break;
-	    
-	default:
-	    printf("%s.%u: request with invalid DHCP message type option\n",
-		   inet_ntoa(client_sock.sin_addr), ntohs(client_sock.sin_port));
-	    break;
-	
-	}
+/*
+ * Subnet of an address, NULL if the address is in no subnet.
+ */
+
+subnet_pool *
+address_subnet (server_config *config, uint32_t address)
+{
+    long id = lookup_prefix(&config->lookup, address);
 
-	if(type != 0)
-	    send_dhcp_reply(s, &client_sock, &reply);
+    return id == -1 ? NULL : &config->subnets[id];
+}
 
-	delete_option_list(&request.opts);
-	delete_option_list(&reply.opts);
+/*
+ * Address that selects the subnet of a request: the address of the
+ * relay agent for a relayed request, else the address of the client
+ * (a client renewing its lease), else the address of the interface
+ * that received the request.
+ */
 
-    }
+uint32_t
+subnet_selector (dhcp_msg *request, uint32_t local)
+{
+    if (request->hdr.giaddr != 0)
+	return request->hdr.giaddr;
+
+    if (request->hdr.ciaddr != 0)
+	return request->hdr.ciaddr;
 
+    return local;
 }
 
-int
-main (int argc, char *argv[])
+/*
+ * Class of a request: among the classes whose rules match its
+ * vendor class, its user class or its hardware address, the one
+ * configured first. NULL if there is none.
+ */
+
+client_class *
+request_class (server_config *config, dhcp_msg *request)
 {
-    int s;
-    struct protoent *pp;
-    struct servent *ss;
-    struct sockaddr_in server_sock;
+    dhcp_option *opt;
+    long class, best = -1;
 
-    /* Initialize global pool */
+    if (config->nclasses == 0)
+	return NULL;
 
-    memset(&pool, 0, sizeof(pool));
+    if ((opt = search_option(&request->opts, VENDOR_CLASS_IDENTIFIER)) != NULL)
+	best = match_class(&config->matcher, CLASS_VENDOR, opt->data, opt->len);
 
-    init_binding_list(&pool.bindings);
-    init_option_list(&pool.options);
+    if ((opt = search_option(&request->opts, USER_CLASS)) != NULL &&
+	(class = match_user_class(&config->matcher, opt->data, opt->len)) != -1 &&
+	(best == -1 || class < best))
+	best = class;
 
-    /* Load configuration */
+    if (request->hdr.htype == 1 && request->hdr.hlen == 6 &&
+	(class = match_class(&config->matcher, CLASS_OUI, request->hdr.chaddr, 3)) != -1 &&
+	(best == -1 || class < best))
+	best = class;
 
-    parse_args(argc, argv, &pool);
+    return best == -1 ? NULL : &config->classes[best];
+}
 
-    /* Set up server */
+/*
+ * Part of the range of a subnet given to the shard k of n: every
+ * shard gets a contiguous part of the range.
+ */
 
-    if ((ss = getservbyname("bootps", "udp")) == 0) {
-        fprintf(stderr, "server: getservbyname() error\n");
-        exit(1);
+void
+shard_indexes (subnet_pool *subnet, unsigned int k, unsigned int n, pool_indexes *indexes)
+{
+    uint32_t first = ntohl(subnet->indexes.first);
+    uint32_t last  = ntohl(subnet->indexes.last);
+    uint64_t range = 0;
+    uint64_t lo, hi;
+
+    if (subnet->indexes.first != 0 && last >= first)
+	range = (uint64_t) last - first + 1;
+
+    lo = first + range * k / n;
+    hi = first + range * (k + 1) / n;
+
+    memset(indexes, 0, sizeof(*indexes));
+
+    if (lo < hi) {
+	indexes->first   = htonl(lo);
+	indexes->last    = htonl(hi - 1);
+	indexes->current = htonl(lo);
     }
+}
 
-     if ((pp = getprotobyname("udp")) == 0) {
-          fprintf(stderr, "server: getprotobyname() error\n");
-          exit(1);
-     }
+/*
+ * Index of an address in the addresses reserved to circuits,
+ * -1 if the address is not reserved.
+ */
 
-     if ((s = socket(AF_INET, SOCK_DGRAM, pp->p_proto)) == -1) {
-          perror("server: socket() error");
-          exit(1);
-     }
+static long
+reserved_slot (server_config *config, uint32_t address)
+{
+    size_t lo = 0, hi = config->nreserved;
 
-     server_sock.sin_family = AF_INET;
-     server_sock.sin_addr.s_addr = htonl(INADDR_ANY);
-     server_sock.sin_port = ss->s_port;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
 
-     if (bind(s, (struct sockaddr *) &server_sock, sizeof(server_sock)) == -1) {
-         perror("server: bind()");
-         close(s);
-         exit(1);
-     }
+	if (ntohl(config->reserved[mid]) < ntohl(address))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
 
-     printf("dhcp server: listening on %d\n", ntohs(server_sock.sin_port));
+    return lo < config->nreserved && config->reserved[lo] == address ? (long) lo : -1;
+}
 
-     /* Message processing loop */
-     
-     message_dispatcher(s, server_sock);
+/*
+ * Unlock all the shards but the given one.
+ */
+
+static void
+unlock_other_shards (pool_shard *shard)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool.nshards; i++) {
+	if (&pool.shards[i] != shard)
+	    pthread_mutex_unlock(&pool.shards[i].lock);
+    }
+}
+
+/*
+ * Give the client of a request the address reserved to its circuit,
+ * with a static binding: the other bindings of the client in the
+ * subnet are removed (the address of a static one stays reserved),
+ * and so is the binding of the client that had the address before,
+ * in any shard, so that the address is never bound twice.
+ *
+ * The owner of the address is changed holding the locks of all the
+ * shards, taken in order as reload_config does: the lock of the
+ * shard of the client is released first, and the configuration may
+ * be reloaded meanwhile; then the request is dropped (the client
+ * retries) and -1 is returned, else zero.
+ */
+
+int
+bind_circuit_address (dhcp_msg *request, pool_shard *shard, subnet_pool *subnet, uint32_t address)
+{
+    server_config *config = shard->config;
+    unsigned int generation = config->generation;
+    binding_list *list = &shard->bindings[subnet->id];
+    address_binding *binding = search_binding(list, request->hdr.chaddr,
+					      request->hdr.hlen, STATIC, EMPTY);
+    long slot = reserved_slot(config, address);
+    circuit_owner *owner;
+    unsigned int i;
+
+    if (slot < 0 || (binding != NULL && binding->address == address))
+	return 0;
+
+    // the client already owns the address: the owner is changed
+    // holding all the locks, so the lock of the shard is enough
+
+    owner = &config->owners[slot];
+
+    if (owner->cident_len == request->hdr.hlen &&
+	memcmp(owner->cident, request->hdr.chaddr, owner->cident_len) == 0 &&
+	search_address_binding(list, request->hdr.chaddr, request->hdr.hlen,
+			       STATIC, address) != NULL)
+	return 0;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    for (i = 0; i < pool.nshards; i++)
+	pthread_mutex_lock(&pool.shards[i].lock);
+
+    if (shard->config->generation != generation) {
+	unlock_other_shards(shard);
+	return -1;
+    }
+
+    // the binding of the previous owner, in the shard of its client
+
+    if (owner->cident_len != 0 &&
+	(owner->cident_len != request->hdr.hlen ||
+	 memcmp(owner->cident, request->hdr.chaddr, owner->cident_len) != 0)) {
+	pool_shard *other = &pool.shards[client_shard(owner->cident)];
+	binding_list *other_list = &other->bindings[subnet->id];
+
+	if ((binding = search_address_binding(other_list, owner->cident, owner->cident_len,
+					      STATIC, address)) != NULL) {
+	    log_event(EV_CIRCUIT_TAKEN, owner->cident, address, 0);
+
+	    delete_neighbor(&other->neighbors, address);
+	    remove_binding(other_list, binding);
+	    reserve_address(other_list, address);
+
+	    if (other != shard)
+		flush_neighbors(&other->neighbors);
+	}
+
+	owner->cident_len = 0;
+    }
+
+    while ((binding = search_binding(list, request->hdr.chaddr,
+				     request->hdr.hlen, STATIC_OR_DYNAMIC, EMPTY)) != NULL) {
+	uint32_t old = binding->address;
+	int is_static = binding->is_static;
+	long old_slot;
+
+	delete_neighbor(&shard->neighbors, old);
+
+	if (!is_static) {
+	    set_binding_status(list, binding, EMPTY);
+	    binding->lease_time = 0;
+	    journal_binding(list, binding);
+	}
+
+	remove_binding(list, binding);
+
+	if (is_static) {
+	    reserve_address(list, old);
+
+	    if ((old_slot = reserved_slot(config, old)) >= 0)
+		config->owners[old_slot].cident_len = 0;
+	}
+    }
+
+    add_binding(list, address, request->hdr.chaddr, request->hdr.hlen, STATIC);
+
+    owner->cident_len = request->hdr.hlen;
+    memcpy(owner->cident, request->hdr.chaddr, request->hdr.hlen);
+
+    unlock_other_shards(shard);
+
+    return 0;
+}
+
+/*
+ * Check if a static binding of a subnet is still in the
+ * configuration: the same client and address in the static
+ * bindings, or the address of a circuit.
+ */
+
+int
+static_configured (server_config *config, subnet_pool *subnet,
+		   binding_list *list, address_binding *binding)
+{
+    static_binding *host;
+
+    if ((binding->address & subnet->netmask) != subnet->network)
+	return 0;
+
+    if (binding->cident_len == 6 &&
+	(host = search_host(&config->hosts, binding_cident(list, binding))) != NULL &&
+	host->address == binding->address)
+	return 1;
+
+    return reserved_slot(config, binding->address) >= 0;
+}
+
+static int
+in_range (pool_indexes *indexes, uint32_t address)
+{
+    return indexes->first != 0 &&
+	ntohl(address) >= ntohl(indexes->first) && ntohl(address) <= ntohl(indexes->last);
+}
+
+/*
+ * Remove from a binding list of a shard the bindings that the new
+ * configuration does not keep: the static bindings no longer
+ * configured, and the dynamic bindings outside the part of the
+ * range of the shard, unless they are offered or leased and still
+ * in the range of the subnet (see reserve_moved_leases). All of
+ * them go if subnet is NULL (the subnet is no longer served). The
+ * dynamic ones are journaled as empty.
+ */
+
+void
+prune_bindings (pool_shard *shard, binding_list *list, server_config *config,
+		subnet_pool *subnet, pool_indexes *indexes)
+{
+    binding_handle handle;
+
+    for (handle = 1; handle < list->count; handle++) {
+	address_binding *binding = get_binding(list, handle);
+
+	if (binding->handle == NO_BINDING)
+	    continue;
+
+	if (binding->is_static) {
+	    if (subnet != NULL && static_configured(config, subnet, list, binding))
+		continue;
+	} else {
+	    if (subnet != NULL && (in_range(indexes, binding->address) ||
+				   ((binding->status == PENDING || binding->status == ASSOCIATED) &&
+				    in_range(&subnet->indexes, binding->address))))
+		continue;
+
+	    set_binding_status(list, binding, EMPTY);
+	    binding->lease_time = 0;
+	    journal_binding(list, binding);
+	}
+
+	delete_neighbor(&shard->neighbors, binding->address);
+	remove_binding(list, binding);
+    }
+}
+
+/*
+ * Switch the shard k to a configuration, holding its lock (or
+ * before the workers start). The binding lists of the subnets
+ * still served (the same network and prefix) are kept, without
+ * the bindings the configuration does not keep (see
+ * prune_bindings), and the lists of the new subnets start empty.
+ * The static bindings are added if the client is of the shard,
+ * else their addresses are reserved; the addresses reserved to
+ * circuits are reserved in every shard (the binding is added for
+ * the client that comes first).
+ */
+
+void
+apply_config (pool_shard *shard, unsigned int k, server_config *config)
+{
+    server_config *old = shard->config;
+    pool_indexes *indexes = calloc(config->nsubnets, sizeof(pool_indexes));
+    binding_list *bindings = calloc(config->nsubnets, sizeof(binding_list));
+    uint8_t *kept = old != NULL ? calloc(old->nsubnets, 1) : NULL;
+    unsigned int i, j;
+
+    for (j = 0; j < config->nsubnets; j++) {
+	subnet_pool *subnet = &config->subnets[j];
+	binding_list *list = &bindings[j];
+
+	shard_indexes(subnet, k, pool.nshards, &indexes[j]);
+
+	for (i = 0; old != NULL && i < old->nsubnets; i++) {
+	    if (!kept[i] && old->subnets[i].network == subnet->network &&
+		old->subnets[i].prefix == subnet->prefix)
+		break;
+	}
+
+	if (old == NULL || i == old->nsubnets) {
+	    init_binding_list(list);
+	    set_binding_pool(list, &indexes[j]);
+	    continue;
+	}
+
+	*list = shard->bindings[i];
+	kept[i] = 1;
+
+	// go on allocating from the last address, if still in the range
+
+	if (indexes[j].first != 0 &&
+	    ntohl(shard->indexes[i].current) >= ntohl(indexes[j].first) &&
+	    ntohl(shard->indexes[i].current) <= ntohl(indexes[j].last))
+	    indexes[j].current = shard->indexes[i].current;
+
+	prune_bindings(shard, list, config, subnet, &indexes[j]);
+	set_binding_pool(list, &indexes[j]);
+    }
+
+    for (i = 0; old != NULL && i < old->nsubnets; i++) {
+	if (!kept[i]) {
+	    prune_bindings(shard, &shard->bindings[i], config, NULL, NULL);
+	    delete_binding_list(&shard->bindings[i]);
+	}
+    }
+
+    for (i = 0; i < config->hosts.count; i++) {
+	static_binding *sb = &config->hosts.hosts[i];
+	subnet_pool *subnet = address_subnet(config, sb->address);
+	address_binding *binding;
+
+	if (subnet == NULL) {
+	    if (k == 0)
+		log_error("Static binding of %s to %s not in any subnet",
+			  str_ip(sb->address), str_mac(sb->mac));
+	    continue;
+	}
+
+	if (client_shard(sb->mac) != k) {
+	    reserve_address(&bindings[subnet->id], sb->address);
+	    continue;
+	}
+
+	binding = search_binding(&bindings[subnet->id], sb->mac, 6, STATIC, EMPTY);
+
+	if (binding == NULL || binding->address != sb->address)
+	    add_binding(&bindings[subnet->id], sb->address, sb->mac, 6, 1);
+    }
+
+    for (i = 0; i < config->circuits.count; i++) {
+	circuit *c = &config->circuits.circuits[i];
+
+	if (c->address != 0)
+	    reserve_address(&bindings[c->subnet], c->address);
+    }
+
+    free(shard->indexes);
+    free(shard->bindings);
+    free(kept);
+
+    shard->indexes  = indexes;
+    shard->bindings = bindings;
+    shard->config   = config;
+}
+
+/*
+ * Reserve the addresses of the leases kept by a reload outside the
+ * part of the range of their shard (the range has been split again)
+ * in the shard whose part they are now in, so that they are not
+ * handed out twice. Run holding the locks of all the shards, or
+ * once the leases are restored (see restore_lease): then a lease may
+ * be bound in the shard of its address as well (the journal was
+ * written with another split), and only the newer one is kept.
+ */
+
+void
+reserve_moved_leases (server_config *config)
+{
+    binding_handle handle;
+    unsigned int i, j, k;
+
+    for (i = 0; i < pool.nshards; i++) {
+	for (j = 0; j < config->nsubnets; j++) {
+	    binding_list *list = &pool.shards[i].bindings[j];
+
+	    for (handle = 1; handle < list->count; handle++) {
+		address_binding *binding = get_binding(list, handle);
+
+		if (binding->handle == NO_BINDING || binding->is_static ||
+		    (binding->status != PENDING && binding->status != ASSOCIATED) ||
+		    in_range(&pool.shards[i].indexes[j], binding->address))
+		    continue;
+
+		for (k = 0; k < pool.nshards; k++) {
+		    binding_list *other_list = &pool.shards[k].bindings[j];
+		    address_binding *other;
+
+		    if (k == i)
+			continue;
+
+		    if ((other = search_bound_address(other_list, binding->address)) != NULL &&
+			!other->is_static &&
+			(other->status == PENDING || other->status == ASSOCIATED)) {
+			if (other->binding_time > binding->binding_time) {
+			    remove_binding(list, binding);
+			    break;
+			}
+
+			remove_binding(other_list, other);
+		    }
+
+		    reserve_address(other_list, binding->address);
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * Find the owners of the addresses reserved to circuits, in the
+ * static bindings of all the shards, holding their locks (or before
+ * the workers start). If an address is bound more than once (e.g.
+ * bindings restored from before a fix) only the first binding is
+ * kept, the others are removed.
+ */
+
+void
+index_circuit_owners (server_config *config)
+{
+    binding_handle handle;
+    unsigned int i, j;
+    long slot;
+
+    memset(config->owners, 0, config->nreserved * sizeof(circuit_owner));
+
+    for (i = 0; i < pool.nshards; i++) {
+	pool_shard *shard = &pool.shards[i];
+
+	for (j = 0; j < config->nsubnets; j++) {
+	    binding_list *list = &shard->bindings[j];
+
+	    for (handle = 1; handle < list->count; handle++) {
+		address_binding *binding = get_binding(list, handle);
+		circuit_owner *owner;
+
+		if (binding->handle == NO_BINDING || !binding->is_static ||
+		    (slot = reserved_slot(config, binding->address)) < 0)
+		    continue;
+
+		owner = &config->owners[slot];
+
+		if (owner->cident_len != 0) {
+		    uint32_t address = binding->address;
+
+		    log_event(EV_CIRCUIT_TWICE, binding_cident(list, binding), address, 0);
+		    delete_neighbor(&shard->neighbors, address);
+		    remove_binding(list, binding);
+		    reserve_address(list, address);
+		    continue;
+		}
+
+		owner->cident_len = binding->cident_len;
+		memcpy(owner->cident, binding_cident(list, binding), binding->cident_len);
+	    }
+	}
+    }
+}
+
+/*
+ * Split the pool in n shards, with the current configuration.
+ */
+
+void
+init_pool_shards (unsigned int n)
+{
+    unsigned int i;
+
+    pool.nshards = n;
+    pool.shards = calloc(n, sizeof(pool_shard));
+
+    for (i = 0; i < n; i++) {
+	pool_shard *shard = &pool.shards[i];
+
+	pthread_mutex_init(&shard->lock, NULL);
+	init_neighbor_table(&shard->neighbors, pool.device);
+
+	apply_config(shard, i, pool.config);
+    }
+}
+
+/*
+ * Load the configuration again, and switch all the shards to it
+ * holding their locks (taken in order, the workers take one at a
+ * time): the messages received meanwhile wait in the sockets. The
+ * old configuration is freed once no shard refers to it. On error
+ * the current configuration is kept.
+ */
+
+void
+reload_config (void)
+{
+    server_config *config, *old;
+    char *error;
+    unsigned int i;
+
+    if ((config = load_config(&settings, &error)) == NULL) {
+	log_error("Configuration not reloaded, %s", error);
+	return;
+    }
+
+    pthread_mutex_lock(&pool.config_lock);
+
+    old = pool.config;
+
+    for (i = 0; i < pool.nshards; i++) {
+	pthread_mutex_lock(&pool.shards[i].lock);
+	apply_config(&pool.shards[i], i, config);
+    }
+
+    reserve_moved_leases(config);
+    index_circuit_owners(config);
+
+    for (i = 0; i < pool.nshards; i++) {
+	flush_neighbors(&pool.shards[i].neighbors);
+	pthread_mutex_unlock(&pool.shards[i].lock);
+    }
+
+    pool.config = config;
+
+    pthread_mutex_unlock(&pool.config_lock);
+
+    delete_config(old);
+
+    log_info("%s", "Configuration reloaded");
+}
+
+/*
+ * Apply a change read from the journal to the shard of its client,
+ * in the subnet of its address.
+ *
+ * If the pool has been split differently (another number of workers)
+ * the address of a lease may be in the part of another shard: the
+ * lease is restored in the shard of its client all the same, as a
+ * reload keeps it, and its address is reserved in the other shard
+ * once all the leases are restored (see reserve_moved_leases).
+ */
+
+void
+restore_lease (journal_record *rec, void *arg)
+{
+    subnet_pool *subnet = address_subnet(pool.config, rec->address);
+
+    if (subnet == NULL || !in_range(&subnet->indexes, rec->address))
+	return; // the address is no longer served
+
+    if (search_host_address(&pool.config->hosts, rec->address) != NULL ||
+	reserved_slot(pool.config, rec->address) >= 0)
+	return; // the address is statically bound
+
+    restore_binding(&pool.shards[client_shard(rec->cident)].bindings[subnet->id],
+		    rec->address, rec->cident, rec->cident_len, rec->status,
+		    rec->binding_time, rec->lease_time);
+}
+
+/*
+ * Checkpoint of the journal: save the bindings to the snapshot.
+ */
+
+ssize_t
+checkpoint_bindings (uint64_t segment, void *arg)
+{
+    return write_snapshot(snapshot_path, &pool, segment);
+}
+
+/*
+ * The filters below hash the hardware address of the client
+ * like client_shard(). The reuseport filter sees the UDP payload,
+ * i.e. the DHCP message; the socket filters still see the UDP
+ * header in front of it.
+ */
+
+#define SHARD_FILTER(n, header)						\
+    { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, (header) + offsetof(dhcp_message, chaddr) + 2 }, \
+    { BPF_ALU | BPF_MUL | BPF_K,   0, 0, SHARD_HASH },			\
+    { BPF_ALU | BPF_RSH | BPF_K,   0, 0, 16 },				\
+    { BPF_ALU | BPF_MOD | BPF_K,   0, 0, (n) }
+
+/*
+ * Attach to the socket of a worker a filter that accepts only
+ * the messages of the clients of the worker: the broadcast
+ * messages are delivered to every socket bound to the port.
+ */
+
+int
+attach_worker_filter (int s, unsigned int id, unsigned int n)
+{
+    struct sock_filter code[] = {
+	SHARD_FILTER(n, sizeof(struct udphdr)),
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, id },
+	{ BPF_RET | BPF_K,           0, 0, 0xffffffff },
+	{ BPF_RET | BPF_K,           0, 0, 0 },
+    };
+
+    struct sock_fprog prog = {
+	.len = sizeof(code) / sizeof(code[0]),
+	.filter = code
+    };
+
+    return setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/*
+ * Attach to the group of reuseport sockets (once they are all
+ * bound) a filter that selects the socket of the worker of the
+ * client for the unicast messages.
+ */
+
+int
+attach_reuseport_filter (int s, unsigned int n)
+{
+    struct sock_filter code[] = {
+	SHARD_FILTER(n, 0),
+	{ BPF_RET | BPF_A, 0, 0, 0 },
+    };
+
+    struct sock_fprog prog = {
+	.len = sizeof(code) / sizeof(code[0]),
+	.filter = code
+    };
+
+    return setsockopt(s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+/*
+ * Dispatch a client DHCP message to the correct handling routine,
+ * in the subnet of the request (local is the address the request was
+ * received on) or of its circuit or class, holding the lock of the
+ * shard of the client.
+ *
+ * The neighbor entry of the client is queued in the shard, and
+ * sent with the other entries of the batch if the shard is the
+ * one of the worker (otherwise right away).
+ *
+ * Return the type of the reply, zero if there is no reply.
+ */
+
+uint8_t
+serve_dhcp_message (dhcp_worker *worker, dhcp_msg *request, size_t len,
+		    struct sockaddr_in *client_sock, uint32_t local, dhcp_msg *reply)
+{
+    worker_metrics *metrics = &worker->metrics;
+    circuit *agent_circuit = NULL;
+    relay_agent_info agent;
+    server_config *config;
+    subnet_pool *subnet;
+    pool_shard *shard;
+    uint8_t type;
+
+    if(len < DHCP_HEADER_SIZE + 5)
+	return 0; // TODO: check the magic number 300
+
+    if(request->hdr.op != BOOTREQUEST)
+	return 0;
+	
+    if((type = expand_request(request, len)) == 0) {
+	log_event(EV_INVALID, request->hdr.chaddr, client_sock->sin_addr.s_addr,
+		  ntohs(client_sock->sin_port));
+	count_metric(&metrics->outcomes[OUT_INVALID], 1);
+	return 0;
+    }
+
+    log_event(EV_RECEIVED, request->hdr.chaddr, 0, type);
+
+    if (type <= DHCP_INFORM)
+	count_metric(&metrics->received[type], 1);
+
+    // the configuration is the one of the shard, while holding its lock
+
+    shard = &pool.shards[client_shard(request->hdr.chaddr)];
+
+    pthread_mutex_lock(&shard->lock);
+
+    config = shard->config;
+
+    if (parse_relay_agent_info(&request->opts, &agent))
+	agent_circuit = search_circuit(&config->circuits, &agent);
+
+    request->class = request_class(config, request);
+
+    request->host  = NULL;
+    request->hosts = &config->hosts;
+
+    if (config->hosts.options_len > 0 && request->hdr.hlen == 6 &&
+	(request->host = search_host(&config->hosts, request->hdr.chaddr)) != NULL &&
+	request->host->options_len == 0)
+	request->host = NULL;
+
+    if (agent_circuit != NULL) {
+	subnet = &config->subnets[agent_circuit->subnet];
+    } else if (request->class != NULL && request->class->subnet != -1) {
+	subnet = &config->subnets[request->class->subnet];
+    } else if ((subnet = address_subnet(config, subnet_selector(request, local))) == NULL) {
+	pthread_mutex_unlock(&shard->lock);
+	log_event(EV_NO_SUBNET, request->hdr.chaddr, subnet_selector(request, local), 0);
+	count_metric(&metrics->outcomes[OUT_NO_SUBNET], 1);
+	return 0;
+    }
+
+    init_reply(request, reply);
+
+    if (agent_circuit != NULL && agent_circuit->address != 0 &&
+	(type == DHCP_DISCOVER || type == DHCP_REQUEST) &&
+	bind_circuit_address(request, shard, subnet, agent_circuit->address) != 0) {
+	pthread_mutex_unlock(&shard->lock);
+	return 0;
+    }
+
+    switch (type) {
+
+    case DHCP_DISCOVER:
+	type = serve_dhcp_discover(request, reply, shard, subnet);
+
+	if (type == 0)
+	    count_metric(&metrics->outcomes[OUT_NO_ADDRESS], 1);
+	break;
+
+    case DHCP_REQUEST:
+	type = serve_dhcp_request(request, reply, shard, subnet);
+	break;
+	    
+    case DHCP_DECLINE:
+	type = serve_dhcp_decline(request, reply, shard, subnet);
+	break;
+	    
+    case DHCP_RELEASE:
+	type = serve_dhcp_release(request, reply, shard, subnet);
+	break;
+	    
+    case DHCP_INFORM:
+	type = serve_dhcp_inform(request, reply, shard, subnet);
+	break;
+	    
+    default:
+	log_event(EV_INVALID_TYPE, request->hdr.chaddr, client_sock->sin_addr.s_addr,
+		  ntohs(client_sock->sin_port));
+	count_metric(&metrics->outcomes[OUT_INVALID_TYPE], 1);
+	type = 0;
+	break;
+	
+    }
+
+    if (type == DHCP_OFFER)
+	count_metric(&metrics->outcomes[OUT_OFFER], 1);
+    else if (type == DHCP_ACK)
+	count_metric(&metrics->outcomes[OUT_ACK], 1);
+    else if (type == DHCP_NAK)
+	count_metric(&metrics->outcomes[OUT_NAK], 1);
+
+    if (type != 0 && reply->hdr.yiaddr != 0 && !raw_reply(worker, request)) {
+	add_neighbor(&shard->neighbors, reply->hdr.yiaddr, reply->hdr.chaddr);
+
+	if (shard != &pool.shards[worker->id])
+	    flush_neighbors(&shard->neighbors);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return type;
+}
+
+/*
+ * Dispatch the first n messages of the batch of a worker to the
+ * correct handling routines, and send all the replies together.
+ * The latency of the replies is measured from the given time, when
+ * the batch started to be received.
+ *
+ * The lease changes of the batch are made durable by a single
+ * group commit of the journal before the replies are sent (the
+ * workers wait for the writer only if they changed a lease, and
+ * meanwhile the next batch grows in the socket). If the journal
+ * can not be written the replies are dropped: the clients retry,
+ * and no lease is acknowledged before it is durable.
+ */
+
+void
+serve_batch (dhcp_worker *worker, unsigned int n, uint64_t start)
+{
+    pool_shard *own = &pool.shards[worker->id];
+    dhcp_batch *batch = &worker->batch;
+    int s = worker->s;
+    unsigned int i, nreplies = 0, nserved = 0, failed;
+
+    for (i = 0; i < n; i++) {
+	if(serve_dhcp_message(worker, &batch->requests[i], batch->in[i].msg_len,
+			      &batch->clients[i], receive_address(&batch->in[i].msg_hdr),
+			      &batch->replies[i]) != 0)
+	    batch->served[nserved++] = i;
+    }
+
+    /* the leases must be durable, and the neighbor entries
+       there, before the replies are sent */
+
+    if (lease_journal.fd != -1 && nserved > 0 &&
+	sync_journal(&lease_journal, journal_seq) == -1) {
+	count_metric(&worker->metrics.outcomes[OUT_NOT_DURABLE], nserved);
+	nserved = 0;
+    }
+
+    pthread_mutex_lock(&own->lock);
+    flush_neighbors(&own->neighbors);
+    pthread_mutex_unlock(&own->lock);
+
+    for (i = 0; i < nserved; i++) {
+	dhcp_msg *request = &batch->requests[batch->served[i]];
+	dhcp_msg *reply   = &batch->replies[batch->served[i]];
+	struct sockaddr_in *client_sock = &batch->clients[batch->served[i]];
+
+	if (raw_reply(worker, request)) {
+	    queue_raw_reply(worker, request, reply);
+	    continue;
+	}
+
+	struct mmsghdr *out = &batch->out[nreplies];
+
+	batch->out_iov[nreplies].iov_base = &reply->hdr;
+	batch->out_iov[nreplies].iov_len  = finish_dhcp_reply(client_sock, reply);
+
+	out->msg_hdr.msg_name    = client_sock;
+	out->msg_hdr.msg_namelen = sizeof(*client_sock);
+	out->msg_hdr.msg_iov     = &batch->out_iov[nreplies];
+	out->msg_hdr.msg_iovlen  = 1;
+
+	nreplies++;
+    }
+
+    failed = send_batch(s, batch, nreplies);
+    flush_packets(&worker->tx);
+    flush_xdp_packets(&worker->xsk);
+
+    if (n == 0)
+	return;
+
+    count_metric(&worker->metrics.batches, 1);
+    count_metric(&worker->metrics.outcomes[OUT_SEND_FAILED], failed);
+
+    if (nserved > 0)
+	observe_latency(&worker->metrics, monotonic_ns() - start, nserved);
+}
+
+/*
+ * Called when the socket of a worker is readable: a batch of
+ * messages is received and served.
+ */
+
+void
+message_dispatcher (event *ev, uint32_t events)
+{
+    dhcp_worker *worker = ev->arg;
+    uint64_t start = monotonic_ns();
+
+    serve_batch(worker, receive_batch(worker->s, &worker->batch, settings.flush_timeout), start);
+}
+
+/*
+ * Called when the AF_XDP socket of a worker has frames: the messages
+ * are parsed out of the frames in the UMEM, copied in the batch of
+ * the worker, and served.
+ */
+
+void
+xdp_dispatcher (event *ev, uint32_t events)
+{
+    dhcp_worker *worker = ev->arg;
+    dhcp_batch *batch = &worker->batch;
+    uint64_t start = monotonic_ns();
+    unsigned int i, n, count = 0;
+
+    n = receive_xdp_packets(&worker->xsk, worker->xdp_pkts, batch->size);
+
+    for (i = 0; i < n; i++) {
+	size_t len;
+	uint8_t *payload = parse_frame(worker->xdp_pkts[i].frame, worker->xdp_pkts[i].len,
+				       &batch->clients[count], &len);
+
+	if (payload == NULL || len > sizeof(batch->requests[count].hdr))
+	    continue;
+
+	memcpy(&batch->requests[count].hdr, payload, len);
+	batch->in[count].msg_len = len;
+	batch->in[count].msg_hdr.msg_controllen = 0;
+	count++;
+    }
+
+    release_xdp_packets(&worker->xsk, n);
+
+    serve_batch(worker, count, start);
+}
+
+/*
+ * Periodic work of a worker, run by its timer: the expired
+ * offers and leases of the shard of the worker are released,
+ * in every subnet.
+ */
+
+void
+worker_housekeeping (event *ev, uint32_t events)
+{
+    dhcp_worker *worker = ev->arg;
+    pool_shard *own = &pool.shards[worker->id];
+    time_t now = time(NULL);
+    unsigned int i;
+
+    clear_event(ev);
+
+    pthread_mutex_lock(&own->lock);
+
+    for (i = 0; i < own->config->nsubnets; i++)
+	update_bindings_statuses(&own->bindings[i], now, binding_expired, own);
+
+    flush_neighbors(&own->neighbors);
+    pthread_mutex_unlock(&own->lock);
+}
+
+/*
+ * Set up the event loop of a worker, watching its socket and its timer.
+ */
+
+void
+init_worker (dhcp_worker *worker)
+{
+    init_batch(&worker->batch, settings.batch_size);
+
+    worker->tx.fd  = -1;
+    worker->xsk.fd = -1;
+
+    if (settings.tx_mode != TX_UDP &&
+	init_packet_socket(&worker->tx, pool.device, pool.server_id,
+			   settings.tx_mode, settings.batch_size) == -1) {
+	perror("server: can not open the packet socket");
+	exit(1);
+    }
+
+    if (init_event_loop(&worker->loop) == -1 ||
+	add_event(&worker->loop, &worker->socket_ev, worker->s,
+		  message_dispatcher, worker) == -1 ||
+	add_timer_event(&worker->loop, &worker->timer_ev, HOUSEKEEPING_INTERVAL,
+			worker_housekeeping, worker) == -1) {
+	perror("server: can not set up the worker event loop");
+	exit(1);
+    }
+
+    /* without a socket, the frames of the queue go to the UDP socket */
+
+    if (settings.xdp_mode != XDP_MODE_NONE) {
+
+	if (init_xdp_socket(&worker->xsk, &xdp, pool.device, worker->id,
+			    pool.server_id) == -1) {
+	    log_error("Worker %u: no AF_XDP socket for receive queue %u: %s",
+		      worker->id, worker->id, strerror(errno));
+	    return;
+	}
+
+	worker->xdp_pkts = calloc(settings.batch_size, sizeof(xdp_packet));
+
+	if (add_event(&worker->loop, &worker->xsk_ev, worker->xsk.fd,
+		      xdp_dispatcher, worker) == -1) {
+	    perror("server: can not set up the worker event loop");
+	    exit(1);
+	}
+    }
+}
+
+void *
+worker_main (void *arg)
+{
+    dhcp_worker *worker = arg;
+
+    run_event_loop(&worker->loop);
+
+    return NULL;
+}
+
+/*
+ * Called by the control loop of the main thread
+ * when a signal is received.
+ */
+
+void
+signal_handler (event *ev, uint32_t events)
+{
+    event_loop *control = ev->arg;
+    struct signalfd_siginfo si;
+
+    while (read(ev->fd, &si, sizeof(si)) == sizeof(si)) {
+
+	switch (si.ssi_signo) {
+
+	case SIGHUP:
+	    reload_config();
+	    break;
+
+	case SIGUSR1:
+	case SIGUSR2:
+	    set_log_level(get_log_level() + (si.ssi_signo == SIGUSR1 ? 1 : -1));
+	    log_info("Log level %d", get_log_level());
+	    break;
+
+	case SIGINT:
+	case SIGTERM:
+	    log_info("Terminating on signal %d", si.ssi_signo);
+	    stop_event_loop(control);
+	    break;
+
+	}
+
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+    struct protoent *pp;
+    struct servent *ss;
+    struct sockaddr_in server_sock;
+    dhcp_worker *workers;
+    event_loop control;
+    event signal_ev;
+    metrics_server metrics;
+    sigset_t mask;
+    unsigned int i;
+    char *error;
+    int on = 1;
+
+    /* Initialize global pool */
+
+    memset(&pool, 0, sizeof(pool));
+
+    /* Load configuration */
+
+    settings.batch_size    = 32;
+    settings.flush_timeout = 0;
+    settings.workers       = 1;
+    settings.tx_mode       = TX_UDP;
+    settings.xdp_mode      = XDP_MODE_NONE;
+    settings.journal       = NULL;
+    settings.log_level     = LOG_INFO;
+    settings.metrics_port  = 0;
+    settings.config_file   = NULL;
+
+    parse_args(argc, argv, &pool, &settings);
+
+    if ((pool.config = load_config(&settings, &error)) == NULL)
+	usage(error, 1);
+
+    pthread_mutex_init(&pool.config_lock, NULL);
+    init_pool_shards(settings.workers);
+
+    /* The signals are received by the control loop only (every
+       thread started from now on inherits the mask) */
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    if (start_logger(settings.log_level) == -1) {
+	perror("server: can not start the logger");
+	exit(1);
+    }
+
+    lease_journal.fd = -1;
+
+    if (settings.journal != NULL) {
+	uint64_t from;
+	int n;
+
+	snapshot_path = malloc(strlen(settings.journal) + sizeof(".snap"));
+	sprintf(snapshot_path, "%s.snap", settings.journal);
+
+	if (load_snapshot(snapshot_path, &pool, &from, restore_lease, NULL) == 0)
+	    log_info("Bindings loaded from %s", snapshot_path);
+
+	n = open_journal(&lease_journal, settings.journal, from, restore_lease,
+			 checkpoint_bindings, NULL);
+
+	if (n == -1) {
+	    perror("server: can not open the lease journal");
+	    exit(1);
+	}
+
+	log_info("Replayed %d changes from %s", n, settings.journal);
+
+	reserve_moved_leases(pool.config);
+	index_circuit_owners(pool.config);
+    }
+
+    /* Set up server */
+
+    if ((ss = getservbyname("bootps", "udp")) == 0) {
+        fprintf(stderr, "server: getservbyname() error\n");
+        exit(1);
+    }
+
+     if ((pp = getprotobyname("udp")) == 0) {
+          fprintf(stderr, "server: getprotobyname() error\n");
+          exit(1);
+     }
+
+     server_sock.sin_family = AF_INET;
+     server_sock.sin_addr.s_addr = htonl(INADDR_ANY);
+     server_sock.sin_port = ss->s_port;
+
+     /* Every worker has its own socket, bound to the same port
+	(the workers are aligned, their counters are on their own
+	cache lines) */
+
+     workers = aligned_alloc(__alignof__(dhcp_worker),
+			     settings.workers * sizeof(dhcp_worker));
+     memset(workers, 0, settings.workers * sizeof(dhcp_worker));
+
+     for (i = 0; i < settings.workers; i++) {
+	 int s;
+
+	 if ((s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, pp->p_proto)) == -1) {
+	     perror("server: socket() error");
+	     exit(1);
+	 }
+
+	 if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1 ||
+	     setsockopt(s, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) == -1) {
+	     perror("server: setsockopt()");
+	     exit(1);
+	 }
+
+	 if (settings.workers > 1 &&
+	     attach_worker_filter(s, i, settings.workers) == -1) {
+	     perror("server: can not attach the worker filter");
+	     exit(1);
+	 }
+
+	 if (bind(s, (struct sockaddr *) &server_sock, sizeof(server_sock)) == -1) {
+	     perror("server: bind()");
+	     close(s);
+	     exit(1);
+	 }
+
+	 workers[i].id = i;
+	 workers[i].s  = s;
+     }
+
+     if (settings.workers > 1 &&
+	 attach_reuseport_filter(workers[0].s, settings.workers) == -1) {
+	 perror("server: can not attach the reuseport filter");
+	 exit(1);
+     }
+
+     if (settings.xdp_mode != XDP_MODE_NONE &&
+	 attach_xdp_program(&xdp, pool.device, settings.xdp_mode, settings.workers) == -1) {
+	 perror("server: can not attach the XDP program");
+	 exit(1);
+     }
+
+     printf("dhcp server: listening on %d\n", ntohs(server_sock.sin_port));
+
+     /* Message processing loops */
+
+     for (i = 0; i < settings.workers; i++) {
+	 init_worker(&workers[i]);
+
+	 if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+	     perror("server: pthread_create()");
+	     exit(1);
+	 }
+     }
+
+     /* Control loop */
+
+     if (init_event_loop(&control) == -1 ||
+	 add_signal_event(&control, &signal_ev, &mask, signal_handler, &control) == -1) {
+	 perror("server: can not set up the control loop");
+	 exit(1);
+     }
+
+     if (settings.metrics_port != 0 &&
+	 start_metrics(&metrics, settings.metrics_port, &pool, workers, settings.workers) == -1) {
+	 perror("server: can not open the metrics endpoint");
+	 exit(1);
+     }
+
+     run_event_loop(&control);
+
+     if (settings.metrics_port != 0)
+	 stop_metrics(&metrics);
+
+     for (i = 0; i < settings.workers; i++) {
+	 stop_event_loop(&workers[i].loop);
+	 pthread_join(workers[i].thread, NULL);
+	 close(workers[i].s);
+     }
+
+     if (settings.xdp_mode != XDP_MODE_NONE)
+	 detach_xdp_program(&xdp);
 
-     close(s);
+     close_journal(&lease_journal);
+     stop_logger();
 
      return 0;
 }
@@ -3,11 +3,132 @@
 
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 
-#include "queue.h"
 #include "dhcp.h"
 #include "options.h"
 #include "bindings.h"
+#include "event.h"
+#include "neighbor.h"
+#include "packet.h"
+#include "xdp.h"
+#include "journal.h"
+#include "metrics.h"
+#include "prefix.h"
+#include "circuits.h"
+#include "classes.h"
+#include "hosts.h"
+
+/*
+ * A subnet served by the server, with its own range of addresses,
+ * options and lease times. The subnet of a request is found with a
+ * longest prefix match on the address of the relay agent (giaddr),
+ * or on the address of the client, or else on the address of the
+ * interface that received the request; unless the relay agent
+ * information of the request (option 82) matches a configured
+ * circuit, or the request is of a client class, which give the
+ * subnet (in this order).
+ *
+ * Note: all the IP addresses are in network order.
+ */
+
+struct subnet_pool {
+    unsigned int id;   // index of the subnet, and of its binding lists in the shards
+    uint32_t network;  // network address
+    uint32_t netmask;  // network mask
+    uint8_t prefix;    // length of the network mask
+
+    pool_indexes indexes;  // used to delimitate a pool of available addresses
+
+    time_t lease_time;   // default lease time
+    time_t pending_time; // duration of a binding in the pending state
+    int rapid_commit;    // answer a discover with rapid commit (option 80) with an ack
+
+    dhcp_option_table options; // options for this subnet, already encoded
+};
+
+typedef struct subnet_pool subnet_pool;
+
+// times of the default subnet, when not configured (in seconds)
+enum {
+    DEFAULT_LEASE_TIME   = 3600,
+    DEFAULT_PENDING_TIME = 30
+};
+
+/*
+ * Client bound to an address reserved to a circuit.
+ */
+
+struct circuit_owner {
+    uint8_t cident_len; // client identifier len, zero if the address is not bound
+    uint8_t cident[16]; // client identifier (hardware address)
+};
+
+typedef struct circuit_owner circuit_owner;
+
+/*
+ * Configuration of the pool: the subnets, with their ranges, options
+ * and times, the circuits, the client classes and the static bindings.
+ *
+ * A configuration is immutable once loaded: a reload loads a new one
+ * and switches the shards to it holding their locks (see reload_config),
+ * so the packet path reads it with no lock of its own, through the
+ * pointer of the shard of the client. The only exception are the
+ * owners of the circuit addresses, changed holding the locks of all
+ * the shards (see bind_circuit_address).
+ *
+ * The first subnet is the default one (0.0.0.0/0), configured
+ * before any other subnet: the other subnets start with its
+ * options and lease times.
+ */
+
+struct server_config {
+    subnet_pool *subnets;  // subnets served
+    unsigned int nsubnets; // number of subnets
+    prefix_table lookup;   // subnets by prefix
+
+    circuit_table circuits; // circuits of the relay agents (option 82)
+    uint32_t *reserved;     // addresses reserved to circuits, sorted
+    circuit_owner *owners;  // client bound to every reserved address
+    unsigned int nreserved; // number of addresses reserved to circuits
+
+    client_class *classes;  // client classes
+    unsigned int nclasses;  // number of client classes
+    class_matcher matcher;  // match rules of the client classes
+
+    host_table hosts; // static bindings of the configuration
+
+    unsigned int generation; // number of the configuration, in load order
+};
+
+typedef struct server_config server_config;
+
+/*
+ * A shard of the pool: the bindings of the clients whose hardware
+ * address hashes to the shard, and a part of the range of every
+ * subnet from which their dynamic addresses are allocated.
+ *
+ * Every worker receives the messages of the clients of its own shard
+ * (see the socket filter in dhcpserver.c), so the shard lock is
+ * normally taken by a single thread. The lock also protects the
+ * configuration of the shard, and the binding lists of its subnets.
+ */
+
+struct pool_shard {
+    pthread_mutex_t lock;
+
+    server_config *config;  // configuration of the shard
+    pool_indexes *indexes;  // addresses of this shard, for every subnet
+    binding_list *bindings; // bindings of this shard, for every subnet
+
+    neighbor_table neighbors; // neighbor entries of the clients of this shard
+};
+
+typedef struct pool_shard pool_shard;
 
 /*
  * Global association pool.
@@ -15,39 +136,115 @@
  * The (static or dynamic) associations tables of the DHCP server,
  * are maintained in this global structure.
  *
- * Note: all the IP addresses are in host order,
- *       to allow an easy manipulation.
+ * The configuration is replaced while holding config_lock, which
+ * is taken as well by the slow paths that read the configuration
+ * of all the shards (e.g. a snapshot of the bindings).
  */
 
 struct address_pool {
     uint32_t server_id; // this server id (IP address)
-    uint32_t netmask;   // network mask
-    uint32_t gateway;   // network gateway
 
     char device[16];    // network device to use
 
-    pool_indexes indexes;  // used to delimitate a pool of available addresses
+    server_config *config;       // current configuration
+    pthread_mutex_t config_lock; // held while the configuration is replaced
 
-    time_t lease_time;   // default lease time
-    time_t pending_time; // duration of a binding in the pending state
-
-    dhcp_option_list options; // options for this pool, see queue
-    
-    binding_list bindings; // associated addresses, see queue(3)
+    pool_shard *shards;   // associated addresses
+    unsigned int nshards; // number of shards, one per worker
 };
 
 typedef struct address_pool address_pool;
 
 /*
- * Internal representation of a DHCP message,
- * with options parsed into a list...
+ * Internal representation of a DHCP message, with the options
+ * of a request parsed in place and the options of a reply written
+ * directly in the message...
  */
 
 struct dhcp_msg {
     dhcp_message hdr;
-    dhcp_option_list opts;
+    dhcp_option_table opts;        // options of a request
+    dhcp_option_buffer reply_opts; // options of a reply
+    uint8_t reply_type;            // message type of a reply
+    client_class *class;           // class of a request, NULL if none
+    static_binding *host;          // static binding of the client with its own options, NULL if none
+    host_table *hosts;             // table of the static binding
 };
 
 typedef struct dhcp_msg dhcp_msg;
 
+/*
+ * Settings of the server, not related to a pool.
+ */
+
+struct server_settings {
+    unsigned int batch_size;    // max messages received or sent with one system call
+    unsigned int flush_timeout; // max time to wait to fill a batch (in milliseconds)
+    unsigned int workers;       // number of worker threads
+    int tx_mode;                // how the replies are sent, see packet.h
+    int xdp_mode;               // AF_XDP backend, see xdp.h
+    char *journal;              // path of the lease journal, NULL if not used
+    char *config_file;          // path of the configuration file, NULL if not used
+    int log_level;              // level of the events logged, see logging.h
+    uint16_t metrics_port;      // port of the metrics endpoint, zero if not used
+};
+
+typedef struct server_settings server_settings;
+
+/*
+ * Messages received with a single recvmmsg(2) call,
+ * and their replies sent with a single sendmmsg(2) call.
+ */
+
+struct dhcp_batch {
+    unsigned int size; // max number of messages
+
+    dhcp_msg *requests;
+    dhcp_msg *replies;
+    struct sockaddr_in *clients; // source of every request
+    uint8_t *control;            // receive address of every request (IP_PKTINFO)
+
+    struct iovec *in_iov;
+    struct iovec *out_iov;
+    struct mmsghdr *in;
+    struct mmsghdr *out;
+
+    unsigned int *served; // index of every request served, with a reply
+};
+
+typedef struct dhcp_batch dhcp_batch;
+
+/*
+ * A worker thread, with its own socket bound to the server port
+ * and its own event loop.
+ */
+
+struct dhcp_worker {
+    unsigned int id; // also the index of the shard of the worker
+    int s;           // socket of the worker
+    pthread_t thread;
+    dhcp_batch batch;
+    packet_socket tx; // raw transmission of the replies
+
+    xdp_socket xsk;        // AF_XDP socket of the receive queue of the worker
+    xdp_packet *xdp_pkts;  // frames received from the AF_XDP socket
+
+    event_loop loop;
+    event socket_ev; // messages on the socket
+    event xsk_ev;    // frames on the AF_XDP socket
+    event timer_ev;  // periodic housekeeping
+
+    worker_metrics metrics; // counters of the messages served
+};
+
+typedef struct dhcp_worker dhcp_worker;
+
+/*
+ * Helper functions (the strings are in buffers of the calling thread)
+ */
+
+char *str_ip (uint32_t ip);
+char *str_mac (uint8_t *mac);
+char *str_status (int status);
+
 #endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+
+/*
+ * Max number of events returned by a single epoll_wait.
+ */
+
+#define MAX_EVENTS 16
+
+static void
+wakeup_handler (event *ev, uint32_t events)
+{
+    event_loop *loop = ev->arg;
+
+    clear_event(ev);
+    loop->running = 0;
+}
+
+/*
+ * Initialize an event loop.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+init_event_loop (event_loop *loop)
+{
+    int fd;
+
+    memset(loop, 0, sizeof(*loop));
+
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	return -1;
+
+    if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+	add_event(loop, &loop->wakeup, fd, wakeup_handler, loop) == -1) {
+	close(loop->epfd);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Close an event loop: the descriptors of the events
+ * added by the caller are not closed.
+ */
+
+void
+delete_event_loop (event_loop *loop)
+{
+    close(loop->wakeup.fd);
+    close(loop->epfd);
+}
+
+/*
+ * Watch a descriptor: the handler is called every time
+ * the descriptor is ready for reading.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+add_event (event_loop *loop, event *ev, int fd, event_handler handler, void *arg)
+{
+    struct epoll_event ee;
+
+    ev->fd = fd;
+    ev->handler = handler;
+    ev->arg = arg;
+
+    memset(&ee, 0, sizeof(ee));
+    ee.events = EPOLLIN;
+    ee.data.ptr = ev;
+
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ee);
+}
+
+/*
+ * Stop watching the descriptor of an event, and close it.
+ */
+
+void
+delete_event (event_loop *loop, event *ev)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+    close(ev->fd);
+
+    ev->fd = -1;
+}
+
+/*
+ * Add a periodic timer, firing every interval milliseconds.
+ * The handler must call clear_event().
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+add_timer_event (event_loop *loop, event *ev, unsigned int interval,
+		 event_handler handler, void *arg)
+{
+    struct itimerspec its;
+    int fd;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+	return -1;
+
+    its.it_interval.tv_sec  = interval / 1000;
+    its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+    its.it_value = its.it_interval;
+
+    if (timerfd_settime(fd, 0, &its, NULL) == -1 ||
+	add_event(loop, ev, fd, handler, arg) == -1) {
+	close(fd);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Receive the signals of a mask as events: the signals must be
+ * blocked in every thread. The handler reads the signalfd_siginfo
+ * structures from the descriptor.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+add_signal_event (event_loop *loop, event *ev, sigset_t *mask,
+		  event_handler handler, void *arg)
+{
+    int fd;
+
+    if ((fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+	return -1;
+
+    if (add_event(loop, ev, fd, handler, arg) == -1) {
+	close(fd);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the counter of a timer or of an eventfd.
+ *
+ * Return the number of expirations (or the value) read.
+ */
+
+uint64_t
+clear_event (event *ev)
+{
+    uint64_t n;
+
+    if (read(ev->fd, &n, sizeof(n)) != sizeof(n))
+	return 0;
+
+    return n;
+}
+
+/*
+ * Run the event loop, until it is stopped.
+ */
+
+void
+run_event_loop (event_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    loop->running = 1;
+
+    while (loop->running) {
+
+	if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1)) == -1) {
+	    if (errno != EINTR) {
+		perror("epoll_wait failed");
+		return;
+	    }
+	    continue;
+	}
+
+	for (i = 0; i < n; i++) {
+	    event *ev = events[i].data.ptr;
+	    ev->handler(ev, events[i].events);
+	}
+
+    }
+}
+
+/*
+ * Stop an event loop: can be called from any thread.
+ */
+
+void
+stop_event_loop (event_loop *loop)
+{
+    uint64_t n = 1;
+
+    if (write(loop->wakeup.fd, &n, sizeof(n)) != sizeof(n))
+	perror("can not stop the event loop");
+}
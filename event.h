@@ -0,0 +1,55 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+#include <signal.h>
+
+/*
+ * Event loop, built on epoll(7).
+ *
+ * Every event source is a file descriptor (a socket, a timerfd,
+ * a signalfd, an eventfd...) with a handler, called from the loop
+ * when the descriptor is ready. The handlers run on the thread
+ * of the loop, one at a time.
+ */
+
+struct event;
+
+typedef void (*event_handler) (struct event *ev, uint32_t events);
+
+struct event {
+    int fd;                // file descriptor watched
+    event_handler handler; // called when the descriptor is ready
+    void *arg;             // argument for the handler
+};
+
+typedef struct event event;
+
+struct event_loop {
+    int epfd;     // epoll instance
+    int running;  // cleared to stop the loop
+    event wakeup; // eventfd used to stop the loop from another thread
+};
+
+typedef struct event_loop event_loop;
+
+/*
+ * Prototypes
+ */
+
+int init_event_loop (event_loop *loop);
+void delete_event_loop (event_loop *loop);
+
+int add_event (event_loop *loop, event *ev, int fd, event_handler handler, void *arg);
+void delete_event (event_loop *loop, event *ev);
+
+int add_timer_event (event_loop *loop, event *ev, unsigned int interval,
+		     event_handler handler, void *arg);
+int add_signal_event (event_loop *loop, event *ev, sigset_t *mask,
+		      event_handler handler, void *arg);
+uint64_t clear_event (event *ev);
+
+void run_event_loop (event_loop *loop);
+void stop_event_loop (event_loop *loop);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hosts.h"
+
+/*
+ * Initialize an empty host table.
+ */
+
+void
+init_host_table (host_table *table)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->index_size = 64;
+    table->by_mac     = calloc(table->index_size, sizeof(*table->by_mac));
+    table->by_address = calloc(table->index_size, sizeof(*table->by_address));
+}
+
+void
+delete_host_table (host_table *table)
+{
+    free(table->hosts);
+    free(table->by_mac);
+    free(table->by_address);
+    free(table->options);
+
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Multiplicative hashes: the high bits of the product depend on
+ * all the bits of the key (the varying bytes of the addresses of
+ * a range are the last ones, the high bits in network order).
+ */
+
+static uint32_t
+hash_mac (uint8_t *mac)
+{
+    uint64_t key = 0;
+
+    memcpy(&key, mac, 6);
+
+    return (key * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+static uint32_t
+hash_address (uint32_t address)
+{
+    return ((uint64_t) address * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+/*
+ * Search the slot of a hardware address in the index, or the
+ * empty slot where it would go.
+ */
+
+static size_t
+mac_slot (host_table *table, uint8_t *mac)
+{
+    size_t mask = table->index_size - 1;
+    size_t i;
+
+    for (i = hash_mac(mac) & mask; table->by_mac[i] != 0; i = (i + 1) & mask) {
+	if (memcmp(table->hosts[table->by_mac[i] - 1].mac, mac, 6) == 0)
+	    break;
+    }
+
+    return i;
+}
+
+static size_t
+address_slot (host_table *table, uint32_t address)
+{
+    size_t mask = table->index_size - 1;
+    size_t i;
+
+    for (i = hash_address(address) & mask; table->by_address[i] != 0; i = (i + 1) & mask) {
+	if (table->hosts[table->by_address[i] - 1].address == address)
+	    break;
+    }
+
+    return i;
+}
+
+/*
+ * Double the indexes, when they become three quarters full.
+ */
+
+static void
+grow_indexes (host_table *table)
+{
+    uint32_t n;
+
+    free(table->by_mac);
+    free(table->by_address);
+
+    table->index_size *= 2;
+    table->by_mac     = calloc(table->index_size, sizeof(*table->by_mac));
+    table->by_address = calloc(table->index_size, sizeof(*table->by_address));
+
+    for (n = 0; n < table->count; n++) {
+	table->by_mac[mac_slot(table, table->hosts[n].mac)] = n + 1;
+	table->by_address[address_slot(table, table->hosts[n].address)] = n + 1;
+    }
+}
+
+/*
+ * Add a static binding of a hardware address to an address, with
+ * the given options (a table of stored options, NULL if none).
+ *
+ * Return 0 on success, HOST_DUPLICATE_MAC or HOST_DUPLICATE_ADDRESS
+ * if the hardware address or the address is already reserved.
+ */
+
+int
+add_host (host_table *table, uint8_t *mac, uint32_t address, dhcp_option_table *options)
+{
+    static_binding *host;
+    size_t mac_i, address_i;
+
+    if (4 * (size_t) (table->count + 1) > 3 * table->index_size)
+	grow_indexes(table);
+
+    mac_i = mac_slot(table, mac);
+    address_i = address_slot(table, address);
+
+    if (table->by_mac[mac_i] != 0)
+	return HOST_DUPLICATE_MAC;
+
+    if (table->by_address[address_i] != 0)
+	return HOST_DUPLICATE_ADDRESS;
+
+    if (table->count == table->size) {
+	table->size = table->size ? table->size * 2 : 64;
+	table->hosts = realloc(table->hosts, table->size * sizeof(static_binding));
+    }
+
+    host = &table->hosts[table->count];
+
+    memset(host, 0, sizeof(*host));
+    memcpy(host->mac, mac, 6);
+    host->address = address;
+
+    // the options are stored with the magic cookie and the END option,
+    // as the options field of a message
+
+    if (options != NULL && options->len > sizeof(option_magic)) {
+	if (table->options_len + options->len + 1 > table->options_size) {
+	    while (table->options_len + options->len + 1 > table->options_size)
+		table->options_size = table->options_size ? table->options_size * 2 : 4096;
+	    table->options = realloc(table->options, table->options_size);
+	}
+
+	memcpy(table->options + table->options_len, options->base, options->len);
+	table->options[table->options_len + options->len] = END;
+
+	host->options     = table->options_len;
+	host->options_len = options->len + 1;
+
+	table->options_len += options->len + 1;
+    }
+
+    table->count++;
+    table->by_mac[mac_i] = table->count;
+    table->by_address[address_i] = table->count;
+
+    return 0;
+}
+
+/*
+ * Search the static binding of a hardware address, NULL if
+ * there is none.
+ */
+
+static_binding *
+search_host (host_table *table, uint8_t *mac)
+{
+    size_t i = mac_slot(table, mac);
+
+    return table->by_mac[i] == 0 ? NULL : &table->hosts[table->by_mac[i] - 1];
+}
+
+/*
+ * Search the static binding of an address, NULL if there is none.
+ */
+
+static_binding *
+search_host_address (host_table *table, uint32_t address)
+{
+    size_t i = address_slot(table, address);
+
+    return table->by_address[i] == 0 ? NULL : &table->hosts[table->by_address[i] - 1];
+}
+
+/*
+ * Parse the options of a static binding (it must have some)
+ * into an option table, without copying them.
+ */
+
+void
+host_options (host_table *table, static_binding *host, dhcp_option_table *options)
+{
+    parse_options_to_table(options, table->options + host->options, host->options_len);
+}
@@ -0,0 +1,61 @@
+#ifndef HOSTS_H
+#define HOSTS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "options.h"
+
+/*
+ * Table of the static bindings (reservations) of the configuration,
+ * indexed by hardware address and by address with two open addressing
+ * hash tables: a reservation is added, and checked against the others
+ * (no hardware address nor address can be reserved twice), with a
+ * hash and a few probes, whatever the number of reservations.
+ *
+ * The options of a reservation, if any, are stored already encoded
+ * one after the other in a single buffer (see host_options).
+ */
+
+struct static_binding {
+    uint8_t mac[6];       // client hardware address
+    uint16_t options_len; // len of the options of the client, zero if none
+    uint32_t address;     // address assigned to the client
+    uint32_t options;     // offset of the options in the options buffer
+};
+
+typedef struct static_binding static_binding;
+
+struct host_table {
+    static_binding *hosts; // static bindings, in the order they were added
+    uint32_t count;        // number of static bindings
+    uint32_t size;         // number of static bindings allocated
+
+    uint32_t *by_mac;     // index by hardware address: position + 1, zero if empty
+    uint32_t *by_address; // index by address: position + 1, zero if empty
+    size_t index_size;    // number of slots of every index (a power of two)
+
+    uint8_t *options;    // options of the static bindings
+    size_t options_len;  // bytes used
+    size_t options_size; // bytes allocated
+};
+
+typedef struct host_table host_table;
+
+enum {
+    HOST_DUPLICATE_MAC     = -1,
+    HOST_DUPLICATE_ADDRESS = -2
+};
+
+/*
+ * Prototypes
+ */
+
+void init_host_table (host_table *table);
+void delete_host_table (host_table *table);
+int add_host (host_table *table, uint8_t *mac, uint32_t address, dhcp_option_table *options);
+static_binding *search_host (host_table *table, uint8_t *mac);
+static_binding *search_host_address (host_table *table, uint32_t address);
+void host_options (host_table *table, static_binding *host, dhcp_option_table *options);
+
+#endif
@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "bindings.h"
+#include "logging.h"
+
+/*
+ * Checksum of a record (Fletcher-16 of the bytes before the checksum):
+ * the result is flipped, so a record of zeros is never valid.
+ */
+
+static uint16_t
+record_check (journal_record *rec)
+{
+    uint8_t *p = (uint8_t *) rec;
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < offsetof(journal_record, check); i++) {
+	a = (a + p[i]) % 255;
+	b = (b + a) % 255;
+    }
+
+    return ~((b << 8) | a);
+}
+
+/*
+ * Name of a segment file, in a static buffer of the calling thread.
+ */
+
+static char *
+segment_name (journal *j, uint64_t segment, char *suffix)
+{
+    static __thread char name[4096];
+
+    snprintf(name, sizeof(name), "%s.%llu%s", j->path,
+	     (unsigned long long) segment, suffix);
+
+    return name;
+}
+
+static int
+compare_segments (const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * List the numbers of the segment files, in increasing order.
+ *
+ * Return the array of the numbers (to be freed), and their
+ * number in n.
+ */
+
+static uint64_t *
+list_segments (journal *j, size_t *n)
+{
+    char pattern[4096];
+    uint64_t *segments;
+    glob_t g;
+    size_t i;
+
+    *n = 0;
+    snprintf(pattern, sizeof(pattern), "%s.*", j->path);
+
+    if (glob(pattern, 0, NULL, &g) != 0)
+	return calloc(1, sizeof(uint64_t));
+
+    segments = calloc(g.gl_pathc + 1, sizeof(uint64_t));
+
+    for (i = 0; i < g.gl_pathc; i++) {
+	char *suffix = g.gl_pathv[i] + strlen(j->path) + 1;
+	char *end;
+	unsigned long long segment = strtoull(suffix, &end, 10);
+
+	if (*suffix < '0' || *suffix > '9' || *end != '\0' || segment == 0)
+	    continue; // not a segment
+
+	segments[(*n)++] = segment;
+    }
+
+    globfree(&g);
+    qsort(segments, *n, sizeof(uint64_t), compare_segments);
+
+    return segments;
+}
+
+/*
+ * Read the records of the segments, appending them to an array
+ * (to be freed). A segment is read up to its first invalid record,
+ * i.e. the write interrupted by a crash.
+ *
+ * Return the array, and the number of records in n.
+ */
+
+static journal_record *
+read_segments (journal *j, uint64_t *segments, size_t nsegments, size_t *n)
+{
+    journal_record *recs = NULL;
+    size_t size = 0;
+    size_t i;
+
+    *n = 0;
+
+    for (i = 0; i < nsegments; i++) {
+	char *name = segment_name(j, segments[i], "");
+	FILE *f = fopen(name, "re");
+	journal_record rec;
+
+	if (f == NULL) {
+	    log_error("Journal: can not read %s: %s", name, strerror(errno));
+	    continue;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+
+	    if (rec.check != record_check(&rec)) {
+		log_error("Journal: %s truncated at record %ld", name,
+			  ftell(f) / (long) sizeof(rec) - 1);
+		break;
+	    }
+
+	    if (*n == size) {
+		size = size ? size * 2 : JOURNAL_BUFFER;
+		recs = realloc(recs, size * sizeof(*recs));
+	    }
+
+	    recs[(*n)++] = rec;
+	}
+
+	fclose(f);
+    }
+
+    return recs;
+}
+
+static int
+compare_records (const void *a, const void *b, void *arg)
+{
+    journal_record *recs = arg;
+    uint32_t x = *(uint32_t *) a, y = *(uint32_t *) b;
+
+    if (recs[x].address != recs[y].address)
+	return recs[x].address < recs[y].address ? -1 : 1;
+
+    return x < y ? -1 : x > y; // keep the order of the changes
+}
+
+/*
+ * Merge the records: only the last record of every address is kept.
+ * The records kept are moved to the beginning of the array.
+ *
+ * Return the number of records kept.
+ */
+
+static size_t
+merge_records (journal_record *recs, size_t n)
+{
+    uint32_t *order = malloc((n + 1) * sizeof(uint32_t));
+    journal_record *merged = malloc((n + 1) * sizeof(journal_record));
+    size_t i, count = 0;
+
+    for (i = 0; i < n; i++)
+	order[i] = i;
+
+    qsort_r(order, n, sizeof(uint32_t), compare_records, recs);
+
+    for (i = 0; i < n; i++) {
+	journal_record *rec = &recs[order[i]];
+
+	if (i + 1 < n && recs[order[i + 1]].address == rec->address)
+	    continue; // changed later
+
+	merged[count++] = *rec;
+    }
+
+    memcpy(recs, merged, count * sizeof(journal_record));
+
+    free(merged);
+    free(order);
+
+    return count;
+}
+
+/*
+ * Write the whole buffer, retrying after partial writes.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int
+write_all (int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+	ssize_t ret = write(fd, p, len);
+
+	if (ret == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	p   += ret;
+	len -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Open a new segment, and make its directory entry durable.
+ *
+ * Return the descriptor, -1 on error.
+ */
+
+static int
+open_segment (journal *j, uint64_t segment)
+{
+    int fd = open(segment_name(j, segment, ""),
+		  O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd != -1)
+	fsync(j->dirfd);
+
+    return fd;
+}
+
+/*
+ * Remove the segments before the given one.
+ */
+
+static void
+remove_segments (journal *j, uint64_t before)
+{
+    uint64_t *segments;
+    size_t nsegments, i;
+
+    segments = list_segments(j, &nsegments);
+
+    for (i = 0; i < nsegments && segments[i] < before; i++)
+	unlink(segment_name(j, segments[i], ""));
+
+    free(segments);
+}
+
+/*
+ * Writer thread: group commit of the records appended.
+ */
+
+static void *
+journal_writer (void *arg)
+{
+    journal *j = arg;
+
+    pthread_mutex_lock(&j->lock);
+
+    for (;;) {
+	journal_record *recs;
+	uint64_t upto;
+	size_t n;
+
+	while (j->len == 0 && j->running) {
+	    j->idle = 1;
+	    pthread_cond_wait(&j->appended_cond, &j->lock);
+	    j->idle = 0;
+	}
+
+	if (j->len == 0) // stopped, and everything written
+	    break;
+
+	// swap the buffers, new records are appended meanwhile
+
+	recs = j->buf;
+	n    = j->len;
+	j->buf   = j->spare;
+	j->spare = recs;
+
+	size_t size = j->size;
+	j->size = j->spare_size;
+	j->spare_size = size;
+
+	j->len = 0;
+	upto = j->appended;
+
+	pthread_mutex_unlock(&j->lock);
+
+	/* the records are durable only once written and synced:
+	   on error the workers waiting for them are released without
+	   success (see sync_journal), and the records are written
+	   again to a new segment (the contents of the failed one,
+	   and of its pages in the cache, are unknown) */
+
+	int written;
+
+	while (!(written = write_all(j->fd, recs, n * sizeof(journal_record)) == 0 &&
+		 fdatasync(j->fd) == 0)) {
+	    int fd;
+
+	    log_error("Journal: can not write %s: %s",
+		      segment_name(j, j->segment, ""), strerror(errno));
+
+	    pthread_mutex_lock(&j->lock);
+
+	    j->failed = 1;
+	    pthread_cond_broadcast(&j->synced_cond);
+
+	    if (!j->running) // stopped: the last checkpoint saves the bindings
+		break;
+
+	    pthread_mutex_unlock(&j->lock);
+
+	    sleep(JOURNAL_RETRY);
+
+	    if ((fd = open_segment(j, j->segment + 1)) != -1) {
+		close(j->fd);
+		j->fd = fd;
+		j->segment++;
+		j->segment_len = 0;
+	    }
+	}
+
+	if (!written)
+	    break;
+
+	j->segment_len += n * sizeof(journal_record);
+
+	pthread_mutex_lock(&j->lock);
+
+	if (j->failed)
+	    log_info("Journal: written again to %s", segment_name(j, j->segment, ""));
+
+	j->failed = 0;
+
+	__atomic_store_n(&j->synced, upto, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&j->synced_cond);
+
+	/* start a new segment, at least as large as the last
+	   checkpoint so the checkpoint cost stays proportional */
+
+	if (j->segment_len >= JOURNAL_SEGMENT && j->segment_len >= j->checkpoint_len) {
+	    int fd = open_segment(j, j->segment + 1);
+
+	    if (fd == -1) {
+		log_error("Journal: can not open %s: %s",
+			  segment_name(j, j->segment + 1, ""), strerror(errno));
+		continue;
+	    }
+
+	    close(j->fd);
+	    j->fd = fd;
+	    j->segment++;
+	    j->segment_len = 0;
+
+	    j->checkpoint_from = j->segment;
+	    pthread_cond_signal(&j->checkpoint_cond);
+	}
+    }
+
+    pthread_mutex_unlock(&j->lock);
+
+    return NULL;
+}
+
+/*
+ * Checkpoint thread: when a new segment is started, the bindings
+ * are saved (with all the changes of the previous segments), and
+ * the previous segments removed.
+ */
+
+static void *
+journal_checkpointer (void *arg)
+{
+    journal *j = arg;
+
+    pthread_mutex_lock(&j->lock);
+
+    while (j->running) {
+	uint64_t from;
+	ssize_t len;
+
+	if (j->checkpoint_from == 0) {
+	    pthread_cond_wait(&j->checkpoint_cond, &j->lock);
+	    continue;
+	}
+
+	from = j->checkpoint_from;
+	j->checkpoint_from = 0;
+
+	pthread_mutex_unlock(&j->lock);
+
+	if ((len = j->checkpoint(from, j->arg)) != -1)
+	    remove_segments(j, from);
+
+	pthread_mutex_lock(&j->lock);
+
+	if (len != -1)
+	    j->checkpoint_len = len;
+    }
+
+    pthread_mutex_unlock(&j->lock);
+
+    return NULL;
+}
+
+/*
+ * Open the journal with the given path: the changes found in the
+ * segments starting from the given one (the first one not included
+ * in the last checkpoint) are merged and passed to the restore
+ * function, then a new segment and the writer and checkpoint threads
+ * are started.
+ *
+ * Return the number of changes restored, -1 on error.
+ */
+
+int
+open_journal (journal *j, char *path, uint64_t from, journal_restore restore,
+	      journal_checkpoint checkpoint, void *arg)
+{
+    uint64_t *segments;
+    journal_record *recs;
+    size_t nsegments, n, i;
+    char *dir = strdup(path);
+
+    memset(j, 0, sizeof(*j));
+    j->path = strdup(path);
+    j->fd = -1;
+    j->checkpoint = checkpoint;
+    j->arg = arg;
+
+    j->dirfd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+
+    if (j->dirfd == -1)
+	return -1;
+
+    remove_segments(j, from); // left by a crash after a checkpoint
+
+    segments = list_segments(j, &nsegments);
+    recs = read_segments(j, segments, nsegments, &n);
+    n = merge_records(recs, n);
+
+    for (i = 0; i < n; i++)
+	restore(&recs[i], arg);
+
+    j->segment = nsegments ? segments[nsegments - 1] + 1 : (from ? from : 1);
+
+    free(recs);
+    free(segments);
+
+    if ((j->fd = open_segment(j, j->segment)) == -1)
+	return -1;
+
+    j->size = j->spare_size = JOURNAL_BUFFER;
+    j->buf   = malloc(j->size * sizeof(journal_record));
+    j->spare = malloc(j->spare_size * sizeof(journal_record));
+
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->appended_cond, NULL);
+    pthread_cond_init(&j->synced_cond, NULL);
+    pthread_cond_init(&j->checkpoint_cond, NULL);
+
+    j->running = 1;
+
+    if (pthread_create(&j->writer, NULL, journal_writer, j) != 0 ||
+	pthread_create(&j->checkpointer, NULL, journal_checkpointer, j) != 0)
+	return -1;
+
+    return n;
+}
+
+/*
+ * Stop the journal threads, once the records appended are written,
+ * and take a last checkpoint: the next start has no changes to replay.
+ */
+
+void
+close_journal (journal *j)
+{
+    if (j->fd == -1)
+	return;
+
+    pthread_mutex_lock(&j->lock);
+    j->running = 0;
+    pthread_cond_broadcast(&j->appended_cond);
+    pthread_cond_broadcast(&j->checkpoint_cond);
+    pthread_mutex_unlock(&j->lock);
+
+    pthread_join(j->writer, NULL);
+    pthread_join(j->checkpointer, NULL);
+
+    close(j->fd);
+
+    if (j->checkpoint(j->segment + 1, j->arg) != -1)
+	remove_segments(j, j->segment + 1);
+
+    close(j->dirfd);
+    j->fd = -1;
+}
+
+/*
+ * Append a record to the journal: it is written by the writer
+ * thread with the other records appended meanwhile.
+ *
+ * Return the sequence number of the record, see sync_journal.
+ */
+
+uint64_t
+append_journal (journal *j, journal_record *rec)
+{
+    uint64_t seq;
+
+    rec->check = record_check(rec);
+
+    pthread_mutex_lock(&j->lock);
+
+    if (j->len == j->size) {
+	j->size *= 2;
+	j->buf = realloc(j->buf, j->size * sizeof(journal_record));
+    }
+
+    j->buf[j->len++] = *rec;
+    seq = ++j->appended;
+
+    if (j->idle)
+	pthread_cond_signal(&j->appended_cond);
+
+    pthread_mutex_unlock(&j->lock);
+
+    return seq;
+}
+
+/*
+ * Wait until the record with the given sequence number
+ * (and all the ones before it) is durable.
+ *
+ * Return 0 when it is durable, -1 if the journal can not be
+ * written (the record is not durable yet, the writer retries).
+ */
+
+int
+sync_journal (journal *j, uint64_t seq)
+{
+    int ret;
+
+    if (__atomic_load_n(&j->synced, __ATOMIC_ACQUIRE) >= seq)
+	return 0;
+
+    pthread_mutex_lock(&j->lock);
+
+    while (j->synced < seq && !j->failed)
+	pthread_cond_wait(&j->synced_cond, &j->lock);
+
+    ret = j->synced >= seq ? 0 : -1;
+
+    pthread_mutex_unlock(&j->lock);
+
+    return ret;
+}
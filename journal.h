@@ -0,0 +1,107 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Write-ahead journal of the leases.
+ *
+ * Every change of a dynamic lease is appended as a fixed size record
+ * to an in-memory buffer; a writer thread writes all the records
+ * appended since its last flush with a single write(2) and makes them
+ * durable with a single fdatasync(2) (group commit), so the cost of
+ * a flush is shared by all the changes of the batches served in the
+ * meantime, by all the workers.
+ *
+ * The journal is a sequence of segment files, named path.N. When the
+ * current segment is full a new one is started, and a checkpoint thread
+ * saves the bindings (see snapshot.h): the snapshot includes all the
+ * changes of the previous segments, which are then removed.
+ *
+ * On restart the segments after the snapshot are read in order, only
+ * the last record of every address is kept, and the changes found are
+ * applied to the bindings loaded from the snapshot.
+ */
+
+enum {
+    JOURNAL_SEGMENT = 4 << 20, // min bytes of a segment before a new one is started
+    JOURNAL_BUFFER  = 1024,    // initial number of records of the buffers
+    JOURNAL_RETRY   = 1        // seconds between the writes of a failed journal
+};
+
+/*
+ * A lease change, in host order except the address. The status is
+ * the new status of the binding: only ASSOCIATED records are leases,
+ * the others end the lease of the address.
+ */
+
+struct journal_record {
+    uint32_t address;      // leased address (network order)
+    uint32_t binding_time; // start of the lease
+    uint32_t lease_time;   // duration of the lease
+
+    uint8_t status;     // new binding status
+    uint8_t cident_len; // client identifier len
+    uint8_t cident[16]; // client identifier (hardware address)
+
+    uint16_t check; // checksum of the record, detects torn writes
+};
+
+typedef struct journal_record journal_record;
+
+typedef void (*journal_restore) (journal_record *rec, void *arg);
+
+// save the bindings, with the changes of the segments before the given one;
+// return the bytes written, -1 on error
+typedef ssize_t (*journal_checkpoint) (uint64_t segment, void *arg);
+
+struct journal {
+    char *path; // prefix of the segment files
+    int fd;     // current segment, -1 if the journal is not used
+    int dirfd;  // directory of the segments
+
+    uint64_t segment;      // number of the current segment
+    size_t segment_len;    // bytes written to the current segment
+    size_t checkpoint_len; // bytes of the last checkpoint
+
+    journal_checkpoint checkpoint;
+    void *arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t appended_cond; // records appended, for the writer
+    pthread_cond_t synced_cond;   // records durable, for the workers
+    pthread_cond_t checkpoint_cond; // segment started, for the checkpoint thread
+
+    journal_record *buf;   // records appended
+    size_t len, size;
+    journal_record *spare; // records being written by the writer
+    size_t spare_size;
+
+    uint64_t appended;     // sequence number of the last record appended
+    uint64_t synced;       // sequence number of the last durable record
+    uint64_t checkpoint_from; // first segment not in the checkpoint to take, zero if none
+
+    int running;
+    int idle;   // the writer waits for records
+    int failed; // the last write failed, the writer retries
+    pthread_t writer;
+    pthread_t checkpointer;
+};
+
+typedef struct journal journal;
+
+/*
+ * Prototypes
+ */
+
+int open_journal (journal *j, char *path, uint64_t from, journal_restore restore,
+		  journal_checkpoint checkpoint, void *arg);
+void close_journal (journal *j);
+
+uint64_t append_journal (journal *j, journal_record *rec);
+int sync_journal (journal *j, uint64_t seq);
+
+#endif
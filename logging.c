@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "dhcpserver.h"
+
+/*
+ * Level of every event.
+ */
+
+static const uint8_t event_levels[EV_MAX] = {
+    [EV_RECEIVED]       = LOG_DEBUG,
+    [EV_OFFER]          = LOG_INFO,
+    [EV_OFFER_STATIC]   = LOG_INFO,
+    [EV_NO_ADDRESS]     = LOG_INFO,
+    [EV_ACK]            = LOG_INFO,
+    [EV_NAK]            = LOG_INFO,
+    [EV_CLEAR]          = LOG_INFO,
+    [EV_DECLINE]        = LOG_INFO,
+    [EV_RELEASE]        = LOG_INFO,
+    [EV_INFORM]         = LOG_INFO,
+    [EV_EXPIRE]         = LOG_INFO,
+    [EV_INVALID]        = LOG_ERROR,
+    [EV_INVALID_TYPE]   = LOG_ERROR,
+    [EV_SEND_FAILED]    = LOG_ERROR,
+    [EV_NO_SUBNET]      = LOG_INFO,
+    [EV_CIRCUIT_TAKEN]  = LOG_INFO,
+    [EV_CIRCUIT_TWICE]  = LOG_INFO,
+    [EV_RECEIVE_ERROR]  = LOG_ERROR,
+    [EV_SEND_ERROR]     = LOG_ERROR,
+    [EV_NEIGHBOR_ERROR] = LOG_ERROR
+};
+
+static char *message_types[] = {
+    NULL, "discover", "offer", "request", "decline", "ack", "nak", "release", "inform"
+};
+
+static int log_level = LOG_INFO;
+
+static log_ring *rings;   // rings of all the threads
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread log_ring *thread_ring; // ring of the current thread
+
+static pthread_t logger;
+static int logger_running;
+
+/*
+ * Set and get the level of the events logged.
+ */
+
+void
+set_log_level (int level)
+{
+    if (level < LOG_ERROR)
+	level = LOG_ERROR;
+
+    if (level > LOG_DEBUG)
+	level = LOG_DEBUG;
+
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int
+get_log_level (void)
+{
+    return __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+/*
+ * Total number of records dropped, by all the threads.
+ */
+
+uint64_t
+log_dropped (void)
+{
+    log_ring *ring;
+    uint64_t dropped = 0;
+
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+	dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+    return dropped;
+}
+
+/*
+ * Create the ring of the current thread, and add it to the rings
+ * watched by the logger.
+ */
+
+static log_ring *
+new_ring (void)
+{
+    log_ring *ring = calloc(1, sizeof(log_ring));
+
+    if (ring == NULL)
+	return NULL;
+
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+
+    return thread_ring = ring;
+}
+
+/*
+ * Log an event of the packet path: the record is pushed in the ring
+ * of the thread, and formatted later by the logger. The hardware
+ * address can be NULL.
+ */
+
+void
+log_event (int event, uint8_t *mac, uint32_t address, uint16_t arg)
+{
+    log_ring *ring = thread_ring;
+    log_record *rec;
+    struct timespec ts;
+    uint64_t head;
+
+    if (event_levels[event] > __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+	return;
+
+    if (ring == NULL && (ring = new_ring()) == NULL)
+	return;
+
+    head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+	__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+	return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->time    = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->event   = event;
+    rec->arg     = arg;
+    rec->address = address;
+
+    if (mac != NULL)
+	memcpy(rec->mac, mac, sizeof(rec->mac));
+    else
+	memset(rec->mac, 0, sizeof(rec->mac));
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write a record, in the same format of the synchronous messages
+ * with a timestamp.
+ */
+
+static void
+format_record (log_record *rec)
+{
+    FILE *f = event_levels[rec->event] == LOG_ERROR ? stderr : stdout;
+    time_t sec = rec->time / 1000000000;
+    char when[32];
+    struct tm tm;
+
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+    fprintf(f, "%s.%06u ", when, (unsigned int) (rec->time % 1000000000 / 1000));
+
+    switch (rec->event) {
+
+    case EV_RECEIVED:
+	fprintf(f, "Received %s from %s",
+		rec->arg <= DHCP_INFORM ? message_types[rec->arg] : "unknown",
+		str_mac(rec->mac));
+	break;
+
+    case EV_OFFER:
+    case EV_OFFER_STATIC:
+	fprintf(f, "Offer %s to %s%s, %s status",
+		str_ip(rec->address), str_mac(rec->mac),
+		rec->event == EV_OFFER_STATIC ? " (static)" : "", str_status(rec->arg));
+	break;
+
+    case EV_NO_ADDRESS:
+	fprintf(f, "Can not offer an address to %s, no address available.",
+		str_mac(rec->mac));
+	break;
+
+    case EV_ACK:
+	fprintf(f, "Ack %s to %s, associated", str_ip(rec->address), str_mac(rec->mac));
+	break;
+
+    case EV_NAK:
+	fprintf(f, "Nak to %s, not associated", str_mac(rec->mac));
+	break;
+
+    case EV_CLEAR:
+	fprintf(f, "Clearing %s of %s, accepted another server offer",
+		str_ip(rec->address), str_mac(rec->mac));
+	break;
+
+    case EV_DECLINE:
+	fprintf(f, "Declined %s by %s", str_ip(rec->address), str_mac(rec->mac));
+	break;
+
+    case EV_RELEASE:
+	fprintf(f, "Released %s by %s", str_ip(rec->address), str_mac(rec->mac));
+	break;
+
+    case EV_INFORM:
+	fprintf(f, "Info to %s", str_mac(rec->mac));
+	break;
+
+    case EV_EXPIRE:
+	fprintf(f, "Expired %s of %s", str_ip(rec->address), str_mac(rec->mac));
+	break;
+
+    case EV_INVALID:
+	fprintf(f, "%s.%u: invalid request received", str_ip(rec->address), rec->arg);
+	break;
+
+    case EV_INVALID_TYPE:
+	fprintf(f, "%s.%u: request with invalid DHCP message type option",
+		str_ip(rec->address), rec->arg);
+	break;
+
+    case EV_SEND_FAILED:
+	fprintf(f, "Can not send a reply to %s", str_mac(rec->mac));
+	break;
+
+    case EV_NO_SUBNET:
+	fprintf(f, "Request of %s from %s, no subnet served", str_mac(rec->mac),
+		str_ip(rec->address));
+	break;
+
+    case EV_CIRCUIT_TAKEN:
+	fprintf(f, "Address %s of the circuit taken from %s", str_ip(rec->address),
+		str_mac(rec->mac));
+	break;
+
+    case EV_CIRCUIT_TWICE:
+	fprintf(f, "Address %s of a circuit bound twice, binding of %s removed",
+		str_ip(rec->address), str_mac(rec->mac));
+	break;
+
+    case EV_RECEIVE_ERROR:
+	fprintf(f, "Can not receive requests: %s", strerror(rec->arg));
+	break;
+
+    case EV_SEND_ERROR:
+	fprintf(f, "Can not send replies: %s", strerror(rec->arg));
+	break;
+
+    case EV_NEIGHBOR_ERROR:
+	fprintf(f, "Neighbor table: %s", strerror(rec->arg));
+	break;
+
+    }
+
+    fputc('\n', f);
+}
+
+static int
+compare_records (const void *a, const void *b)
+{
+    const log_record *x = a, *y = b;
+
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+/*
+ * Logger thread: the records of all the rings are collected, sorted
+ * by time and written; then the logger sleeps if there were none.
+ */
+
+static void *
+logger_main (void *arg)
+{
+    log_record *batch = malloc(LOG_RING_SIZE * sizeof(log_record));
+    struct timespec interval = { 0, LOG_INTERVAL * 1000000 };
+
+    for (;;) {
+	int running = __atomic_load_n(&logger_running, __ATOMIC_ACQUIRE);
+	size_t n = 0, i;
+	log_ring *ring;
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+	    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	    uint64_t tail = ring->tail;
+	    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	    for (; tail != head && n < LOG_RING_SIZE; tail++)
+		batch[n++] = ring->records[tail & (LOG_RING_SIZE - 1)];
+
+	    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	    if (dropped != ring->reported) {
+		fprintf(stderr, "Log: %llu records dropped\n",
+			(unsigned long long) (dropped - ring->reported));
+		ring->reported = dropped;
+	    }
+	}
+
+	qsort(batch, n, sizeof(log_record), compare_records);
+
+	for (i = 0; i < n; i++)
+	    format_record(&batch[i]);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if (n == LOG_RING_SIZE)
+	    continue; // more records are waiting
+
+	if (!running)
+	    break;
+
+	nanosleep(&interval, NULL);
+    }
+
+    free(batch);
+
+    return NULL;
+}
+
+/*
+ * Start the logger thread, logging the events up to the given level.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+start_logger (int level)
+{
+    set_log_level(level);
+
+    __atomic_store_n(&logger_running, 1, __ATOMIC_RELEASE);
+
+    if (pthread_create(&logger, NULL, logger_main, NULL) != 0)
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Stop the logger thread, once the records pushed are written, and
+ * free the rings: the other threads that log events must be stopped.
+ */
+
+void
+stop_logger (void)
+{
+    log_ring *ring;
+
+    __atomic_store_n(&logger_running, 0, __ATOMIC_RELEASE);
+    pthread_join(logger, NULL);
+
+    pthread_mutex_lock(&rings_lock);
+
+    while ((ring = rings) != NULL) {
+	rings = ring->next;
+	free(ring);
+    }
+
+    pthread_mutex_unlock(&rings_lock);
+
+    thread_ring = NULL;
+}
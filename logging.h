@@ -1,7 +1,15 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
 #include <stdio.h>
+#include <stdint.h>
 
 /*
- * Logging macros
+ * Logging macros, for the messages out of the packet path, written
+ * synchronously: they are called at startup, by the control loop
+ * (reloads, signals) and by the journal writer and checkpoint
+ * threads, never by the workers, which log events instead (see
+ * log_event). Their output is not ordered with the events.
  */
 
 #define log_info(str, ...)   do { \
@@ -14,3 +22,86 @@
     fprintf(stderr, (str), __VA_ARGS__);	\
     fprintf(stderr, "\n");			\
   } while(0);
+
+/*
+ * Events of the packet path, logged asynchronously: every thread
+ * pushes fixed size records in its own ring (a single producer,
+ * single consumer queue, without locks) and a logger thread formats
+ * and writes them, in time order. When the ring of a thread is full
+ * the record is dropped and counted.
+ *
+ * The level of the logged events can be changed at runtime.
+ */
+
+// log levels
+enum {
+    LOG_ERROR = 0,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+// events
+enum {
+    EV_RECEIVED = 1,   // message received (arg: message type)
+    EV_OFFER,          // address offered (arg: binding status)
+    EV_OFFER_STATIC,   // static address offered (arg: binding status)
+    EV_NO_ADDRESS,     // no address available
+    EV_ACK,            // address associated
+    EV_NAK,            // request refused
+    EV_CLEAR,          // offer accepted from another server
+    EV_DECLINE,        // address declined
+    EV_RELEASE,        // address released
+    EV_INFORM,         // information given
+    EV_EXPIRE,         // offer or lease expired
+    EV_INVALID,        // invalid request (address and arg: source address and port)
+    EV_INVALID_TYPE,   // invalid message type (address and arg: source address and port)
+    EV_SEND_FAILED,    // reply not sent
+    EV_NO_SUBNET,      // request of no subnet served (address: address looked up)
+    EV_CIRCUIT_TAKEN,  // address of a circuit taken from its previous client
+    EV_CIRCUIT_TWICE,  // address of a circuit bound twice, binding removed
+    EV_RECEIVE_ERROR,  // requests not received (arg: errno)
+    EV_SEND_ERROR,     // replies not sent (arg: errno)
+    EV_NEIGHBOR_ERROR, // neighbor entries not changed (arg: errno)
+    EV_MAX
+};
+
+enum {
+    LOG_RING_SIZE = 4096, // records of the ring of a thread (a power of two)
+    LOG_INTERVAL  = 10    // max delay of the logger (in milliseconds)
+};
+
+struct log_record {
+    uint64_t time;    // CLOCK_REALTIME, in nanoseconds
+    uint16_t event;
+    uint16_t arg;
+    uint8_t mac[6];   // hardware address of the client
+    uint32_t address;
+};
+
+typedef struct log_record log_record;
+
+struct log_ring {
+    log_record records[LOG_RING_SIZE];
+    uint64_t head;    // next record to push, written by the thread
+    uint64_t tail;    // next record to format, written by the logger
+    uint64_t dropped; // records dropped, written by the thread
+    uint64_t reported; // dropped records already reported, by the logger
+    struct log_ring *next;
+};
+
+typedef struct log_ring log_ring;
+
+/*
+ * Prototypes
+ */
+
+int start_logger (int level);
+void stop_logger (void);
+
+void set_log_level (int level);
+int get_log_level (void);
+uint64_t log_dropped (void);
+
+void log_event (int event, uint8_t *mac, uint32_t address, uint16_t arg);
+
+#endif
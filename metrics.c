@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "dhcpserver.h"
+#include "logging.h"
+
+enum {
+    METRICS_TIMEOUT = 1,   // max seconds to read a request and write its reply
+    METRICS_REQUEST = 4096 // max bytes of a request
+};
+
+static char *message_types[] = {
+    NULL, "discover", "offer", "request", "decline", "ack", "nak", "release", "inform"
+};
+
+static char *status_names[] = {
+    "empty", "associated", "pending", "expired", "released"
+};
+
+/*
+ * Current time of the monotonic clock, in nanoseconds.
+ */
+
+uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Count n replies sent with the given latency.
+ */
+
+void
+observe_latency (worker_metrics *m, uint64_t ns, unsigned int n)
+{
+    uint64_t us = ns / 1000;
+    unsigned int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+    if (i >= LATENCY_BUCKETS)
+	i = LATENCY_BUCKETS - 1;
+
+    count_metric(&m->latency[i], n);
+    count_metric(&m->latency_sum, ns * n);
+}
+
+/*
+ * Open the socket of the endpoint, listening on the loopback
+ * address only.
+ *
+ * Return the socket, -1 on error.
+ */
+
+static int
+open_metrics_socket (uint16_t port)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+    int s;
+
+    if ((s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+	return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	listen(s, 16) == -1) {
+	close(s);
+	return -1;
+    }
+
+    return s;
+}
+
+#define READ_METRIC(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/*
+ * Write the metrics of the server, in the Prometheus text format.
+ */
+
+void
+write_metrics (FILE *f, address_pool *pool, dhcp_worker *workers, unsigned int nworkers)
+{
+    worker_metrics sum;
+    uint64_t bindings[RELEASED + 1];
+    uint64_t cumulative = 0;
+    unsigned int i, j, k;
+
+    memset(&sum, 0, sizeof(sum));
+    memset(bindings, 0, sizeof(bindings));
+
+    for (i = 0; i < nworkers; i++) {
+	worker_metrics *m = &workers[i].metrics;
+
+	for (k = 0; k <= DHCP_INFORM; k++)
+	    sum.received[k] += READ_METRIC(m->received[k]);
+
+	for (k = 0; k < OUT_MAX; k++)
+	    sum.outcomes[k] += READ_METRIC(m->outcomes[k]);
+
+	for (k = 0; k < LATENCY_BUCKETS; k++)
+	    sum.latency[k] += READ_METRIC(m->latency[k]);
+
+	sum.batches     += READ_METRIC(m->batches);
+	sum.latency_sum += READ_METRIC(m->latency_sum);
+    }
+
+    for (i = 0; i < pool->nshards; i++) {
+	for (j = 0; j < pool->config->nsubnets; j++) {
+	    binding_list *list = &pool->shards[i].bindings[j];
+
+	    for (k = 0; k <= RELEASED; k++)
+		bindings[k] += READ_METRIC(list->by_status[k]);
+	}
+    }
+
+    fprintf(f, "# HELP dhcp_requests_total Requests received, by message type.\n"
+	    "# TYPE dhcp_requests_total counter\n");
+
+    for (k = 1; k <= DHCP_INFORM; k++) {
+	if (k == DHCP_OFFER || k == DHCP_ACK || k == DHCP_NAK)
+	    continue; // sent by servers only
+
+	fprintf(f, "dhcp_requests_total{type=\"%s\"} %llu\n", message_types[k],
+		(unsigned long long) sum.received[k]);
+    }
+
+    fprintf(f, "# HELP dhcp_replies_total Replies, by message type.\n"
+	    "# TYPE dhcp_replies_total counter\n"
+	    "dhcp_replies_total{type=\"offer\"} %llu\n"
+	    "dhcp_replies_total{type=\"ack\"} %llu\n"
+	    "dhcp_replies_total{type=\"nak\"} %llu\n",
+	    (unsigned long long) sum.outcomes[OUT_OFFER],
+	    (unsigned long long) sum.outcomes[OUT_ACK],
+	    (unsigned long long) sum.outcomes[OUT_NAK]);
+
+    fprintf(f, "# HELP dhcp_no_address_total Discovers with no address available.\n"
+	    "# TYPE dhcp_no_address_total counter\n"
+	    "dhcp_no_address_total %llu\n",
+	    (unsigned long long) sum.outcomes[OUT_NO_ADDRESS]);
+
+    fprintf(f, "# HELP dhcp_invalid_requests_total Requests discarded, by reason.\n"
+	    "# TYPE dhcp_invalid_requests_total counter\n"
+	    "dhcp_invalid_requests_total{reason=\"malformed\"} %llu\n"
+	    "dhcp_invalid_requests_total{reason=\"type\"} %llu\n"
+	    "dhcp_invalid_requests_total{reason=\"subnet\"} %llu\n",
+	    (unsigned long long) sum.outcomes[OUT_INVALID],
+	    (unsigned long long) sum.outcomes[OUT_INVALID_TYPE],
+	    (unsigned long long) sum.outcomes[OUT_NO_SUBNET]);
+
+    fprintf(f, "# HELP dhcp_send_failures_total Replies that could not be sent.\n"
+	    "# TYPE dhcp_send_failures_total counter\n"
+	    "dhcp_send_failures_total %llu\n",
+	    (unsigned long long) sum.outcomes[OUT_SEND_FAILED]);
+
+    fprintf(f, "# HELP dhcp_not_durable_total Replies dropped, the lease journal can not be written.\n"
+	    "# TYPE dhcp_not_durable_total counter\n"
+	    "dhcp_not_durable_total %llu\n",
+	    (unsigned long long) sum.outcomes[OUT_NOT_DURABLE]);
+
+    fprintf(f, "# HELP dhcp_batches_total Batches of messages served.\n"
+	    "# TYPE dhcp_batches_total counter\n"
+	    "dhcp_batches_total %llu\n",
+	    (unsigned long long) sum.batches);
+
+    fprintf(f, "# HELP dhcp_log_dropped_total Log records dropped, rings full.\n"
+	    "# TYPE dhcp_log_dropped_total counter\n"
+	    "dhcp_log_dropped_total %llu\n",
+	    (unsigned long long) log_dropped());
+
+    fprintf(f, "# HELP dhcp_reply_latency_seconds Time from the receive of a batch to its replies.\n"
+	    "# TYPE dhcp_reply_latency_seconds histogram\n");
+
+    for (k = 0; k < LATENCY_BUCKETS - 1; k++) {
+	cumulative += sum.latency[k];
+	fprintf(f, "dhcp_reply_latency_seconds_bucket{le=\"%.6f\"} %llu\n",
+		(double) (1ULL << k) / 1e6, (unsigned long long) cumulative);
+    }
+
+    cumulative += sum.latency[LATENCY_BUCKETS - 1];
+
+    fprintf(f, "dhcp_reply_latency_seconds_bucket{le=\"+Inf\"} %llu\n"
+	    "dhcp_reply_latency_seconds_sum %.9f\n"
+	    "dhcp_reply_latency_seconds_count %llu\n",
+	    (unsigned long long) cumulative, (double) sum.latency_sum / 1e9,
+	    (unsigned long long) cumulative);
+
+    fprintf(f, "# HELP dhcp_bindings Bindings, by status.\n"
+	    "# TYPE dhcp_bindings gauge\n");
+
+    for (k = 0; k <= RELEASED; k++)
+	fprintf(f, "dhcp_bindings{status=\"%s\"} %llu\n", status_names[k],
+		(unsigned long long) bindings[k]);
+
+    fprintf(f, "# HELP dhcp_pool_addresses Addresses of the pool of every subnet, free or in use.\n"
+	    "# TYPE dhcp_pool_addresses gauge\n");
+
+    for (j = 0; j < pool->config->nsubnets; j++) {
+	subnet_pool *subnet = &pool->config->subnets[j];
+	uint64_t nfree = 0, range = 0;
+	char label[32];
+
+	if (subnet->indexes.first == 0)
+	    continue;
+
+	for (i = 0; i < pool->nshards; i++) {
+	    binding_list *list = &pool->shards[i].bindings[j];
+
+	    nfree += READ_METRIC(list->free.count);
+	    range += list->range;
+	}
+
+	snprintf(label, sizeof(label), "%s/%u", str_ip(subnet->network), subnet->prefix);
+
+	fprintf(f, "dhcp_pool_addresses{subnet=\"%s\",state=\"free\"} %llu\n"
+		"dhcp_pool_addresses{subnet=\"%s\",state=\"used\"} %llu\n",
+		label, (unsigned long long) nfree, label, (unsigned long long) (range - nfree));
+    }
+}
+
+/*
+ * Wait until a connection is ready for the given events (POLLIN or
+ * POLLOUT), up to a deadline of the monotonic clock.
+ *
+ * Return 0 when ready, -1 on error or once the deadline has passed.
+ */
+
+static int
+wait_connection (int fd, short events, uint64_t deadline)
+{
+    struct pollfd pfd = { fd, events, 0 };
+
+    for (;;) {
+	uint64_t now = monotonic_ns();
+	int ret;
+
+	if (now >= deadline)
+	    return -1;
+
+	ret = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+
+	if (ret == -1 && errno == EINTR)
+	    continue;
+
+	return ret == 1 ? 0 : -1;
+    }
+}
+
+/*
+ * Write the whole buffer to a connection, before the deadline.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int
+send_all (int fd, char *buf, size_t len, uint64_t deadline)
+{
+    while (len > 0) {
+	ssize_t ret;
+
+	if (wait_connection(fd, POLLOUT, deadline) == -1)
+	    return -1;
+
+	ret = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	if (ret == -1) {
+	    if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    return -1;
+	}
+
+	buf += ret;
+	len -= ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Serve a connection: the request is read up to its end (its path
+ * does not matter), and the metrics are sent back, all within
+ * METRICS_TIMEOUT seconds whatever the pace of the client.
+ */
+
+static void
+serve_connection (int fd, address_pool *pool, dhcp_worker *workers, unsigned int nworkers)
+{
+    uint64_t deadline = monotonic_ns() + (uint64_t) METRICS_TIMEOUT * 1000000000;
+    char request[METRICS_REQUEST + 1];
+    char header[256];
+    size_t len = 0, size = 0;
+    char *body = NULL;
+    FILE *f;
+    int hlen;
+
+    while (len < METRICS_REQUEST) {
+	ssize_t ret;
+
+	if (wait_connection(fd, POLLIN, deadline) == -1)
+	    return;
+
+	ret = recv(fd, request + len, METRICS_REQUEST - len, MSG_DONTWAIT);
+
+	if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+	    continue;
+
+	if (ret <= 0)
+	    return;
+
+	len += ret;
+	request[len] = '\0';
+
+	if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+	    break;
+    }
+
+    if ((f = open_memstream(&body, &size)) == NULL)
+	return;
+
+    // the configuration is replaced by the control loop meanwhile
+
+    pthread_mutex_lock(&pool->config_lock);
+    write_metrics(f, pool, workers, nworkers);
+    pthread_mutex_unlock(&pool->config_lock);
+
+    fclose(f);
+
+    hlen = snprintf(header, sizeof(header),
+		    "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %zu\r\n"
+		    "Connection: close\r\n\r\n", size);
+
+    if (send_all(fd, header, hlen, deadline) == 0)
+	send_all(fd, body, size, deadline);
+
+    free(body);
+}
+
+/*
+ * Called by the loop of the metrics thread when the endpoint has
+ * connections waiting: every connection is served, then closed.
+ */
+
+static void
+metrics_handler (event *ev, uint32_t events)
+{
+    metrics_server *m = ev->arg;
+    int fd;
+
+    while ((fd = accept4(ev->fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+	serve_connection(fd, m->pool, m->workers, m->nworkers);
+	close(fd);
+    }
+}
+
+static void *
+metrics_main (void *arg)
+{
+    metrics_server *m = arg;
+
+    run_event_loop(&m->loop);
+
+    return NULL;
+}
+
+/*
+ * Start the thread of the endpoint, listening on the given port.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+start_metrics (metrics_server *m, uint16_t port, address_pool *pool,
+	       dhcp_worker *workers, unsigned int nworkers)
+{
+    int s;
+
+    m->pool     = pool;
+    m->workers  = workers;
+    m->nworkers = nworkers;
+
+    if ((s = open_metrics_socket(port)) == -1)
+	return -1;
+
+    if (init_event_loop(&m->loop) == -1) {
+	close(s);
+	return -1;
+    }
+
+    if (add_event(&m->loop, &m->listen_ev, s, metrics_handler, m) == -1 ||
+	pthread_create(&m->thread, NULL, metrics_main, m) != 0) {
+	close(s);
+	delete_event_loop(&m->loop);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop the thread of the endpoint, once the connection being
+ * served (if any) is closed.
+ */
+
+void
+stop_metrics (metrics_server *m)
+{
+    stop_event_loop(&m->loop);
+    pthread_join(m->thread, NULL);
+
+    delete_event(&m->loop, &m->listen_ev);
+    delete_event_loop(&m->loop);
+}
@@ -0,0 +1,98 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "options.h"
+#include "event.h"
+
+/*
+ * Runtime metrics, read from a local TCP endpoint in the Prometheus
+ * text format.
+ *
+ * Every worker counts the messages it serves in its own counters,
+ * written only by its thread (plain stores, no shared cache line);
+ * the endpoint, served by a thread of its own so that a slow client
+ * never delays the control loop (signals, reloads), sums the
+ * counters of all the workers. The number of bindings by status is kept by the
+ * binding lists (see bindings.h), and read without taking the shard
+ * locks: a scrape never pauses the packet loop.
+ */
+
+// outcomes of the messages served
+enum {
+    OUT_OFFER = 0,
+    OUT_ACK,
+    OUT_NAK,
+    OUT_NO_ADDRESS,   // discover with no address available
+    OUT_INVALID,      // not a valid request (see expand_request)
+    OUT_INVALID_TYPE, // unknown message type
+    OUT_SEND_FAILED,  // reply not sent
+    OUT_NO_SUBNET,    // request of no subnet served
+    OUT_NOT_DURABLE,  // reply dropped, the journal can not be written
+    OUT_MAX
+};
+
+/*
+ * Request-to-reply latency, in buckets of powers of two
+ * microseconds: the bucket i counts the replies sent within
+ * 2^i microseconds, the last one the others.
+ */
+
+enum {
+    LATENCY_BUCKETS = 24
+};
+
+struct worker_metrics {
+    uint64_t received[DHCP_INFORM + 1]; // requests by message type
+    uint64_t outcomes[OUT_MAX];
+    uint64_t batches;                   // batches served
+
+    uint64_t latency[LATENCY_BUCKETS]; // replies by latency
+    uint64_t latency_sum;              // total latency (in nanoseconds)
+} __attribute__((aligned(64)));
+
+typedef struct worker_metrics worker_metrics;
+
+/*
+ * Add to a counter of the current thread: a single store, so the
+ * endpoint never reads a torn value.
+ */
+
+static inline void
+count_metric (uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+struct address_pool;
+struct dhcp_worker;
+
+struct metrics_server {
+    event_loop loop;
+    event listen_ev; // connections on the socket of the endpoint
+    pthread_t thread;
+
+    struct address_pool *pool;
+    struct dhcp_worker *workers;
+    unsigned int nworkers;
+};
+
+typedef struct metrics_server metrics_server;
+
+/*
+ * Prototypes
+ */
+
+uint64_t monotonic_ns (void);
+void observe_latency (worker_metrics *m, uint64_t ns, unsigned int n);
+
+void write_metrics (FILE *f, struct address_pool *pool,
+		    struct dhcp_worker *workers, unsigned int nworkers);
+int start_metrics (metrics_server *m, uint16_t port, struct address_pool *pool,
+		   struct dhcp_worker *workers, unsigned int nworkers);
+void stop_metrics (metrics_server *m);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+#include "neighbor.h"
+#include "logging.h"
+
+/*
+ * Initialize a neighbor table for the entries of a device.
+ *
+ * If the device is not specified, or on error, the table is
+ * disabled and its functions do nothing.
+ *
+ * Return 0 on success, -1 if the table is disabled.
+ */
+
+int
+init_neighbor_table (neighbor_table *table, char *device)
+{
+    struct sockaddr_nl sa;
+
+    memset(table, 0, sizeof(*table));
+    table->nl = -1;
+
+    if (device == NULL || device[0] == '\0')
+	return -1;
+
+    if ((table->ifindex = if_nametoindex(device)) == 0) {
+	perror("neighbor table: if_nametoindex()");
+	return -1;
+    }
+
+    if ((table->nl = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    NETLINK_ROUTE)) == -1) {
+	perror("neighbor table: socket()");
+	return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+
+    if (bind(table->nl, (struct sockaddr *) &sa, sizeof(sa)) == -1) {
+	perror("neighbor table: bind()");
+	close(table->nl);
+	table->nl = -1;
+	return -1;
+    }
+
+    return 0;
+}
+
+static neighbor_entry *
+cache_entry (neighbor_table *table, uint32_t address)
+{
+    return &table->cache[ntohl(address) & (NEIGHBOR_CACHE - 1)];
+}
+
+static void
+add_attribute (struct nlmsghdr *nh, int type, void *data, int len)
+{
+    struct rtattr *rta = (struct rtattr *) ((uint8_t *) nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len  = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/*
+ * Queue a new (or replaced) neighbor entry, or the removal of an entry
+ * if mac is NULL.
+ */
+
+static void
+queue_update (neighbor_table *table, uint32_t address, uint8_t *mac)
+{
+    struct nlmsghdr *nh;
+    struct ndmsg *nd;
+
+    if (table->len + NLMSG_SPACE(sizeof(*nd) + RTA_SPACE(4) + RTA_SPACE(6)) >
+	sizeof(table->buf))
+	flush_neighbors(table);
+
+    nh = (struct nlmsghdr *) (table->buf + table->len);
+    memset(nh, 0, NLMSG_SPACE(sizeof(*nd) + RTA_SPACE(4) + RTA_SPACE(6)));
+
+    nh->nlmsg_len   = NLMSG_LENGTH(sizeof(*nd));
+    nh->nlmsg_type  = mac ? RTM_NEWNEIGH : RTM_DELNEIGH;
+    nh->nlmsg_flags = NLM_F_REQUEST;
+    nh->nlmsg_seq   = ++table->seq;
+
+    if (mac)
+	nh->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+
+    nd = NLMSG_DATA(nh);
+    nd->ndm_family  = AF_INET;
+    nd->ndm_ifindex = table->ifindex;
+    nd->ndm_state   = NUD_REACHABLE;
+
+    add_attribute(nh, NDA_DST, &address, 4);
+
+    if (mac)
+	add_attribute(nh, NDA_LLADDR, mac, 6);
+
+    table->len += NLMSG_ALIGN(nh->nlmsg_len);
+}
+
+/*
+ * Add a neighbor entry for a client, unless the same entry
+ * has been added recently.
+ */
+
+void
+add_neighbor (neighbor_table *table, uint32_t address, uint8_t *mac)
+{
+    neighbor_entry *entry;
+    time_t now;
+
+    if (table->nl == -1)
+	return;
+
+    entry = cache_entry(table, address);
+    now = time(NULL);
+
+    if (entry->address == address && memcmp(entry->mac, mac, 6) == 0 &&
+	now - entry->updated < NEIGHBOR_VALID)
+	return;
+
+    queue_update(table, address, mac);
+
+    entry->address = address;
+    memcpy(entry->mac, mac, 6);
+    entry->updated = now;
+}
+
+/*
+ * Remove the neighbor entry of an address (e.g. of an expired lease).
+ */
+
+void
+delete_neighbor (neighbor_table *table, uint32_t address)
+{
+    neighbor_entry *entry;
+
+    if (table->nl == -1)
+	return;
+
+    entry = cache_entry(table, address);
+
+    if (entry->address == address)
+	entry->address = 0;
+
+    queue_update(table, address, NULL);
+}
+
+/*
+ * Send the queued updates to the kernel, with a single message.
+ *
+ * No acknowledgment is requested: the kernel replies only on error,
+ * and the errors are read back (and logged) without waiting.
+ */
+
+void
+flush_neighbors (neighbor_table *table)
+{
+    struct sockaddr_nl sa;
+    uint8_t buf[4096];
+    ssize_t len;
+
+    if (table->nl == -1 || table->len == 0)
+	return;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+
+    if (sendto(table->nl, table->buf, table->len, 0,
+	       (struct sockaddr *) &sa, sizeof(sa)) == -1)
+	log_event(EV_NEIGHBOR_ERROR, NULL, 0, errno);
+
+    table->len = 0;
+
+    while ((len = recv(table->nl, buf, sizeof(buf), 0)) > 0) {
+	struct nlmsghdr *nh;
+
+	for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+	    struct nlmsgerr *err = NLMSG_DATA(nh);
+
+	    // removing an entry already gone is not an error
+	    if (nh->nlmsg_type == NLMSG_ERROR && err->error != 0 &&
+		!(err->msg.nlmsg_type == RTM_DELNEIGH && err->error == -ENOENT))
+		log_event(EV_NEIGHBOR_ERROR, NULL, 0, -err->error);
+	}
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef NEIGHBOR_H
+#define NEIGHBOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Neighbor (ARP) entries of the clients, managed with rtnetlink.
+ *
+ * The updates are queued in a buffer and sent to the kernel
+ * with a single message when the buffer is flushed (i.e. once
+ * per batch of replies). An update already sent recently for
+ * the same address and hardware address is skipped, using a
+ * direct mapped cache indexed by address.
+ */
+
+enum {
+    NEIGHBOR_BUFFER = 8192, // bytes of queued updates
+    NEIGHBOR_CACHE  = 1024, // entries of the cache (a power of two)
+    NEIGHBOR_VALID  = 15    // seconds an entry is assumed to be in the kernel
+};
+
+struct neighbor_entry {
+    uint32_t address; // zero if the entry is empty
+    uint8_t mac[6];
+    time_t updated;   // time of the last update sent
+};
+
+typedef struct neighbor_entry neighbor_entry;
+
+struct neighbor_table {
+    int nl;      // rtnetlink socket, -1 if disabled
+    int ifindex; // device of the entries
+    uint32_t seq;
+
+    uint8_t buf[NEIGHBOR_BUFFER]; // queued updates
+    size_t len;
+
+    neighbor_entry cache[NEIGHBOR_CACHE];
+};
+
+typedef struct neighbor_table neighbor_table;
+
+/*
+ * Prototypes
+ */
+
+int init_neighbor_table (neighbor_table *table, char *device);
+
+void add_neighbor (neighbor_table *table, uint32_t address, uint8_t *mac);
+void delete_neighbor (neighbor_table *table, uint32_t address);
+void flush_neighbors (neighbor_table *table);
+
+#endif
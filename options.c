@@ -13,7 +13,6 @@
 #include <ctype.h>
 #include <regex.h>
 
-#include "queue.h"
 #include "options.h"
 #include "logging.h"
 
@@ -22,6 +21,12 @@ const uint8_t option_magic[4] = { 0x63, 0x82, 0x53, 0x63 };
 /* 
  * Mapping table between DHCP options and 
  * functions that parse their value.
+ *
+ * The length of a received option is checked against size, if
+ * the option has a fixed length, or must be a non zero multiple
+ * of unit, if the option is a list (or a string), or must be zero
+ * if the option is a flag without a value (empty). Options with
+ * zero size and unit are not checked otherwise.
  */
 
 static struct {
@@ -29,84 +34,91 @@ static struct {
     char *name;
     int (*f) (char *, void **);
 
+    uint8_t size; // fixed length of the option
+    uint8_t unit; // length of the elements of a variable length option
+    uint8_t empty; // the option has no value (e.g. RAPID_COMMIT, RFC 4039)
+
 } dhcp_option_info [256] = {
 
-    [PAD] { "PAD", NULL },
-    [END] { "END", NULL },
-    [SUBNET_MASK] { "SUBNET_MASK", parse_ip },
-    [TIME_OFFSET] { "TIME_OFFSET", parse_long },
-    [ROUTER] { "ROUTER", parse_ip_list },
-    [TIME_SERVER] { "TIME_SERVER", parse_ip_list },
-    [NAME_SERVER] { "NAME_SERVER", parse_ip_list },
-    [DOMAIN_NAME_SERVER] { "DOMAIN_NAME_SERVER", parse_ip_list },
-    [LOG_SERVER] { "LOG_SERVER", parse_ip_list },
-    [COOKIE_SERVER] { "COOKIE_SERVER", parse_ip_list },
-    [LPR_SERVER] { "LPR_SERVER", parse_ip_list },
-    [IMPRESS_SERVER] { "IMPRESS_SERVER", parse_ip_list },
-    [RESOURCE_LOCATION_SERVER] { "RESOURCE_LOCATION_SERVER", parse_ip_list },
-    [HOST_NAME] { "HOST_NAME", parse_string },
-    [BOOT_FILE_SIZE] { "BOOT_FILE_SIZE", parse_short },
-    [MERIT_DUMP_FILE] { "MERIT_DUMP_FILE", parse_string },
-    [DOMAIN_NAME] { "DOMAIN_NAME", parse_string },
-    [SWAP_SERVER] { "SWAP_SERVER", parse_ip },
-    [ROOT_PATH] { "ROOT_PATH", parse_string },
-    [EXTENSIONS_PATH] { "EXTENSIONS_PATH", parse_string },
-    [IP_FORWARDING] { "IP_FORWARDING", parse_byte },
-    [NON_LOCAL_SOURCE_ROUTING] { "NON_LOCAL_SOURCE_ROUTING", parse_byte },
-    [POLICY_FILTER] { "POLICY_FILTER", parse_ip_list },
-    [MAXIMUM_DATAGRAM_REASSEMBLY_SIZE] { "MAXIMUM_DATAGRAM_REASSEMBLY_SIZE", parse_short },
-    [DEFAULT_IP_TIME_TO_LIVE] { "DEFAULT_IP_TIME_TO_LIVE", parse_byte },
-    [PATH_MTU_AGING_TIMEOUT] { "PATH_MTU_AGING_TIMEOUT", parse_long },
-    [PATH_MTU_PLATEAU_TABLE] { "PATH_MTU_PLATEAU_TABLE", parse_short_list },
-    [INTERFACE_MTU] { "INTERFACE_MTU", parse_short },
-    [ALL_SUBNETS_ARE_LOCAL] { "ALL_SUBNETS_ARE_LOCAL", parse_byte },
-    [BROADCAST_ADDRESS] { "BROADCAST_ADDRESS", parse_ip },
-    [PERFORM_MASK_DISCOVERY] { "PERFORM_MASK_DISCOVERY", parse_byte },
-    [MASK_SUPPLIER] { "MASK_SUPPLIER", parse_byte },
-    [PERFORM_ROUTER_DISCOVERY] { "PERFORM_ROUTER_DISCOVERY", parse_byte },
-    [ROUTER_SOLICITATION_ADDRESS] { "ROUTER_SOLICITATION_ADDRESS", parse_ip },
-    [STATIC_ROUTE] { "STATIC_ROUTE", parse_ip_list },
-    [TRAILER_ENCAPSULATION] { "TRAILER_ENCAPSULATION", parse_byte },
-    [ARP_CACHE_TIMEOUT] { "ARP_CACHE_TIMEOUT", parse_long },
-    [ETHERNET_ENCAPSULATION] { "ETHERNET_ENCAPSULATION", parse_byte },
-    [TCP_DEFAULT_TTL] { "TCP_DEFAULT_TTL", parse_byte },
-    [TCP_KEEPALIVE_INTERVAL] { "TCP_KEEPALIVE_INTERVAL", parse_long },
-    [TCP_KEEPALIVE_GARBAGE] { "TCP_KEEPALIVE_GARBAGE", parse_byte },
-    [NETWORK_INFORMATION_SERVICE_DOMAIN] { "NETWORK_INFORMATION_SERVICE_DOMAIN", parse_string },
-    [NETWORK_INFORMATION_SERVERS] { "NETWORK_INFORMATION_SERVERS", parse_ip_list },
-    [NETWORK_TIME_PROTOCOL_SERVERS] { "NETWORK_TIME_PROTOCOL_SERVERS", parse_ip_list },
-    [VENDOR_SPECIFIC_INFORMATION] { "VENDOR_SPECIFIC_INFORMATION", parse_byte_list },
-    [NETBIOS_OVER_TCP_IP_NAME_SERVER] { "NETBIOS_OVER_TCP_IP_NAME_SERVER", parse_ip_list },
-    [NETBIOS_OVER_TCP_IP_DATAGRAM_DISTRIBUTION_SERVER] { "NETBIOS_OVER_TCP_IP_DATAGRAM_DISTRIBUTION_SERVER", parse_ip_list },
-    [NETBIOS_OVER_TCP_IP_NODE_TYPE] { "NETBIOS_OVER_TCP_IP_NODE_TYPE", parse_byte },
-    [NETBIOS_OVER_TCP_IP_SCOPE] { "NETBIOS_OVER_TCP_IP_SCOPE", parse_string },
-    [X_WINDOW_SYSTEM_FONT_SERVER] { "X_WINDOW_SYSTEM_FONT_SERVER", parse_ip_list },
-    [X_WINDOW_SYSTEM_DISPLAY_MANAGER] { "X_WINDOW_SYSTEM_DISPLAY_MANAGER", parse_ip_list },
-    [NETWORK_INFORMATION_SERVICE_PLUS_DOMAIN] { "NETWORK_INFORMATION_SERVICE_PLUS_DOMAIN", parse_string },
-    [NETWORK_INFORMATION_SERVICE_PLUS_SERVERS] { "NETWORK_INFORMATION_SERVICE_PLUS_SERVERS", parse_ip_list },
-    [MOBILE_IP_HOME_AGENT] { "MOBILE_IP_HOME_AGENT", parse_ip_list },
-    [SMTP_SERVER] { "SMTP_SERVER", parse_ip_list },
-    [POP3_SERVER] { "POP3_SERVER", parse_ip_list },
-    [NNTP_SERVER] { "NNTP_SERVER", parse_ip_list },
-    [DEFAULT_WWW_SERVER] { "DEFAULT_WWW_SERVER", parse_ip_list },
-    [DEFAULT_FINGER_SERVER] { "DEFAULT_FINGER_SERVER", parse_ip_list },
-    [DEFAULT_IRC_SERVER] { "DEFAULT_IRC_SERVER", parse_ip_list },
-    [STREETTALK_SERVER] { "STREETTALK_SERVER", parse_ip_list },
-    [STREETTALK_DIRECTORY_ASSISTANCE_SERVER] { "STREETTALK_DIRECTORY_ASSISTANCE_SERVER",  parse_ip_list },
-    [REQUESTED_IP_ADDRESS] { "REQUESTED_IP_ADDRESS", NULL },
-    [IP_ADDRESS_LEASE_TIME] { "IP_ADDRESS_LEASE_TIME", parse_long },
-    [OPTION_OVERLOAD] { "OPTION_OVERLOAD", parse_byte },
-    [TFTP_SERVER_NAME] { "TFTP_SERVER_NAME", parse_string },
-    [BOOTFILE_NAME] { "BOOTFILE_NAME", parse_string },
-    [DHCP_MESSAGE_TYPE] { "DHCP_MESSAGE_TYPE", NULL },
-    [SERVER_IDENTIFIER] { "SERVER_IDENTIFIER", parse_ip },
-    [PARAMETER_REQUEST_LIST] { "PARAMETER_REQUEST_LIST", NULL },
-    [MESSAGE] { "MESSAGE", NULL },
-    [MAXIMUM_DHCP_MESSAGE_SIZE] { "MAXIMUM_DHCP_MESSAGE_SIZE", NULL },
-    [RENEWAL_T1_TIME_VALUE] { "RENEWAL_T1_TIME_VALUE", parse_long },
-    [REBINDING_T2_TIME_VALUE] { "REBINDING_T2_TIME_VALUE", parse_long },
-    [VENDOR_CLASS_IDENTIFIER] { "VENDOR_CLASS_IDENTIFIER", NULL },
-    [CLIENT_IDENTIFIER] { "CLIENT_IDENTIFIER", NULL },
+    [PAD] { "PAD", NULL, 0, 0 },
+    [END] { "END", NULL, 0, 0 },
+    [SUBNET_MASK] { "SUBNET_MASK", parse_ip, 4, 0 },
+    [TIME_OFFSET] { "TIME_OFFSET", parse_long, 4, 0 },
+    [ROUTER] { "ROUTER", parse_ip_list, 0, 4 },
+    [TIME_SERVER] { "TIME_SERVER", parse_ip_list, 0, 4 },
+    [NAME_SERVER] { "NAME_SERVER", parse_ip_list, 0, 4 },
+    [DOMAIN_NAME_SERVER] { "DOMAIN_NAME_SERVER", parse_ip_list, 0, 4 },
+    [LOG_SERVER] { "LOG_SERVER", parse_ip_list, 0, 4 },
+    [COOKIE_SERVER] { "COOKIE_SERVER", parse_ip_list, 0, 4 },
+    [LPR_SERVER] { "LPR_SERVER", parse_ip_list, 0, 4 },
+    [IMPRESS_SERVER] { "IMPRESS_SERVER", parse_ip_list, 0, 4 },
+    [RESOURCE_LOCATION_SERVER] { "RESOURCE_LOCATION_SERVER", parse_ip_list, 0, 4 },
+    [HOST_NAME] { "HOST_NAME", parse_string, 0, 1 },
+    [BOOT_FILE_SIZE] { "BOOT_FILE_SIZE", parse_short, 2, 0 },
+    [MERIT_DUMP_FILE] { "MERIT_DUMP_FILE", parse_string, 0, 1 },
+    [DOMAIN_NAME] { "DOMAIN_NAME", parse_string, 0, 1 },
+    [SWAP_SERVER] { "SWAP_SERVER", parse_ip, 4, 0 },
+    [ROOT_PATH] { "ROOT_PATH", parse_string, 0, 1 },
+    [EXTENSIONS_PATH] { "EXTENSIONS_PATH", parse_string, 0, 1 },
+    [IP_FORWARDING] { "IP_FORWARDING", parse_byte, 1, 0 },
+    [NON_LOCAL_SOURCE_ROUTING] { "NON_LOCAL_SOURCE_ROUTING", parse_byte, 1, 0 },
+    [POLICY_FILTER] { "POLICY_FILTER", parse_ip_list, 0, 8 },
+    [MAXIMUM_DATAGRAM_REASSEMBLY_SIZE] { "MAXIMUM_DATAGRAM_REASSEMBLY_SIZE", parse_short, 2, 0 },
+    [DEFAULT_IP_TIME_TO_LIVE] { "DEFAULT_IP_TIME_TO_LIVE", parse_byte, 1, 0 },
+    [PATH_MTU_AGING_TIMEOUT] { "PATH_MTU_AGING_TIMEOUT", parse_long, 4, 0 },
+    [PATH_MTU_PLATEAU_TABLE] { "PATH_MTU_PLATEAU_TABLE", parse_short_list, 0, 2 },
+    [INTERFACE_MTU] { "INTERFACE_MTU", parse_short, 2, 0 },
+    [ALL_SUBNETS_ARE_LOCAL] { "ALL_SUBNETS_ARE_LOCAL", parse_byte, 1, 0 },
+    [BROADCAST_ADDRESS] { "BROADCAST_ADDRESS", parse_ip, 4, 0 },
+    [PERFORM_MASK_DISCOVERY] { "PERFORM_MASK_DISCOVERY", parse_byte, 1, 0 },
+    [MASK_SUPPLIER] { "MASK_SUPPLIER", parse_byte, 1, 0 },
+    [PERFORM_ROUTER_DISCOVERY] { "PERFORM_ROUTER_DISCOVERY", parse_byte, 1, 0 },
+    [ROUTER_SOLICITATION_ADDRESS] { "ROUTER_SOLICITATION_ADDRESS", parse_ip, 4, 0 },
+    [STATIC_ROUTE] { "STATIC_ROUTE", parse_ip_list, 0, 8 },
+    [TRAILER_ENCAPSULATION] { "TRAILER_ENCAPSULATION", parse_byte, 1, 0 },
+    [ARP_CACHE_TIMEOUT] { "ARP_CACHE_TIMEOUT", parse_long, 4, 0 },
+    [ETHERNET_ENCAPSULATION] { "ETHERNET_ENCAPSULATION", parse_byte, 1, 0 },
+    [TCP_DEFAULT_TTL] { "TCP_DEFAULT_TTL", parse_byte, 1, 0 },
+    [TCP_KEEPALIVE_INTERVAL] { "TCP_KEEPALIVE_INTERVAL", parse_long, 4, 0 },
+    [TCP_KEEPALIVE_GARBAGE] { "TCP_KEEPALIVE_GARBAGE", parse_byte, 1, 0 },
+    [NETWORK_INFORMATION_SERVICE_DOMAIN] { "NETWORK_INFORMATION_SERVICE_DOMAIN", parse_string, 0, 1 },
+    [NETWORK_INFORMATION_SERVERS] { "NETWORK_INFORMATION_SERVERS", parse_ip_list, 0, 4 },
+    [NETWORK_TIME_PROTOCOL_SERVERS] { "NETWORK_TIME_PROTOCOL_SERVERS", parse_ip_list, 0, 4 },
+    [VENDOR_SPECIFIC_INFORMATION] { "VENDOR_SPECIFIC_INFORMATION", parse_byte_list, 0, 1 },
+    [NETBIOS_OVER_TCP_IP_NAME_SERVER] { "NETBIOS_OVER_TCP_IP_NAME_SERVER", parse_ip_list, 0, 4 },
+    [NETBIOS_OVER_TCP_IP_DATAGRAM_DISTRIBUTION_SERVER] { "NETBIOS_OVER_TCP_IP_DATAGRAM_DISTRIBUTION_SERVER", parse_ip_list, 0, 4 },
+    [NETBIOS_OVER_TCP_IP_NODE_TYPE] { "NETBIOS_OVER_TCP_IP_NODE_TYPE", parse_byte, 1, 0 },
+    [NETBIOS_OVER_TCP_IP_SCOPE] { "NETBIOS_OVER_TCP_IP_SCOPE", parse_string, 0, 1 },
+    [X_WINDOW_SYSTEM_FONT_SERVER] { "X_WINDOW_SYSTEM_FONT_SERVER", parse_ip_list, 0, 4 },
+    [X_WINDOW_SYSTEM_DISPLAY_MANAGER] { "X_WINDOW_SYSTEM_DISPLAY_MANAGER", parse_ip_list, 0, 4 },
+    [NETWORK_INFORMATION_SERVICE_PLUS_DOMAIN] { "NETWORK_INFORMATION_SERVICE_PLUS_DOMAIN", parse_string, 0, 1 },
+    [NETWORK_INFORMATION_SERVICE_PLUS_SERVERS] { "NETWORK_INFORMATION_SERVICE_PLUS_SERVERS", parse_ip_list, 0, 4 },
+    [MOBILE_IP_HOME_AGENT] { "MOBILE_IP_HOME_AGENT", parse_ip_list, 0, 0 },
+    [SMTP_SERVER] { "SMTP_SERVER", parse_ip_list, 0, 4 },
+    [POP3_SERVER] { "POP3_SERVER", parse_ip_list, 0, 4 },
+    [NNTP_SERVER] { "NNTP_SERVER", parse_ip_list, 0, 4 },
+    [DEFAULT_WWW_SERVER] { "DEFAULT_WWW_SERVER", parse_ip_list, 0, 4 },
+    [DEFAULT_FINGER_SERVER] { "DEFAULT_FINGER_SERVER", parse_ip_list, 0, 4 },
+    [DEFAULT_IRC_SERVER] { "DEFAULT_IRC_SERVER", parse_ip_list, 0, 4 },
+    [STREETTALK_SERVER] { "STREETTALK_SERVER", parse_ip_list, 0, 4 },
+    [STREETTALK_DIRECTORY_ASSISTANCE_SERVER] { "STREETTALK_DIRECTORY_ASSISTANCE_SERVER", parse_ip_list, 0, 4 },
+    [REQUESTED_IP_ADDRESS] { "REQUESTED_IP_ADDRESS", NULL, 4, 0 },
+    [IP_ADDRESS_LEASE_TIME] { "IP_ADDRESS_LEASE_TIME", parse_long, 4, 0 },
+    [OPTION_OVERLOAD] { "OPTION_OVERLOAD", parse_byte, 1, 0 },
+    [TFTP_SERVER_NAME] { "TFTP_SERVER_NAME", parse_string, 0, 1 },
+    [BOOTFILE_NAME] { "BOOTFILE_NAME", parse_string, 0, 1 },
+    [DHCP_MESSAGE_TYPE] { "DHCP_MESSAGE_TYPE", NULL, 1, 0 },
+    [SERVER_IDENTIFIER] { "SERVER_IDENTIFIER", parse_ip, 4, 0 },
+    [PARAMETER_REQUEST_LIST] { "PARAMETER_REQUEST_LIST", NULL, 0, 1 },
+    [MESSAGE] { "MESSAGE", NULL, 0, 1 },
+    [MAXIMUM_DHCP_MESSAGE_SIZE] { "MAXIMUM_DHCP_MESSAGE_SIZE", NULL, 2, 0 },
+    [RENEWAL_T1_TIME_VALUE] { "RENEWAL_T1_TIME_VALUE", parse_long, 4, 0 },
+    [REBINDING_T2_TIME_VALUE] { "REBINDING_T2_TIME_VALUE", parse_long, 4, 0 },
+    [VENDOR_CLASS_IDENTIFIER] { "VENDOR_CLASS_IDENTIFIER", NULL, 0, 1 },
+    [CLIENT_IDENTIFIER] { "CLIENT_IDENTIFIER", NULL, 0, 1 },
+    [USER_CLASS] { "USER_CLASS", NULL, 0, 1 },
+    [RAPID_COMMIT] { "RAPID_COMMIT", NULL, 0, 0, 1 },
+    [RELAY_AGENT_INFORMATION] { "RELAY_AGENT_INFORMATION", NULL, 0, 1 },
     
 };
 
@@ -151,7 +163,7 @@ int
 parse_short (char *s, void **p)
 {
     *p = malloc(sizeof(uint16_t));
-    uint16_t n = ((uint16_t) strtol(s, NULL, 0));
+    uint16_t n = htons((uint16_t) strtol(s, NULL, 0));
     memcpy(*p, &n, sizeof(n));
     
     return sizeof(uint16_t);
@@ -169,7 +181,7 @@ parse_short_list (char *s, void **p)
 
     while(s3 != NULL) {
 
-	uint16_t n = ((uint16_t) strtol(s3, NULL, 0));
+	uint16_t n = htons((uint16_t) strtol(s3, NULL, 0));
 
 	memcpy(((uint8_t *) *p) + count, &n, sizeof(uint16_t));
 
@@ -186,7 +198,7 @@ int
 parse_long (char *s, void **p)
 {
     *p = malloc(sizeof(uint32_t));
-    uint32_t n = strtol(s, NULL, 0);
+    uint32_t n = htonl(strtol(s, NULL, 0));
     memcpy(*p, &n, sizeof(n));
 
     return sizeof(uint32_t);
@@ -324,165 +336,293 @@ parse_option (dhcp_option *opt, char *name, char *value)
 }
 
 /*
- * Initialize an option list.
+ * Initialize an option table used to store options (e.g. the options
+ * of a pool): they are kept already encoded, after the magic cookie,
+ * so they can be copied as they are inside a message.
  */
 
 void
-init_option_list (dhcp_option_list *list)
+init_option_table (dhcp_option_table *table)
 {
-    TAILQ_INIT(list);
+    memset(table->offset, 0, sizeof(table->offset));
+
+    table->size = 512;
+    table->base = malloc(table->size);
+
+    memcpy(table->base, option_magic, sizeof(option_magic));
+    table->len = sizeof(option_magic);
 }
 
 /*
- * Given a list of options search an option having
- * the passed option id, and returns a pointer to it.
- *
- * If the option is not present the function returns NULL.
+ * Initialize an option table with a copy of the options of another one.
  */
 
-dhcp_option *
-search_option (dhcp_option_list *list, uint8_t id)
+void
+copy_option_table (dhcp_option_table *table, dhcp_option_table *from)
+{
+    memcpy(table->offset, from->offset, sizeof(table->offset));
+
+    table->size = from->size;
+    table->len  = from->len;
+    table->base = malloc(table->size);
+
+    memcpy(table->base, from->base, from->len);
+}
+
+void
+delete_option_table (dhcp_option_table *table)
 {
-    dhcp_option *opt, *opt_temp;
+    free(table->base);
+
+    table->base = NULL;
+    table->len = table->size = 0;
+}
 
-    TAILQ_FOREACH_SAFE(opt, list, pointers, opt_temp) {
+/*
+ * Add an option to an option table, replacing the option
+ * with the same id (if any).
+ *
+ * Return 1 on success, 0 if the table is full.
+ */
 
-	if(opt->id == id)
-	    return opt;
+int
+add_option (dhcp_option_table *table, dhcp_option *opt)
+{
+    if (table->len + 2 + opt->len > UINT16_MAX)
+	return 0;
 
+    if (table->len + 2 + opt->len > table->size) {
+	table->size *= 2;
+	table->base = realloc(table->base, table->size);
     }
-    
-    return NULL;
+
+    memcpy(table->base + table->len, opt, 2 + opt->len);
+
+    table->offset[opt->id] = table->len;
+    table->len += 2 + opt->len;
+
+    return 1;
 }
 
 /*
- * Print options in list.
+ * Print the options of a table.
  */
 
 void
-print_options (dhcp_option_list *list)
+print_options (dhcp_option_table *table)
 {
-    dhcp_option *opt, *opt_temp;
-    int i=0;
+    int id, i=0;
 
-    TAILQ_FOREACH_SAFE(opt, list, pointers, opt_temp) {
+    for (id = 0; id < 256; id++) {
 
-	printf("options[%d]=%d (%s)\n", i++, opt->id,
-	       dhcp_option_info[opt->id].name);
+	if (table->offset[id] != 0)
+	    printf("options[%d]=%d (%s)\n", i++, id,
+		   dhcp_option_info[id].name);
 
     }
 }
 
-
 /*
- * Append the provided option to the list.
- *
- * Always allocate new memory, that must be freed later...
+ * Check the length of a received option against the option table.
  */
 
-void
-append_option (dhcp_option_list *list, dhcp_option *opt)
+static int
+valid_option_len (uint8_t id, uint8_t len)
 {
-    dhcp_option *nopt = calloc(1, sizeof(*nopt));
-    memcpy(nopt, opt, 2 + opt->len);
-    
-    TAILQ_INSERT_TAIL(list, nopt, pointers);
+    uint8_t size = dhcp_option_info[id].size;
+    uint8_t unit = dhcp_option_info[id].unit;
+
+    if (dhcp_option_info[id].empty)
+	return len == 0;
+
+    if (size != 0)
+	return len == size;
+
+    if (unit != 0)
+	return len >= unit && len % unit == 0;
+
+    return 1;
 }
 
 /*
- * Parse the options contained in a DHCP message into a list.
+ * Parse the options contained in a DHCP message into an option table,
+ * in a single pass and without copying them.
+ *
+ * If an option is repeated, the first occurrence is used.
  *
  * Return 1 on success, 0 if the options are malformed.
  */
 
 int
-parse_options_to_list (dhcp_option_list *list, dhcp_option *opts, size_t len)
+parse_options_to_table (dhcp_option_table *table, uint8_t *opts, size_t len)
 {
-    dhcp_option *opt, *end;
+    size_t i;
 
-    opt = opts;
-    end = (dhcp_option *)(((uint8_t *)opts) + len);
+    memset(table->offset, 0, sizeof(table->offset));
+    table->base = opts;
 
     if (len < 4 ||
-	memcmp(opt, option_magic, sizeof(option_magic)) != 0)
+	memcmp(opts, option_magic, sizeof(option_magic)) != 0)
 	return 0;
 
-    opt = (dhcp_option *)(((uint8_t *) opt) + 4);
+    i = 4;
 
-    while (opt < end  &&
-	   opt->id != END) { // TODO: check also valid option sizes
+    while (i < len && opts[i] != END) {
 
-	if ((dhcp_option *)(((uint8_t *) opt) + 2 + opt->len) >= end)
+	if (opts[i] == PAD) {
+	    i++;
+	    continue;
+	}
+
+	if (i + 1 >= len || i + 2 + opts[i + 1] >= len)
 	    return 0; // the len field is too long
 
-	append_option(list, opt);
+	if (!valid_option_len(opts[i], opts[i + 1]))
+	    return 0;
+
+	if (table->offset[opts[i]] == 0)
+	    table->offset[opts[i]] = i;
 
-        opt = (dhcp_option *)(((uint8_t *) opt) + 2 + opt->len);
+	i += 2 + opts[i + 1];
     }
 
-    if (opt < end && opt->id == END)
-        return 1;
+    if (i < len && opts[i] == END)
+	return 1;
 
     return 0;
 }
 
 /*
- * Serialize a list of options, to be inserted directly inside
- * the options section of a DHCP message.
+ * Search an option in a parsed option table.
  *
- * Return 0 on error, the total serialized len on success.
+ * If the option is not present the function returns NULL.
  */
 
-size_t
-serialize_option_list (dhcp_option_list *list, uint8_t *buf, size_t len)
+dhcp_option *
+search_option (dhcp_option_table *table, uint8_t id)
+{
+    if (table->offset[id] == 0)
+	return NULL;
+
+    return (dhcp_option *)(table->base + table->offset[id]);
+}
+
+/*
+ * Decode the sub-options of the relay agent information option
+ * of a parsed option table (the other sub-options are skipped).
+ *
+ * Return 1 if the option is present and well formed, 0 otherwise.
+ */
+
+int
+parse_relay_agent_info (dhcp_option_table *table, relay_agent_info *info)
 {
-    uint8_t *p = buf;
+    dhcp_option *opt = search_option(table, RELAY_AGENT_INFORMATION);
+    size_t i;
+
+    memset(info, 0, sizeof(*info));
 
-    if (len < 4)
+    if (opt == NULL)
 	return 0;
 
-    memcpy(p, option_magic, sizeof(option_magic));
-    p += 4; len -= 4;
+    for (i = 0; i < opt->len; i += 2 + opt->data[i + 1]) {
 
-    dhcp_option *opt, *opt_temp;
-    
-    TAILQ_FOREACH_SAFE(opt, list, pointers, opt_temp) {
+	if (i + 2 > opt->len || i + 2 + opt->data[i + 1] > opt->len)
+	    return 0; // the sub-option len field is too long
 
-	if (len <= 2 + opt->len)
-	    return 0;
+	if (opt->data[i] == AGENT_CIRCUIT_ID) {
+	    info->circuit_id  = &opt->data[i + 2];
+	    info->circuit_len = opt->data[i + 1];
+	} else if (opt->data[i] == AGENT_REMOTE_ID) {
+	    info->remote_id  = &opt->data[i + 2];
+	    info->remote_len = opt->data[i + 1];
+	}
+    }
+
+    return 1;
+}
 
-	memcpy(p, opt, 2 + opt->len);
-	p   += 2 + opt->len;
-	len -= 2 + opt->len;
-	
+/*
+ * Initialize an option buffer to write the options of a message
+ * directly inside its options field, starting with the magic cookie.
+ */
+
+void
+init_option_buffer (dhcp_option_buffer *buffer, uint8_t *buf, size_t size)
+{
+    buffer->buf  = buf;
+    buffer->size = size;
+    buffer->len  = 0;
+
+    if (size >= sizeof(option_magic)) {
+	memcpy(buf, option_magic, sizeof(option_magic));
+	buffer->len = sizeof(option_magic);
     }
+}
 
-    if (len < 1)
-	return 0;
+/*
+ * Write an option (already encoded) into an option buffer,
+ * always leaving room for the END option.
+ *
+ * Return 1 on success, 0 if the option does not fit.
+ */
 
-    *p = END;
+int
+write_option (dhcp_option_buffer *buffer, dhcp_option *opt)
+{
+    if (buffer->len + 2 + opt->len + 1 > buffer->size)
+	return 0;
 
-    p++; len--;
+    memcpy(buffer->buf + buffer->len, opt, 2 + opt->len);
+    buffer->len += 2 + opt->len;
 
-    return p - buf;
+    return 1;
 }
 
 /*
- * Delete an option list and deallocate its memory.
- * Deallocate even the list elements.
+ * Write into an option buffer the options of the tables (already
+ * encoded) listed in a parameter request list, in the order of
+ * the list. The tables are a NULL terminated list: an option is
+ * taken from the first table that has it.
  */
 
 void
-delete_option_list (dhcp_option_list *list)
+fill_requested_dhcp_options (dhcp_option_table **tables,
+			     dhcp_option *requested_opts, dhcp_option_buffer *reply_opts)
 {
-    dhcp_option *opt = TAILQ_FIRST(list);
-    dhcp_option *tmp;
-    
-    while (opt != NULL) {
-	tmp = TAILQ_NEXT(opt, pointers);
-	free(opt);
-	opt = tmp;
-     }
-    
-    TAILQ_INIT(list);
+    uint8_t len = requested_opts->len;
+    uint8_t *id = requested_opts->data;
+
+    int i, t;
+    for (i = 0; i < len; i++) {
+
+	if(id[i] != 0) {
+	    dhcp_option *opt = NULL;
+
+	    for (t = 0; opt == NULL && tables[t] != NULL; t++)
+		opt = search_option(tables[t], id[i]);
+
+	    if(opt != NULL)
+		write_option(reply_opts, opt);
+	}
+
+    }
+}
+
+/*
+ * Terminate the options of an option buffer.
+ *
+ * Return 0 on error, the total serialized len on success.
+ */
+
+size_t
+finish_option_buffer (dhcp_option_buffer *buffer)
+{
+    if (buffer->len < sizeof(option_magic) ||
+	buffer->len + 1 > buffer->size)
+	return 0;
+
+    buffer->buf[buffer->len++] = END;
+
+    return buffer->len;
 }
@@ -4,8 +4,6 @@
 #include <stdint.h>
 #include <time.h>
 
-#include "queue.h"
-
 /*
  * Code ID of DHCP and BOOTP options 
  * as defined in RFC 2132
@@ -88,7 +86,7 @@ enum {
     NETWORK_TIME_PROTOCOL_SERVERS = 42,
     VENDOR_SPECIFIC_INFORMATION = 43,
     NETBIOS_OVER_TCP_IP_NAME_SERVER = 44,
-    NETBIOS_OVER_TCP_IP_DATAGRAM_DISTRIBUTION_SERVER = 4,
+    NETBIOS_OVER_TCP_IP_DATAGRAM_DISTRIBUTION_SERVER = 45,
     NETBIOS_OVER_TCP_IP_NODE_TYPE = 46,
     NETBIOS_OVER_TCP_IP_SCOPE = 47,
     X_WINDOW_SYSTEM_FONT_SERVER = 48,
@@ -120,22 +118,86 @@ enum {
     RENEWAL_T1_TIME_VALUE = 58,
     REBINDING_T2_TIME_VALUE = 59,
     VENDOR_CLASS_IDENTIFIER = 60,
-    CLIENT_IDENTIFIER = 61
+    CLIENT_IDENTIFIER = 61,
+
+/* User Class (RFC 3004) */
+
+    USER_CLASS = 77,
+
+/* Rapid Commit (RFC 4039) */
+
+    RAPID_COMMIT = 80,
+
+/* Relay Agent Information (RFC 3046) */
+
+    RELAY_AGENT_INFORMATION = 82
 
 };
 
+// sub-options of the relay agent information option
+enum {
+    AGENT_CIRCUIT_ID = 1,
+    AGENT_REMOTE_ID  = 2
+};
+
 struct dhcp_option {
     uint8_t id;        // option id
     uint8_t len;       // option length
     uint8_t data[256]; // option data
-
-    TAILQ_ENTRY(dhcp_option) pointers; // pointers, see queue(3)
 };
 
 typedef struct dhcp_option dhcp_option;
 
-typedef TAILQ_HEAD(dhcp_option_list_, dhcp_option) DHCP_OPTION_LIST;
-typedef struct dhcp_option_list_ dhcp_option_list;
+/*
+ * Options of a received message, parsed in place: for every option id
+ * the offset of the option inside the options field (zero if the option
+ * is not present), so no memory is allocated and an option is found
+ * with a single array access.
+ *
+ * The same table is used to store the configured options, already
+ * encoded, so that they are copied as they are into the replies.
+ */
+
+struct dhcp_option_table {
+    uint8_t *base;        // options field of the message, or stored options
+    uint16_t offset[256]; // offset of every option from base
+
+    size_t len;  // bytes used in base (stored options)
+    size_t size; // bytes allocated for base (stored options)
+};
+
+typedef struct dhcp_option_table dhcp_option_table;
+
+/*
+ * Options of a message being built, written directly
+ * into the options field of the message.
+ */
+
+struct dhcp_option_buffer {
+    uint8_t *buf; // options field of the message
+    size_t size;  // size of the options field
+    size_t len;   // bytes written
+};
+
+typedef struct dhcp_option_buffer dhcp_option_buffer;
+
+/*
+ * Sub-options of the relay agent information option of a
+ * received message, pointing into the message.
+ */
+
+struct relay_agent_info {
+    uint8_t *circuit_id; // agent circuit id, NULL if not present
+    uint8_t *remote_id;  // agent remote id, NULL if not present
+    uint8_t circuit_len;
+    uint8_t remote_len;
+};
+
+typedef struct relay_agent_info relay_agent_info;
+
+/* Magic cookie, at the start of the options field */
+
+extern const uint8_t option_magic[4];
 
 /* Value parsing functions:
  *
@@ -158,13 +220,21 @@ int parse_mac (char *s, void **p);
 
 /* Other prototypes */
 
-void init_option_list (dhcp_option_list *list);
 uint8_t parse_option (dhcp_option *option, char *name, char *value);
-dhcp_option * search_option (dhcp_option_list *list, uint8_t id);
-void print_options (dhcp_option_list *list);
-void append_option (dhcp_option_list *list, dhcp_option *opt);
-int parse_options_to_list (dhcp_option_list *list, dhcp_option *opts, size_t len);
-size_t serialize_option_list (dhcp_option_list *list, uint8_t *buf, size_t len);
-void delete_option_list (dhcp_option_list *list);
+
+void init_option_table (dhcp_option_table *table);
+void copy_option_table (dhcp_option_table *table, dhcp_option_table *from);
+void delete_option_table (dhcp_option_table *table);
+int add_option (dhcp_option_table *table, dhcp_option *opt);
+void print_options (dhcp_option_table *table);
+int parse_options_to_table (dhcp_option_table *table, uint8_t *opts, size_t len);
+dhcp_option * search_option (dhcp_option_table *table, uint8_t id);
+int parse_relay_agent_info (dhcp_option_table *table, relay_agent_info *info);
+
+void init_option_buffer (dhcp_option_buffer *buffer, uint8_t *buf, size_t size);
+int write_option (dhcp_option_buffer *buffer, dhcp_option *opt);
+void fill_requested_dhcp_options (dhcp_option_table **tables,
+				  dhcp_option *requested_opts, dhcp_option_buffer *reply_opts);
+size_t finish_option_buffer (dhcp_option_buffer *buffer);
 
 #endif
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+
+#include "packet.h"
+#include "logging.h"
+
+#define FRAME_HEADERS (sizeof(struct ether_header) + sizeof(struct iphdr) + sizeof(struct udphdr))
+
+// offset of the frame data in a slot of the transmit ring
+#define RING_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
+static uint16_t
+ip_checksum (void *data, size_t len)
+{
+    uint16_t *p = data;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+	sum += *p++;
+
+    if (len)
+	sum += *(uint8_t *) p;
+
+    while (sum >> 16)
+	sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+/*
+ * Get the hardware address of a device.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+device_mac (char *device, uint8_t *mac)
+{
+    struct ifreq ifr;
+    int s, ret;
+
+    if ((s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+	return -1;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, device, sizeof(ifr.ifr_name) - 1);
+
+    if ((ret = ioctl(s, SIOCGIFHWADDR, &ifr)) != -1)
+	memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+
+    close(s);
+
+    return ret == -1 ? -1 : 0;
+}
+
+/*
+ * Set up the transmit ring of a socket (TPACKET_V2), mapped
+ * in memory. Return 0 on success, -1 on error.
+ */
+
+static int
+init_ring (packet_socket *ps)
+{
+    struct tpacket_req req;
+    int version = TPACKET_V2;
+
+    if (setsockopt(ps->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+	return -1;
+
+    req.tp_block_size = 4096;
+    req.tp_frame_size = PACKET_FRAME_SIZE;
+    req.tp_block_nr   = PACKET_RING_FRAMES * PACKET_FRAME_SIZE / req.tp_block_size;
+    req.tp_frame_nr   = PACKET_RING_FRAMES;
+
+    if (setsockopt(ps->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1)
+	return -1;
+
+    ps->ring = mmap(NULL, PACKET_RING_FRAMES * PACKET_FRAME_SIZE,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, ps->fd, 0);
+
+    if (ps->ring == MAP_FAILED) {
+	ps->ring = NULL;
+	return -1;
+    }
+
+    ps->size = PACKET_RING_FRAMES;
+
+    return 0;
+}
+
+/*
+ * Open a packet socket on a device, to send replies from the given
+ * address; size is the max number of frames queued before a flush
+ * (without the ring).
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+init_packet_socket (packet_socket *ps, char *device, uint32_t address,
+		    int mode, unsigned int size)
+{
+    struct sockaddr_ll sll;
+    unsigned int i;
+
+    memset(ps, 0, sizeof(*ps));
+    ps->address = address;
+
+    if ((ps->ifindex = if_nametoindex(device)) == 0)
+	return -1;
+
+    // protocol zero: the socket is used only to transmit
+    if ((ps->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0)) == -1)
+	return -1;
+
+    if (device_mac(device, ps->mac) == -1)
+	goto error;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family  = AF_PACKET;
+    sll.sll_ifindex = ps->ifindex;
+
+    if (bind(ps->fd, (struct sockaddr *) &sll, sizeof(sll)) == -1)
+	goto error;
+
+    if (mode == TX_RING) {
+	if (init_ring(ps) == -1)
+	    goto error;
+
+	return 0;
+    }
+
+    ps->size   = size;
+    ps->frames = calloc(size, PACKET_FRAME_SIZE);
+    ps->iov    = calloc(size, sizeof(struct iovec));
+    ps->msgs   = calloc(size, sizeof(struct mmsghdr));
+
+    if (!ps->frames || !ps->iov || !ps->msgs)
+	goto error;
+
+    for (i = 0; i < size; i++) {
+	ps->iov[i].iov_base = ps->frames + i * PACKET_FRAME_SIZE;
+	ps->msgs[i].msg_hdr.msg_iov    = &ps->iov[i];
+	ps->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+
+ error:
+    close(ps->fd);
+    ps->fd = -1;
+    return -1;
+}
+
+/*
+ * Build a frame from this server (with the given source hardware
+ * address and address) to a client: the payload is sent from port 67
+ * to port 68 of the given address, and to the given hardware address.
+ *
+ * Return the len of the frame.
+ */
+
+size_t
+build_frame (uint8_t *frame, uint8_t *src_mac, uint32_t src_address,
+	     uint8_t *mac, uint32_t address, void *payload, size_t len)
+{
+    struct ether_header *eth = (struct ether_header *) frame;
+    struct iphdr *ip = (struct iphdr *) (eth + 1);
+    struct udphdr *udp = (struct udphdr *) (ip + 1);
+
+    memcpy(eth->ether_dhost, mac, 6);
+    memcpy(eth->ether_shost, src_mac, 6);
+    eth->ether_type = htons(ETHERTYPE_IP);
+
+    memset(ip, 0, sizeof(*ip));
+    ip->version  = 4;
+    ip->ihl      = sizeof(*ip) / 4;
+    ip->tot_len  = htons(sizeof(*ip) + sizeof(*udp) + len);
+    ip->ttl      = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr    = src_address;
+    ip->daddr    = address;
+    ip->check    = ip_checksum(ip, sizeof(*ip));
+
+    udp->source = htons(67);
+    udp->dest   = htons(68);
+    udp->len    = htons(sizeof(*udp) + len);
+    udp->check  = 0; // optional for IPv4
+
+    memcpy(udp + 1, payload, len);
+
+    return FRAME_HEADERS + len;
+}
+
+/*
+ * Parse a frame received from a client: it must be an IPv4 UDP
+ * datagram to port 67. The source of the datagram is returned
+ * in source.
+ *
+ * Return a pointer to the payload (inside the frame) and its len
+ * in payload_len, NULL if the frame is not a valid datagram.
+ */
+
+uint8_t *
+parse_frame (uint8_t *frame, size_t len, struct sockaddr_in *source, size_t *payload_len)
+{
+    struct ether_header *eth = (struct ether_header *) frame;
+    struct iphdr *ip = (struct iphdr *) (eth + 1);
+    struct udphdr *udp;
+    size_t ip_len, udp_len;
+
+    if (len < FRAME_HEADERS || eth->ether_type != htons(ETHERTYPE_IP))
+	return NULL;
+
+    if (ip->version != 4 || ip->ihl < 5 || ip->protocol != IPPROTO_UDP ||
+	(ip->frag_off & htons(IP_MF | IP_OFFMASK)))
+	return NULL;
+
+    ip_len = ntohs(ip->tot_len);
+
+    if (sizeof(*eth) + ip->ihl * 4 + sizeof(*udp) > len ||
+	sizeof(*eth) + ip_len > len || ip_len < ip->ihl * 4 + sizeof(*udp))
+	return NULL;
+
+    udp = (struct udphdr *) ((uint8_t *) ip + ip->ihl * 4);
+    udp_len = ntohs(udp->len);
+
+    if (udp->dest != htons(67) || udp_len < sizeof(*udp) ||
+	udp_len > ip_len - ip->ihl * 4)
+	return NULL;
+
+    source->sin_family = AF_INET;
+    source->sin_addr.s_addr = ip->saddr;
+    source->sin_port = udp->source;
+
+    *payload_len = udp_len - sizeof(*udp);
+
+    return (uint8_t *) (udp + 1);
+}
+
+/*
+ * Queue a frame, built in place in the transmit ring (if used).
+ *
+ * Return 0 on success, -1 if the frame can not be queued.
+ */
+
+int
+queue_packet (packet_socket *ps, uint8_t *mac, uint32_t address,
+	      void *payload, size_t len)
+{
+    if (ps->fd == -1 || FRAME_HEADERS + len > PACKET_FRAME_SIZE - RING_DATA_OFFSET)
+	return -1;
+
+    if (ps->ring) {
+	struct tpacket2_hdr *hdr =
+	    (struct tpacket2_hdr *) (ps->ring + ps->head * PACKET_FRAME_SIZE);
+
+	if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+	    flush_packets(ps); // the kernel is late: wait for the ring
+
+	    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+		return -1;
+	}
+
+	hdr->tp_len = build_frame((uint8_t *) hdr + RING_DATA_OFFSET, ps->mac, ps->address,
+				  mac, address, payload, len);
+
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+	ps->head = (ps->head + 1) % PACKET_RING_FRAMES;
+	ps->count++;
+
+	return 0;
+    }
+
+    if (ps->count == ps->size)
+	flush_packets(ps);
+
+    ps->iov[ps->count].iov_len =
+	build_frame(ps->iov[ps->count].iov_base, ps->mac, ps->address,
+		    mac, address, payload, len);
+    ps->count++;
+
+    return 0;
+}
+
+/*
+ * Send the queued frames.
+ */
+
+void
+flush_packets (packet_socket *ps)
+{
+    unsigned int sent = 0;
+    int ret;
+
+    if (ps->fd == -1 || ps->count == 0)
+	return;
+
+    if (ps->ring) {
+	// the kernel sends every frame marked for sending
+	if (send(ps->fd, NULL, 0, 0) == -1)
+	    log_event(EV_SEND_ERROR, NULL, 0, errno);
+
+	ps->count = 0;
+	return;
+    }
+
+    while (sent < ps->count) {
+
+	if ((ret = sendmmsg(ps->fd, ps->msgs + sent, ps->count - sent, 0)) == -1) {
+	    if (errno == EINTR)
+		continue;
+
+	    log_event(EV_SEND_ERROR, NULL, 0, errno);
+	    sent++;
+	    continue;
+	}
+
+	sent += ret;
+    }
+
+    ps->count = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+/*
+ * Raw transmission of the replies with an AF_PACKET socket: the
+ * Ethernet, IP and UDP headers are built in user space, so a reply
+ * can be sent to a client that has not configured its address yet
+ * without a neighbor entry.
+ *
+ * The frames are queued and sent together when the socket is
+ * flushed: with sendmmsg(2), or through a PACKET_TX_RING shared
+ * with the kernel, where the frames are built in place and sent
+ * with a single send(2).
+ */
+
+// transmit modes
+enum {
+    TX_UDP = 0, // UDP socket, with neighbor entries
+    TX_PACKET,  // AF_PACKET socket
+    TX_RING     // AF_PACKET socket with a transmit ring
+};
+
+enum {
+    PACKET_FRAME_SIZE = 1024, // room for a frame (a DHCP message is at most 590 bytes)
+    PACKET_RING_FRAMES = 256  // frames of the transmit ring
+};
+
+struct packet_socket {
+    int fd;           // AF_PACKET socket, -1 if not used
+    int ifindex;      // device of the socket
+    uint8_t mac[6];   // source hardware address
+    uint32_t address; // source address
+
+    unsigned int size;  // max number of queued frames
+    unsigned int count; // number of queued frames
+
+    uint8_t *frames;       // queued frames (without the ring)
+    struct iovec *iov;
+    struct mmsghdr *msgs;
+
+    uint8_t *ring;         // transmit ring, NULL if not used
+    unsigned int head;     // next frame of the ring
+};
+
+typedef struct packet_socket packet_socket;
+
+/*
+ * Prototypes
+ */
+
+int device_mac (char *device, uint8_t *mac);
+
+size_t build_frame (uint8_t *frame, uint8_t *src_mac, uint32_t src_address,
+		    uint8_t *mac, uint32_t address, void *payload, size_t len);
+uint8_t *parse_frame (uint8_t *frame, size_t len, struct sockaddr_in *source,
+		      size_t *payload_len);
+
+int init_packet_socket (packet_socket *ps, char *device, uint32_t address,
+			int mode, unsigned int size);
+
+int queue_packet (packet_socket *ps, uint8_t *mac, uint32_t address,
+		  void *payload, size_t len);
+void flush_packets (packet_socket *ps);
+
+#endif
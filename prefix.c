@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "prefix.h"
+
+#define PREFIX_LEN(e) (((e) >> 24) & 0x3f)
+
+/*
+ * Initialize an empty prefix table.
+ */
+
+void
+init_prefix_table (prefix_table *table)
+{
+    memset(table, 0, sizeof(*table));
+
+    table->root = calloc(1 << PREFIX_ROOT_BITS, sizeof(uint32_t));
+}
+
+void
+delete_prefix_table (prefix_table *table)
+{
+    free(table->root);
+    free(table->blocks);
+
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Allocate a block, with all its entries set to the entry
+ * it replaces.
+ *
+ * Return the index of the block, -1 on error.
+ */
+
+static long
+new_block (prefix_table *table, uint32_t fill)
+{
+    uint32_t i;
+
+    if (table->nblocks == table->size) {
+	uint32_t size = table->size ? table->size * 2 : 16;
+	uint32_t *blocks = realloc(table->blocks, (size_t) size * PREFIX_BLOCK * sizeof(uint32_t));
+
+	if (blocks == NULL)
+	    return -1;
+
+	table->blocks = blocks;
+	table->size   = size;
+    }
+
+    for (i = 0; i < PREFIX_BLOCK; i++)
+	table->blocks[table->nblocks * PREFIX_BLOCK + i] = fill;
+
+    return table->nblocks++;
+}
+
+/*
+ * Return the block below the entry n of the given level (the root,
+ * or the block of index level - 1), allocating it if the entry is
+ * not a block yet.
+ *
+ * Return the index of the block, -1 on error.
+ */
+
+static long
+child_block (prefix_table *table, long level, uint32_t n)
+{
+    uint32_t e = level == 0 ? table->root[n] : table->blocks[(level - 1) * PREFIX_BLOCK + n];
+    long block;
+
+    if (e & PREFIX_CHILD)
+	return e & ~PREFIX_CHILD;
+
+    if ((block = new_block(table, e)) == -1)
+	return -1;
+
+    if (level == 0)
+	table->root[n] = PREFIX_CHILD | block;
+    else
+	table->blocks[(level - 1) * PREFIX_BLOCK + n] = PREFIX_CHILD | block;
+
+    return block;
+}
+
+/*
+ * Set an entry (and every entry of the blocks below it) to a prefix,
+ * unless it holds a longer prefix.
+ */
+
+static void
+fill_entry (prefix_table *table, uint32_t *e, uint32_t leaf)
+{
+    uint32_t i;
+
+    if (*e & PREFIX_CHILD) {
+	uint32_t *block = &table->blocks[(*e & ~PREFIX_CHILD) * PREFIX_BLOCK];
+
+	for (i = 0; i < PREFIX_BLOCK; i++)
+	    fill_entry(table, &block[i], leaf);
+
+    } else if (*e == 0 || PREFIX_LEN(*e) <= PREFIX_LEN(leaf)) {
+	*e = leaf;
+    }
+}
+
+/*
+ * Add a prefix to the table, with the given value (lower than
+ * PREFIX_VALUE). The prefixes can be added in any order; a prefix
+ * already in the table gets the new value.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+add_prefix (prefix_table *table, uint32_t network, uint8_t len, uint32_t value)
+{
+    uint32_t a = len == 0 ? 0 : ntohl(network) & (~0U << (32 - len));
+    uint32_t leaf = ((uint32_t) len << 24) | (value + 1);
+    uint32_t *entries, first, count, i;
+    long block;
+
+    if (len > 32 || value >= PREFIX_VALUE)
+	return -1;
+
+    if (len <= PREFIX_ROOT_BITS) {
+	entries = table->root;
+	first = a >> PREFIX_ROOT_BITS;
+	count = 1U << (PREFIX_ROOT_BITS - len);
+
+    } else {
+	if ((block = child_block(table, 0, a >> PREFIX_ROOT_BITS)) == -1)
+	    return -1;
+
+	if (len > PREFIX_ROOT_BITS + PREFIX_BLOCK_BITS &&
+	    (block = child_block(table, block + 1, (a >> 8) & 0xff)) == -1)
+	    return -1;
+
+	entries = &table->blocks[block * PREFIX_BLOCK];
+
+	if (len <= PREFIX_ROOT_BITS + PREFIX_BLOCK_BITS) {
+	    first = (a >> 8) & 0xff;
+	    count = 1U << (PREFIX_ROOT_BITS + PREFIX_BLOCK_BITS - len);
+	} else {
+	    first = a & 0xff;
+	    count = 1U << (32 - len);
+	}
+    }
+
+    for (i = first; i < first + count; i++)
+	fill_entry(table, &entries[i], leaf);
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef PREFIX_H
+#define PREFIX_H
+
+#include <stdint.h>
+
+#include <arpa/inet.h>
+
+/*
+ * Longest prefix match table of IPv4 prefixes, used to find the
+ * subnet of a request.
+ *
+ * The table is a multibit trie with strides of 16, 8 and 8 bits:
+ * the prefixes are expanded to the entries of the level where they
+ * end, so a lookup reads at most three entries whatever the number
+ * of prefixes. An entry holds the value and the length of the
+ * longest prefix covering it, or the block of the next level.
+ */
+
+enum {
+    PREFIX_ROOT_BITS  = 16,
+    PREFIX_BLOCK_BITS = 8,
+    PREFIX_BLOCK      = 1 << PREFIX_BLOCK_BITS, // entries of a block
+
+    PREFIX_CHILD = 1U << 31, // the entry is the index of a block
+    PREFIX_VALUE = (1U << 24) - 1
+};
+
+struct prefix_table {
+    uint32_t *root;   // entries of the first level
+    uint32_t *blocks; // blocks of the other levels
+    uint32_t nblocks; // number of blocks used
+    uint32_t size;    // number of blocks allocated
+};
+
+typedef struct prefix_table prefix_table;
+
+/*
+ * Value of the longest prefix that matches an address
+ * (in network order), -1 if there is none.
+ */
+
+static inline long
+lookup_prefix (prefix_table *table, uint32_t address)
+{
+    uint32_t a = ntohl(address);
+    uint32_t e = table->root[a >> PREFIX_ROOT_BITS];
+
+    if (e & PREFIX_CHILD) {
+	e = table->blocks[(e & ~PREFIX_CHILD) * PREFIX_BLOCK + ((a >> 8) & 0xff)];
+
+	if (e & PREFIX_CHILD)
+	    e = table->blocks[(e & ~PREFIX_CHILD) * PREFIX_BLOCK + (a & 0xff)];
+    }
+
+    return e == 0 ? -1 : (long) (e & PREFIX_VALUE) - 1;
+}
+
+/*
+ * Prototypes
+ */
+
+void init_prefix_table (prefix_table *table);
+void delete_prefix_table (prefix_table *table);
+int add_prefix (prefix_table *table, uint32_t network, uint8_t len, uint32_t value);
+
+#endif
@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "snapshot.h"
+#include "bindings.h"
+#include "logging.h"
+
+#define CHECK_SEED  0xcbf29ce484222325ULL
+#define CHECK_PRIME 0x100000001b3ULL
+
+/*
+ * Checksum of a buffer, eight bytes at a time (FNV-like, with
+ * a shift to mix the high bits back).
+ */
+
+static uint64_t
+checksum (uint64_t check, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t w;
+
+    for (; len >= 8; len -= 8, p += 8) {
+	memcpy(&w, p, sizeof(w));
+	check = (check ^ w) * CHECK_PRIME;
+	check ^= check >> 32;
+    }
+
+    for (; len > 0; len--, p++)
+	check = (check ^ *p) * CHECK_PRIME;
+
+    return check;
+}
+
+/*
+ * Hash of the configuration of the pool the bindings depend on.
+ */
+
+static uint64_t
+pool_config (address_pool *pool)
+{
+    server_config *config = pool->config;
+    uint64_t check = CHECK_SEED;
+    unsigned int i;
+
+    check = checksum(check, &pool->nshards, sizeof(pool->nshards));
+
+    for (i = 0; i < config->nsubnets; i++) {
+	subnet_pool *subnet = &config->subnets[i];
+
+	check = checksum(check, &subnet->network, sizeof(subnet->network));
+	check = checksum(check, &subnet->prefix, sizeof(subnet->prefix));
+	check = checksum(check, &subnet->indexes.first, sizeof(subnet->indexes.first));
+	check = checksum(check, &subnet->indexes.last, sizeof(subnet->indexes.last));
+    }
+
+    for (i = 0; i < config->hosts.count; i++) {
+	check = checksum(check, config->hosts.hosts[i].mac, sizeof(config->hosts.hosts[i].mac));
+	check = checksum(check, &config->hosts.hosts[i].address, sizeof(uint32_t));
+    }
+
+    for (i = 0; i < config->circuits.count; i++) {
+	if (config->circuits.circuits[i].address != 0)
+	    check = checksum(check, &config->circuits.circuits[i].address, sizeof(uint32_t));
+    }
+
+    return check;
+}
+
+static uint64_t
+header_check (snapshot_header *hdr, snapshot_list *table)
+{
+    snapshot_header copy = *hdr;
+
+    copy.check = 0;
+
+    return checksum(checksum(CHECK_SEED, &copy, sizeof(copy)),
+		    table, hdr->nlists * sizeof(snapshot_list));
+}
+
+/*
+ * Output of the images: the parts are buffered, and the checksum
+ * is computed as they are written, the bytes of a word split among
+ * parts being kept until the word is complete.
+ */
+
+struct snapshot_writer {
+    int fd;
+    uint8_t *buf;     // allocated before the fork
+    size_t len;       // bytes in the buffer
+    uint64_t check;   // checksum of the whole words of the image
+    uint8_t word[8];  // bytes of the last partial word
+    size_t nword;
+};
+
+typedef struct snapshot_writer snapshot_writer;
+
+static int
+write_all (int fd, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+	ssize_t n = write(fd, data, len);
+
+	if (n == -1 && errno == EINTR)
+	    continue;
+
+	if (n == -1)
+	    return -1;
+
+	data += n;
+	len  -= n;
+    }
+
+    return 0;
+}
+
+static int
+flush_writer (snapshot_writer *w)
+{
+    if (write_all(w->fd, w->buf, w->len) == -1)
+	return -1;
+
+    w->len = 0;
+
+    return 0;
+}
+
+static int
+write_part (void *arg, const void *data, size_t len)
+{
+    snapshot_writer *w = arg;
+    const uint8_t *p = data;
+    size_t n, whole;
+
+    if (len == 0)
+	return 0;
+
+    // the checksum, eight bytes at a time as in checksum()
+
+    for (n = 0; w->nword > 0 && n < len; n++) {
+	w->word[w->nword++] = p[n];
+
+	if (w->nword == sizeof(w->word)) {
+	    w->check = checksum(w->check, w->word, sizeof(w->word));
+	    w->nword = 0;
+	}
+    }
+
+    whole = (len - n) & ~(size_t) 7;
+    w->check = checksum(w->check, p + n, whole);
+    w->nword = len - n - whole;
+    memcpy(w->word, p + n + whole, w->nword);
+
+    // the parts larger than the buffer are written as they are
+
+    if (w->len + len > SNAPSHOT_BUFFER && flush_writer(w) == -1)
+	return -1;
+
+    if (len >= SNAPSHOT_BUFFER)
+	return write_all(w->fd, p, len);
+
+    memcpy(w->buf + w->len, p, len);
+    w->len += len;
+
+    return 0;
+}
+
+/*
+ * Write the snapshot of the bindings of the pool to a file: run
+ * in the process forked by write_snapshot, with a copy of the pool
+ * as it was (no lock is needed, and nothing else runs). The lists
+ * are written from the memory of the pool, shared with the parent
+ * until it changes it, and only async-signal-safe functions are
+ * called: the table of the lists and the buffer are allocated by
+ * the parent.
+ *
+ * Return 0 on success, -1 on error (with errno set).
+ */
+
+static int
+write_lists (char *tmp, address_pool *pool, uint64_t segment,
+	     snapshot_list *table, uint8_t *buf)
+{
+    server_config *config = pool->config;
+    snapshot_writer w;
+    snapshot_header hdr;
+    unsigned int i, nlists;
+    size_t off;
+
+    memset(&w, 0, sizeof(w));
+    w.buf = buf;
+
+    if ((w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+	return -1;
+
+    nlists = pool->nshards * config->nsubnets;
+    off = sizeof(hdr) + nlists * sizeof(snapshot_list);
+
+    if (lseek(w.fd, off, SEEK_SET) == -1)
+	return -1;
+
+    for (i = 0; i < nlists; i++) {
+	binding_list *list = &pool->shards[i / config->nsubnets].bindings[i % config->nsubnets];
+	size_t size;
+
+	w.check = CHECK_SEED;
+	w.nword = 0;
+
+	if (save_binding_list(list, write_part, &w, &size) == -1)
+	    return -1;
+
+	table[i].offset = off;
+	table[i].size   = size;
+	table[i].check  = checksum(w.check, w.word, w.nword);
+
+	off += size;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic   = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.size    = off;
+    hdr.config  = pool_config(pool);
+    hdr.segment = segment;
+    hdr.nlists  = nlists;
+    hdr.check   = header_check(&hdr, table);
+
+    if (flush_writer(&w) == -1 ||
+	pwrite(w.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	pwrite(w.fd, table, nlists * sizeof(snapshot_list), sizeof(hdr)) !=
+	(ssize_t) (nlists * sizeof(snapshot_list)) ||
+	fdatasync(w.fd) == -1)
+	return -1;
+
+    return close(w.fd);
+}
+
+/*
+ * Save the bindings of the pool to a snapshot, with the changes of
+ * the journal segments before the given one.
+ *
+ * The snapshot is written by a child process, forked holding the
+ * configuration lock and the locks of all the shards: the child
+ * sees the bindings as they were at that instant, the kernel copying
+ * the pages the workers change meanwhile (copy-on-write), so the
+ * workers are stopped only for the fork, not for the write of the
+ * file.
+ *
+ * Return the bytes written, -1 on error.
+ */
+
+ssize_t
+write_snapshot (char *path, address_pool *pool, uint64_t segment)
+{
+    char tmp[4096];
+    snapshot_list *table;
+    uint8_t *buf;
+    struct stat st;
+    unsigned int i;
+    pid_t pid;
+    int status, dirfd;
+    char *dir;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    pthread_mutex_lock(&pool->config_lock);
+
+    table = calloc(pool->nshards * pool->config->nsubnets, sizeof(snapshot_list));
+    buf = malloc(SNAPSHOT_BUFFER);
+
+    for (i = 0; i < pool->nshards; i++)
+	pthread_mutex_lock(&pool->shards[i].lock);
+
+    pid = table != NULL && buf != NULL ? fork() : -1;
+
+    if (pid == 0) // the child, with the only thread that forked
+	_exit(write_lists(tmp, pool, segment, table, buf) == 0 ? 0 :
+	      errno > 0 && errno < 256 ? errno : EIO);
+
+    for (i = 0; i < pool->nshards; i++)
+	pthread_mutex_unlock(&pool->shards[i].lock);
+
+    pthread_mutex_unlock(&pool->config_lock);
+
+    free(table);
+    free(buf);
+
+    if (pid == -1) {
+	log_error("Snapshot: can not fork to write %s: %s", tmp, strerror(errno));
+	return -1;
+    }
+
+    while (waitpid(pid, &status, 0) == -1) {
+	if (errno != EINTR) {
+	    log_error("Snapshot: can not wait for %s: %s", tmp, strerror(errno));
+	    return -1;
+	}
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	log_error("Snapshot: can not write %s: %s", tmp,
+		  WIFEXITED(status) ? strerror(WEXITSTATUS(status)) : "killed");
+	unlink(tmp);
+	return -1;
+    }
+
+    if (stat(tmp, &st) == -1 || rename(tmp, path) == -1) {
+	log_error("Snapshot: can not rename %s: %s", tmp, strerror(errno));
+	unlink(tmp);
+	return -1;
+    }
+
+    // the new name must be durable before the journal segments are removed
+
+    dir = strdup(path);
+
+    if ((dirfd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+	fsync(dirfd);
+	close(dirfd);
+    }
+
+    free(dir);
+
+    return st.st_size;
+}
+
+/*
+ * Loading of a binding list: the lists are shared among a few
+ * threads, every thread loading every n-th list.
+ */
+
+struct list_loader {
+    uint8_t *image;
+    size_t size;
+    uint64_t check;
+    binding_list *list;
+    int ret;
+};
+
+typedef struct list_loader list_loader;
+
+struct loader_thread {
+    list_loader *loaders;
+    unsigned int first, step, count;
+    void (*fn) (list_loader *);
+    int started; // run by its own thread
+    pthread_t thread;
+};
+
+typedef struct loader_thread loader_thread;
+
+static void
+verify_list (list_loader *loader)
+{
+    loader->ret = checksum(CHECK_SEED, loader->image, loader->size) == loader->check ? 0 : -1;
+}
+
+static void
+load_list (list_loader *loader)
+{
+    loader->ret = load_binding_list(loader->list, loader->image, loader->size);
+}
+
+static void *
+run_loader_thread (void *arg)
+{
+    loader_thread *t = arg;
+    unsigned int i;
+
+    for (i = t->first; i < t->count; i += t->step)
+	t->fn(&t->loaders[i]);
+
+    return NULL;
+}
+
+/*
+ * Run a function for every binding list, in parallel
+ * on up to nthreads threads.
+ *
+ * Return 0 if the function succeeded for every list, -1 otherwise.
+ */
+
+static int
+run_loaders (list_loader *loaders, unsigned int n, unsigned int nthreads,
+	     void (*fn) (list_loader *))
+{
+    loader_thread *threads;
+    unsigned int i;
+    int ret = 0;
+
+    if (nthreads > n)
+	nthreads = n;
+
+    threads = calloc(nthreads, sizeof(loader_thread));
+
+    for (i = 0; i < nthreads; i++) {
+	threads[i].loaders = loaders;
+	threads[i].first   = i;
+	threads[i].step    = nthreads;
+	threads[i].count   = n;
+	threads[i].fn      = fn;
+	threads[i].started = pthread_create(&threads[i].thread, NULL,
+					    run_loader_thread, &threads[i]) == 0;
+
+	if (!threads[i].started)
+	    run_loader_thread(&threads[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+	if (threads[i].started)
+	    pthread_join(threads[i].thread, NULL);
+    }
+
+    for (i = 0; i < n; i++) {
+	if (loaders[i].ret == -1)
+	    ret = -1;
+    }
+
+    free(threads);
+
+    return ret;
+}
+
+/*
+ * Restore the leases of a binding list image one by one (the pool
+ * configuration has changed).
+ */
+
+static void
+restore_list (list_loader *loader, journal_restore restore, void *arg)
+{
+    binding_list list;
+    binding_handle handle;
+
+    init_binding_list(&list);
+
+    if (load_binding_list(&list, loader->image, loader->size) == -1) {
+	delete_binding_list(&list);
+	return;
+    }
+
+    for (handle = 1; handle < list.count; handle++) {
+	address_binding *binding = get_binding(&list, handle);
+	journal_record rec;
+
+	if (binding->handle == NO_BINDING || binding->is_static ||
+	    binding->status != ASSOCIATED || binding->cident_len > sizeof(rec.cident))
+	    continue;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.address      = binding->address;
+	rec.binding_time = binding->binding_time;
+	rec.lease_time   = binding->lease_time;
+	rec.status       = binding->status;
+	rec.cident_len   = binding->cident_len;
+	memcpy(rec.cident, binding_cident(&list, binding), binding->cident_len);
+
+	restore(&rec, arg);
+    }
+
+    delete_binding_list(&list); // the records stay in the image
+}
+
+/*
+ * Load the bindings of the pool from a snapshot, mapped in memory
+ * (the mapping is kept if the binding records are used in place). The
+ * first journal segment not included in the snapshot is returned in
+ * segment. If the pool configuration has changed, the leases are
+ * passed to the restore function instead.
+ *
+ * Return 0 on success, -1 if there is no valid snapshot.
+ */
+
+int
+load_snapshot (char *path, address_pool *pool, uint64_t *segment,
+	       journal_restore restore, void *arg)
+{
+    snapshot_header hdr;
+    snapshot_list *table;
+    list_loader *loaders;
+    binding_list *lists;
+    struct stat st;
+    uint8_t *map;
+    unsigned int i;
+    int fd;
+
+    *segment = 0;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+	if (errno != ENOENT)
+	    log_error("Snapshot: can not open %s: %s", path, strerror(errno));
+	return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(hdr)) {
+	log_error("Snapshot: %s is truncated", path);
+	close(fd);
+	return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+	log_error("Snapshot: can not map %s: %s", path, strerror(errno));
+	return -1;
+    }
+
+    memcpy(&hdr, map, sizeof(hdr));
+    table = (snapshot_list *) (map + sizeof(hdr));
+
+    if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION ||
+	hdr.size != (uint64_t) st.st_size ||
+	sizeof(hdr) + (uint64_t) hdr.nlists * sizeof(snapshot_list) > hdr.size ||
+	hdr.check != header_check(&hdr, table)) {
+	log_error("Snapshot: %s is not valid or truncated", path);
+	munmap(map, st.st_size);
+	return -1;
+    }
+
+    loaders = calloc(hdr.nlists, sizeof(list_loader));
+
+    for (i = 0; i < hdr.nlists; i++) {
+	if (table[i].offset > hdr.size || table[i].size > hdr.size - table[i].offset) {
+	    log_error("Snapshot: %s is not valid", path);
+	    goto error;
+	}
+
+	loaders[i].image = map + table[i].offset;
+	loaders[i].size  = table[i].size;
+	loaders[i].check = table[i].check;
+    }
+
+    if (run_loaders(loaders, hdr.nlists, pool->nshards, verify_list) == -1) {
+	log_error("Snapshot: %s is damaged", path);
+	goto error;
+    }
+
+    if (hdr.config == pool_config(pool)) {
+
+	// the lists are loaded aside, and replace the ones of the pool if all are valid
+
+	lists = calloc(hdr.nlists, sizeof(binding_list));
+
+	for (i = 0; i < hdr.nlists; i++) {
+	    init_binding_list(&lists[i]);
+	    loaders[i].list = &lists[i];
+	}
+
+	if (run_loaders(loaders, hdr.nlists, pool->nshards, load_list) == -1) {
+	    log_error("Snapshot: %s is not valid", path);
+
+	    for (i = 0; i < hdr.nlists; i++)
+		delete_binding_list(&lists[i]);
+
+	    free(lists);
+	    goto error;
+	}
+
+	for (i = 0; i < hdr.nlists; i++) {
+	    binding_list *list = &pool->shards[i / pool->config->nsubnets].bindings[i % pool->config->nsubnets];
+
+	    delete_binding_list(list);
+	    *list = lists[i];
+	}
+
+	free(lists);
+
+    } else {
+
+	log_info("Snapshot: pool configuration changed, restoring the leases of %s",
+		 path);
+
+	for (i = 0; i < hdr.nlists; i++)
+	    restore_list(&loaders[i], restore, arg);
+
+	munmap(map, st.st_size); // no list refers to it
+    }
+
+    *segment = hdr.segment;
+    free(loaders);
+
+    return 0;
+
+ error:
+    free(loaders);
+    munmap(map, st.st_size);
+    return -1;
+}
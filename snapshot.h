@@ -0,0 +1,62 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "dhcpserver.h"
+#include "journal.h"
+
+/*
+ * Snapshot of the bindings of the pool, saved at every checkpoint
+ * of the lease journal.
+ *
+ * The file has a header, a table of the binding lists and the image
+ * of every binding list (see save_binding_list), one for every subnet
+ * of every shard, with a checksum of the header and of every image.
+ * It is written to a temporary file and renamed, so it is replaced
+ * atomically.
+ *
+ * On start the file is mapped in memory (privately) and the lists are
+ * loaded in parallel: the binding records are used in place, the
+ * indexes are copied. If the configuration of the pool has changed
+ * (subnets, ranges, number of shards or static bindings) the leases
+ * of the snapshot are restored one by one instead.
+ */
+
+enum {
+    SNAPSHOT_MAGIC   = 0x4e534844, // "DHSN"
+    SNAPSHOT_VERSION = 2,
+    SNAPSHOT_BUFFER  = 1 << 16 // bytes written at a time
+};
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;    // bytes of the file
+    uint64_t config;  // hash of the pool configuration
+    uint64_t segment; // first journal segment not included
+    uint32_t nlists;  // binding lists (shards times subnets)
+    uint32_t reserved;
+    uint64_t check;   // checksum of the header and of the list table
+};
+
+typedef struct snapshot_header snapshot_header;
+
+struct snapshot_list {
+    uint64_t offset; // image of the binding list
+    uint64_t size;
+    uint64_t check;  // checksum of the image
+};
+
+typedef struct snapshot_list snapshot_list;
+
+/*
+ * Prototypes
+ */
+
+ssize_t write_snapshot (char *path, address_pool *pool, uint64_t segment);
+int load_snapshot (char *path, address_pool *pool, uint64_t *segment,
+		   journal_restore restore, void *arg);
+
+#endif
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "xdp.h"
+#include "packet.h"
+#include "logging.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define INSN(code, dst, src, off, imm) { (code), (dst), (src), (off), (imm) }
+
+static int
+sys_bpf (int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Attach (or detach, if fd is -1) an XDP program to a device.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+static int
+set_link_xdp (int ifindex, int fd, uint32_t flags)
+{
+    struct {
+	struct nlmsghdr nh;
+	struct ifinfomsg ifi;
+	uint8_t attrs[64];
+    } req;
+
+    struct sockaddr_nl sa;
+    struct rtattr *xdp, *rta;
+    uint8_t buf[1024];
+    int nl, ret = -1;
+    ssize_t len;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nh.nlmsg_type  = RTM_SETLINK;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index  = ifindex;
+
+    xdp = (struct rtattr *) ((uint8_t *) &req + NLMSG_ALIGN(req.nh.nlmsg_len));
+    xdp->rta_type = IFLA_XDP | NLA_F_NESTED;
+    xdp->rta_len  = RTA_LENGTH(0);
+
+    rta = (struct rtattr *) ((uint8_t *) xdp + xdp->rta_len);
+    rta->rta_type = IFLA_XDP_FD;
+    rta->rta_len  = RTA_LENGTH(sizeof(int));
+    memcpy(RTA_DATA(rta), &fd, sizeof(int));
+    xdp->rta_len += RTA_ALIGN(rta->rta_len);
+
+    rta = (struct rtattr *) ((uint8_t *) xdp + xdp->rta_len);
+    rta->rta_type = IFLA_XDP_FLAGS;
+    rta->rta_len  = RTA_LENGTH(sizeof(uint32_t));
+    memcpy(RTA_DATA(rta), &flags, sizeof(uint32_t));
+    xdp->rta_len += RTA_ALIGN(rta->rta_len);
+
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + xdp->rta_len;
+
+    if ((nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) == -1)
+	return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+
+    if (sendto(nl, &req, req.nh.nlmsg_len, 0, (struct sockaddr *) &sa, sizeof(sa)) == -1)
+	goto out;
+
+    if ((len = recv(nl, buf, sizeof(buf), 0)) > 0) {
+	struct nlmsghdr *nh = (struct nlmsghdr *) buf;
+
+	if (NLMSG_OK(nh, len) && nh->nlmsg_type == NLMSG_ERROR) {
+	    struct nlmsgerr *err = NLMSG_DATA(nh);
+
+	    errno = -err->error;
+	    ret = err->error == 0 ? 0 : -1;
+	}
+    }
+
+ out:
+    close(nl);
+    return ret;
+}
+
+/*
+ * Load the XDP program, and attach it to a device: the UDP datagrams
+ * to port 67 (IPv4 without options, not fragmented) are redirected
+ * to the socket of their receive queue in the map, or passed to the
+ * kernel if the queue has no socket. The fragments are passed to the
+ * kernel, which reassembles them.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+attach_xdp_program (xdp_program *prog, char *device, int mode, unsigned int queues)
+{
+    union bpf_attr attr;
+    char log[4096];
+
+    memset(prog, 0, sizeof(*prog));
+    prog->prog_fd = prog->map_fd = -1;
+
+    prog->flags = XDP_FLAGS_UPDATE_IF_NOEXIST |
+	(mode == XDP_MODE_NATIVE ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE);
+
+    if ((prog->ifindex = if_nametoindex(device)) == 0)
+	return -1;
+
+    /* map of the sockets, indexed by receive queue */
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size    = sizeof(uint32_t);
+    attr.value_size  = sizeof(uint32_t);
+    attr.max_entries = queues;
+
+    if ((prog->map_fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1)
+	return -1;
+
+    /* program: r1 = ctx, r2 = data, r3 = data_end */
+
+    struct bpf_insn code[] = {
+	INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),   // r6 = ctx
+	INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 1, 0, 0),     // r2 = ctx->data
+	INSN(BPF_LDX | BPF_W | BPF_MEM, 3, 1, 4, 0),     // r3 = ctx->data_end
+	INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),   // r4 = r2 + headers
+	INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 42),
+	INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 16, 0),    // too short: pass
+	INSN(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 12, 0),    // ethernet type
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 14, htons(ETHERTYPE_IP)),
+	INSN(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14, 0),    // IP version and header len
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 12, 0x45),
+	INSN(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 23, 0),    // IP protocol
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 10, IPPROTO_UDP),
+	INSN(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 20, 0),    // IP fragment offset and flags
+	INSN(BPF_JMP | BPF_JSET | BPF_K, 5, 0, 8, htons(IP_MF | IP_OFFMASK)), // a fragment: pass
+	INSN(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 36, 0),    // UDP destination port
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, 6, htons(67)),
+	INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 6, 16, 0),    // r2 = ctx->rx_queue_index
+	INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, prog->map_fd),
+	INSN(0, 0, 0, 0, 0),
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS), // if no socket
+	INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+	INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS), // pass:
+	INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns     = (uint64_t) (unsigned long) code;
+    attr.insn_cnt  = sizeof(code) / sizeof(code[0]);
+    attr.license   = (uint64_t) (unsigned long) "GPL";
+    attr.log_buf   = (uint64_t) (unsigned long) log;
+    attr.log_size  = sizeof(log);
+    attr.log_level = 1;
+
+    if ((prog->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr)) == -1) {
+	fprintf(stderr, "%s", log);
+	goto error;
+    }
+
+    if (set_link_xdp(prog->ifindex, prog->prog_fd, prog->flags) == -1)
+	goto error;
+
+    return 0;
+
+ error:
+    close(prog->map_fd);
+    if (prog->prog_fd != -1)
+	close(prog->prog_fd);
+    prog->prog_fd = prog->map_fd = -1;
+    return -1;
+}
+
+/*
+ * Detach the XDP program from its device.
+ */
+
+void
+detach_xdp_program (xdp_program *prog)
+{
+    if (prog->prog_fd == -1)
+	return;
+
+    if (set_link_xdp(prog->ifindex, -1, prog->flags & ~XDP_FLAGS_UPDATE_IF_NOEXIST) == -1)
+	perror("can not detach the XDP program");
+
+    close(prog->prog_fd);
+    close(prog->map_fd);
+    prog->prog_fd = prog->map_fd = -1;
+}
+
+/*
+ * Map a ring of the socket.
+ */
+
+static int
+map_ring (xdp_socket *xs, xsk_ring *ring, struct xdp_ring_offset *off,
+	  size_t desc_size, off_t pgoff)
+{
+    ring->map_size = off->desc + XSK_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, xs->fd, pgoff);
+
+    if (ring->map == MAP_FAILED)
+	return -1;
+
+    ring->producer = (uint32_t *) ((uint8_t *) ring->map + off->producer);
+    ring->consumer = (uint32_t *) ((uint8_t *) ring->map + off->consumer);
+    ring->flags    = (uint32_t *) ((uint8_t *) ring->map + off->flags);
+    ring->desc     = (uint8_t *) ring->map + off->desc;
+
+    return 0;
+}
+
+/*
+ * Open the AF_XDP socket of a receive queue of the device, and add
+ * it to the map of the program, to send replies from the given address.
+ *
+ * Return 0 on success, -1 on error.
+ */
+
+int
+init_xdp_socket (xdp_socket *xs, xdp_program *prog, char *device,
+		 unsigned int queue, uint32_t address)
+{
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    union bpf_attr attr;
+    socklen_t optlen = sizeof(off);
+    int size = XSK_RING_SIZE;
+    int fd;
+    unsigned int i;
+
+    memset(xs, 0, sizeof(*xs));
+    xs->fd = -1;
+    xs->address = address;
+
+    if (device_mac(device, xs->mac) == -1)
+	return -1;
+
+    xs->umem = mmap(NULL, XSK_FRAMES * XSK_FRAME_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (xs->umem == MAP_FAILED)
+	return -1;
+
+    if ((fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) == -1)
+	goto error;
+
+    xs->fd = fd;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t) (unsigned long) xs->umem;
+    reg.len = XSK_FRAMES * XSK_FRAME_SIZE;
+    reg.chunk_size = XSK_FRAME_SIZE;
+
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1 ||
+	setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+	setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+	setsockopt(fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+	setsockopt(fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1 ||
+	getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1)
+	goto error;
+
+    if (map_ring(xs, &xs->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+	map_ring(xs, &xs->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1 ||
+	map_ring(xs, &xs->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+	map_ring(xs, &xs->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1)
+	goto error;
+
+    /* the first half of the frames is used to receive */
+
+    uint64_t *fill = xs->fill.desc;
+
+    for (i = 0; i < XSK_FRAMES / 2 && i < XSK_RING_SIZE; i++)
+	fill[i] = (uint64_t) i * XSK_FRAME_SIZE;
+
+    __atomic_store_n(xs->fill.producer, i, __ATOMIC_RELEASE);
+
+    for (i = 0; i < XSK_FRAMES / 2; i++)
+	xs->free[i] = (uint64_t) (XSK_FRAMES / 2 + i) * XSK_FRAME_SIZE;
+
+    xs->nfree = XSK_FRAMES / 2;
+
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family   = AF_XDP;
+    sxdp.sxdp_ifindex  = prog->ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags    = (prog->flags & XDP_FLAGS_SKB_MODE) ? XDP_COPY : 0;
+
+    if (bind(fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) == -1)
+	goto error;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = prog->map_fd;
+    attr.key    = (uint64_t) (unsigned long) &queue;
+    attr.value  = (uint64_t) (unsigned long) &fd;
+
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+	goto error;
+
+    return 0;
+
+ error:
+    if (xs->fd != -1)
+	close(xs->fd);
+    munmap(xs->umem, XSK_FRAMES * XSK_FRAME_SIZE);
+    xs->fd = -1;
+    return -1;
+}
+
+/*
+ * Get the frames received, up to max: the frames stay in the rx
+ * ring until they are released.
+ *
+ * Return the number of frames received.
+ */
+
+unsigned int
+receive_xdp_packets (xdp_socket *xs, xdp_packet *pkts, unsigned int max)
+{
+    struct xdp_desc *desc = xs->rx.desc;
+    uint32_t cons = *xs->rx.consumer;
+    uint32_t prod = __atomic_load_n(xs->rx.producer, __ATOMIC_ACQUIRE);
+    unsigned int i, n = prod - cons;
+
+    if (n > max)
+	n = max;
+
+    for (i = 0; i < n; i++) {
+	struct xdp_desc *d = &desc[(cons + i) & (XSK_RING_SIZE - 1)];
+
+	pkts[i].frame = xs->umem + d->addr;
+	pkts[i].len = d->len;
+    }
+
+    return n;
+}
+
+/*
+ * Release the first n frames received, giving them back to the
+ * kernel through the fill ring.
+ */
+
+void
+release_xdp_packets (xdp_socket *xs, unsigned int n)
+{
+    struct xdp_desc *desc = xs->rx.desc;
+    uint64_t *fill = xs->fill.desc;
+    uint32_t cons = *xs->rx.consumer;
+    uint32_t prod = *xs->fill.producer;
+    unsigned int i;
+
+    // the fill ring has room for every receive frame
+    for (i = 0; i < n; i++) {
+	uint64_t addr = desc[(cons + i) & (XSK_RING_SIZE - 1)].addr;
+	fill[(prod + i) & (XSK_RING_SIZE - 1)] = addr - addr % XSK_FRAME_SIZE;
+    }
+
+    __atomic_store_n(xs->rx.consumer, cons + n, __ATOMIC_RELEASE);
+    __atomic_store_n(xs->fill.producer, prod + n, __ATOMIC_RELEASE);
+}
+
+/*
+ * Get back the transmit frames already sent.
+ */
+
+static void
+complete_xdp_packets (xdp_socket *xs)
+{
+    uint64_t *comp = xs->comp.desc;
+    uint32_t cons = *xs->comp.consumer;
+    uint32_t prod = __atomic_load_n(xs->comp.producer, __ATOMIC_ACQUIRE);
+
+    for (; cons != prod; cons++)
+	xs->free[xs->nfree++] = comp[cons & (XSK_RING_SIZE - 1)];
+
+    __atomic_store_n(xs->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/*
+ * Queue a frame for transmission, built in place in the UMEM.
+ *
+ * Return 0 on success, -1 if there is no free frame.
+ */
+
+int
+queue_xdp_packet (xdp_socket *xs, uint8_t *mac, uint32_t address,
+		  void *payload, size_t len)
+{
+    struct xdp_desc *desc = xs->tx.desc;
+    uint32_t prod = *xs->tx.producer;
+    uint64_t addr;
+
+    if (xs->fd == -1)
+	return -1;
+
+    if (xs->nfree == 0)
+	complete_xdp_packets(xs);
+
+    if (xs->nfree == 0) {
+	flush_xdp_packets(xs); // the kernel is late: kick it
+	complete_xdp_packets(xs);
+
+	if (xs->nfree == 0)
+	    return -1;
+    }
+
+    addr = xs->free[--xs->nfree];
+
+    desc[prod & (XSK_RING_SIZE - 1)].addr = addr;
+    desc[prod & (XSK_RING_SIZE - 1)].len =
+	build_frame(xs->umem + addr, xs->mac, xs->address, mac, address, payload, len);
+    desc[prod & (XSK_RING_SIZE - 1)].options = 0;
+
+    __atomic_store_n(xs->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    xs->queued++;
+
+    return 0;
+}
+
+/*
+ * Send the queued frames.
+ */
+
+void
+flush_xdp_packets (xdp_socket *xs)
+{
+    if (xs->fd == -1 || xs->queued == 0)
+	return;
+
+    if (sendto(xs->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 &&
+	errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+	log_event(EV_SEND_ERROR, NULL, 0, errno);
+
+    xs->queued = 0;
+
+    complete_xdp_packets(xs);
+}
@@ -0,0 +1,95 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <linux/if_xdp.h>
+
+/*
+ * AF_XDP backend: a small XDP program attached to the device
+ * redirects the UDP datagrams to port 67 into the AF_XDP socket
+ * of the receive queue, and passes every other frame to the kernel.
+ *
+ * Every socket has its own UMEM: half of the frames are used to
+ * receive (they go back and forth through the fill and rx rings),
+ * half to transmit (through the tx and completion rings).
+ */
+
+// XDP modes
+enum {
+    XDP_MODE_NONE = 0,
+    XDP_MODE_SKB,   // generic mode, works on every device
+    XDP_MODE_NATIVE // driver mode
+};
+
+enum {
+    XSK_FRAME_SIZE = 2048,
+    XSK_FRAMES     = 4096, // frames of the UMEM
+    XSK_RING_SIZE  = 2048  // descriptors of every ring
+};
+
+struct xdp_program {
+    int ifindex;    // device of the program
+    int prog_fd;    // XDP program
+    int map_fd;     // sockets of the receive queues
+    uint32_t flags; // attach flags
+};
+
+typedef struct xdp_program xdp_program;
+
+struct xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *desc; // struct xdp_desc (rx, tx) or uint64_t (fill, completion)
+    void *map;  // mapping of the ring
+    size_t map_size;
+};
+
+typedef struct xsk_ring xsk_ring;
+
+struct xdp_socket {
+    int fd;           // AF_XDP socket, -1 if not used
+    uint8_t mac[6];   // source hardware address
+    uint32_t address; // source address
+
+    uint8_t *umem;
+    xsk_ring rx, tx, fill, comp;
+
+    uint64_t free[XSK_FRAMES / 2]; // free transmit frames
+    unsigned int nfree;
+    unsigned int queued; // transmit frames queued since the last flush
+};
+
+typedef struct xdp_socket xdp_socket;
+
+/*
+ * A frame received, in the UMEM.
+ */
+
+struct xdp_packet {
+    uint8_t *frame;
+    uint32_t len;
+};
+
+typedef struct xdp_packet xdp_packet;
+
+/*
+ * Prototypes
+ */
+
+int attach_xdp_program (xdp_program *prog, char *device, int mode, unsigned int queues);
+void detach_xdp_program (xdp_program *prog);
+
+int init_xdp_socket (xdp_socket *xs, xdp_program *prog, char *device,
+		     unsigned int queue, uint32_t address);
+
+unsigned int receive_xdp_packets (xdp_socket *xs, xdp_packet *pkts, unsigned int max);
+void release_xdp_packets (xdp_socket *xs, unsigned int n);
+
+int queue_xdp_packet (xdp_socket *xs, uint8_t *mac, uint32_t address,
+		      void *payload, size_t len);
+void flush_xdp_packets (xdp_socket *xs);
+
+#endif